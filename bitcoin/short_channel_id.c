@@ -26,6 +26,19 @@ char *short_channel_id_to_str(const tal_t *ctx, const struct short_channel_id *s
 	return tal_fmt(ctx, "%d:%d:%d", scid->blocknum, scid->txnum, scid->outnum);
 }
 
+u64 short_channel_id_to_uint(const struct short_channel_id *scid)
+{
+	return ((u64)scid->blocknum << 40) | ((u64)scid->txnum << 16)
+		| scid->outnum;
+}
+
+void short_channel_id_from_uint(struct short_channel_id *scid, u64 id)
+{
+	scid->blocknum = id >> 40;
+	scid->txnum = (id >> 16) & 0xFFFFFF;
+	scid->outnum = id & 0xFFFF;
+}
+
 bool short_channel_id_eq(const struct short_channel_id *a,
 			 const struct short_channel_id *b)
 {
@@ -25,4 +25,8 @@ bool short_channel_id_eq(const struct short_channel_id *a,
 
 char *short_channel_id_to_str(const tal_t *ctx, const struct short_channel_id *scid);
 
+/* Packs it into a u64, in the same order as on the wire: handy as a key. */
+u64 short_channel_id_to_uint(const struct short_channel_id *scid);
+void short_channel_id_from_uint(struct short_channel_id *scid, u64 id);
+
 #endif /* LIGHTNING_BITCOIN_SHORT_CHANNEL_ID_H */
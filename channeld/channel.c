@@ -296,7 +296,7 @@ static void send_temporary_announcement(struct peer *peer)
 	    tmpctx, &peer->short_channel_ids[LOCAL], &peer->chain_hash,
 	    &peer->node_ids[REMOTE], 0 /* flags */, peer->cltv_delta,
 	    peer->conf[REMOTE].htlc_minimum_msat, peer->fee_base,
-	    peer->fee_per_satoshi);
+	    peer->fee_per_satoshi, peer->channel->funding_msat / 1000);
 	wire_sync_write(GOSSIP_FD, take(msg));
 
 	tal_free(tmpctx);
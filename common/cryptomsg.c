@@ -378,6 +378,63 @@ struct io_plan *peer_write_message(struct io_conn *conn,
 	return io_write(conn, pcs->out, tal_count(pcs->out), post, pcs);
 }
 
+struct io_plan *peer_write_messages(struct io_conn *conn,
+				    struct peer_crypto_state *pcs,
+				    const u8 **msgs, size_t num,
+				    struct io_plan *(*next)(struct io_conn *,
+							    struct peer *))
+{
+	struct io_plan *(*post)(struct io_conn *, struct peer_crypto_state *);
+	size_t i, len = 0;
+
+	assert(!pcs->out);
+	assert(num > 0);
+
+	/* Each message grows by the 18-byte header and 16-byte MAC. */
+	for (i = 0; i < num; i++)
+		len += 18 + tal_count(msgs[i]) + 16;
+	pcs->out = tal_arr(conn, u8, len);
+	pcs->next_out = next;
+
+	post = peer_write_done;
+
+	len = 0;
+	for (i = 0; i < num; i++) {
+		u8 *enc = cryptomsg_encrypt_msg(pcs->out, &pcs->cs, msgs[i]);
+		size_t enclen = tal_count(enc);
+#if DEVELOPER
+		int type = fromwire_peektype(msgs[i]);
+#endif
+
+		memcpy(pcs->out + len, enc, enclen);
+		len += enclen;
+		tal_free(enc);
+
+#if DEVELOPER
+		/* Nothing after a sabotaged message would reach the peer
+		 * anyway, so the batch simply ends there. */
+		switch (dev_disconnect(type)) {
+		case DEV_DISCONNECT_NORMAL:
+			continue;
+		case DEV_DISCONNECT_BEFORE:
+		case DEV_DISCONNECT_DROPPKT:
+			len -= enclen;
+			/* FALL THRU */
+		case DEV_DISCONNECT_AFTER:
+			post = peer_write_postclose;
+			break;
+		case DEV_DISCONNECT_BLACKHOLE:
+			dev_blackhole_fd(io_conn_fd(conn));
+			break;
+		}
+		break;
+#endif /* DEVELOPER */
+	}
+	tal_resize(&pcs->out, len);
+
+	return io_write(conn, pcs->out, len, post, pcs);
+}
+
 /* We write in one op, so it's all or nothing. */
 bool peer_out_started(const struct io_conn *conn,
 		      const struct peer_crypto_state *cs)
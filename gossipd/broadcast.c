@@ -1,55 +1,164 @@
+#include <assert.h>
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/take/take.h>
+#include <common/pseudorand.h>
 #include <gossipd/broadcast.h>
 
+/* The payload's tal parent: tal has no refcounting of its own. */
+struct payload_refs {
+	size_t refs;
+};
+
+const u8 *new_shared_payload(const u8 *payload TAKES)
+{
+	struct payload_refs *pr = tal(NULL, struct payload_refs);
+
+	pr->refs = 1;
+	return tal_dup_arr(pr, u8, payload, tal_len(payload), 0);
+}
+
+const u8 *shared_payload_ref(const u8 *payload)
+{
+	struct payload_refs *pr = tal_parent(payload);
+
+	pr->refs++;
+	return payload;
+}
+
+void shared_payload_unref(const u8 *payload)
+{
+	struct payload_refs *pr;
+
+	if (!payload)
+		return;
+
+	pr = tal_parent(payload);
+	assert(pr->refs);
+	if (--pr->refs == 0)
+		tal_free(pr);
+}
+
+const struct broadcast_key *broadcast_map_keyof(const struct queued_message *msg)
+{
+	return &msg->key;
+}
+
+size_t broadcast_map_hash_key(const struct broadcast_key *key)
+{
+	struct siphash24_ctx ctx;
+
+	/* Field-wise, so struct padding doesn't get hashed. */
+	siphash24_init(&ctx, siphash_seed());
+	siphash24_u32(&ctx, key->type);
+	siphash24_update(&ctx, key->tag, sizeof(key->tag));
+	return siphash24_done(&ctx);
+}
+
+bool broadcast_map_eq(const struct queued_message *msg,
+		      const struct broadcast_key *key)
+{
+	return msg->key.type == key->type
+		&& memcmp(msg->key.tag, key->tag, sizeof(key->tag)) == 0;
+}
+
+static void destroy_broadcast_state(struct broadcast_state *bstate)
+{
+	broadcast_map_clear(&bstate->by_key);
+}
+
 struct broadcast_state *new_broadcast_state(tal_t *ctx)
 {
 	struct broadcast_state *bstate = tal(ctx, struct broadcast_state);
 	uintmap_init(&bstate->broadcasts);
+	broadcast_map_init(&bstate->by_key);
+	tal_add_destructor(bstate, destroy_broadcast_state);
 	/* Skip 0 because we initialize peers with 0 */
 	bstate->next_index = 1;
+	bstate->pruned_index = 0;
 	return bstate;
 }
 
+static void destroy_queued_message(struct queued_message *msg)
+{
+	shared_payload_unref(msg->payload);
+}
+
 static struct queued_message *new_queued_message(tal_t *ctx,
-						 const int type,
-						 const u8 *tag,
+						 const struct broadcast_key *key,
+						 u64 index,
 						 const u8 *payload)
 {
 	struct queued_message *msg = tal(ctx, struct queued_message);
-	msg->type = type;
-	msg->tag = tal_dup_arr(msg, u8, tag, tal_count(tag), 0);
-	msg->payload = tal_dup_arr(msg, u8, payload, tal_count(payload), 0);
+	msg->key = *key;
+	msg->index = index;
+	msg->payload = payload ? shared_payload_ref(payload) : NULL;
+	tal_add_destructor(msg, destroy_queued_message);
 	return msg;
 }
 
+bool broadcast_del(struct broadcast_state *bstate,
+		   const struct broadcast_key *key)
+{
+	struct queued_message *msg = broadcast_map_get(&bstate->by_key, key);
+	bool evicted;
+
+	if (!msg)
+		return false;
+
+	evicted = (msg->payload != NULL);
+	uintmap_del(&bstate->broadcasts, msg->index);
+	broadcast_map_del(&bstate->by_key, msg);
+	tal_free(msg);
+	return evicted;
+}
+
 bool queue_broadcast(struct broadcast_state *bstate,
-		     const int type,
-		     const u8 *tag,
+		     const struct broadcast_key *key,
 		     const u8 *payload)
 {
 	struct queued_message *msg;
-	u64 index;
-	bool evicted = false;
-
-	/* Remove any tag&type collisions */
-	for (msg = uintmap_first(&bstate->broadcasts, &index);
-	     msg;
-	     msg = uintmap_after(&bstate->broadcasts, &index)) {
-		if (msg->type == type && memcmp(msg->tag, tag, tal_count(tag)) == 0) {
-			uintmap_del(&bstate->broadcasts, index);
-			tal_free(msg);
-			evicted = true;
-			break;
-		}
-	}
+	bool evicted;
+
+	/* Remove any key collision */
+	evicted = broadcast_del(bstate, key);
 
 	/* Now add the message to the queue */
-	msg = new_queued_message(bstate, type, tag, payload);
-	uintmap_add(&bstate->broadcasts, bstate->next_index, msg);
+	msg = new_queued_message(bstate, key, bstate->next_index, payload);
+	uintmap_add(&bstate->broadcasts, msg->index, msg);
+	broadcast_map_add(&bstate->by_key, msg);
 	bstate->next_index += 1;
 	return evicted;
 }
 
-struct queued_message *next_broadcast_message(struct broadcast_state *bstate, u64 last_index)
+void broadcast_prune_tombstones(struct broadcast_state *bstate, u64 max_index)
+{
+	struct queued_message *msg;
+	u64 index = 0;
+
+	while ((msg = uintmap_after(&bstate->broadcasts, &index)) != NULL
+	       && index <= max_index) {
+		if (msg->payload)
+			continue;
+		uintmap_del(&bstate->broadcasts, index);
+		broadcast_map_del(&bstate->by_key, msg);
+		tal_free(msg);
+		bstate->pruned_index = index;
+	}
+}
+
+struct queued_message *next_broadcast_change(struct broadcast_state *bstate,
+					     u64 last_index)
 {
 	return uintmap_after(&bstate->broadcasts, &last_index);
 }
+
+struct queued_message *next_broadcast_message(struct broadcast_state *bstate, u64 last_index)
+{
+	struct queued_message *msg;
+
+	while ((msg = uintmap_after(&bstate->broadcasts, &last_index)) != NULL) {
+		if (msg->payload)
+			return msg;
+	}
+	return NULL;
+}
@@ -2,6 +2,8 @@
 #define LIGHTNING_LIGHTNINGD_GOSSIP_BROADCAST_H
 #include "config.h"
 
+#include <bitcoin/pubkey.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/intmap/intmap.h>
 #include <ccan/list/list.h>
 #include <ccan/short_types/short_types.h>
@@ -9,33 +11,82 @@
 
 /* Common functionality to implement staggered broadcasts with replacement. */
 
-struct queued_message {
+/* Big enough for a node_id, or a short_channel_id and direction. */
+#define BROADCAST_TAG_LEN PUBKEY_DER_LEN
+
+/* A newer message with the same key replaces an older one. */
+struct broadcast_key {
 	int type;
 
-	/* Unique tag specifying the msg origin */
-	void *tag;
+	/* Unique tag specifying the msg origin (zero-padded) */
+	u8 tag[BROADCAST_TAG_LEN];
+};
 
-	/* Serialized payload */
-	u8 *payload;
+struct queued_message {
+	struct broadcast_key key;
+
+	/* Where we are in broadcast_state->broadcasts */
+	u64 index;
+
+	/* Serialized payload (shared: see new_shared_payload), or NULL if
+	 * this is a tombstone for gossip which has been removed. */
+	const u8 *payload;
 };
 
+const struct broadcast_key *broadcast_map_keyof(const struct queued_message *msg);
+size_t broadcast_map_hash_key(const struct broadcast_key *key);
+bool broadcast_map_eq(const struct queued_message *msg,
+		      const struct broadcast_key *key);
+HTABLE_DEFINE_TYPE(struct queued_message, broadcast_map_keyof, broadcast_map_hash_key, broadcast_map_eq, broadcast_map);
+
 struct broadcast_state {
-u32 next_index;
-UINTMAP(struct queued_message *) broadcasts;
+	u32 next_index;
+	UINTMAP(struct queued_message *) broadcasts;
+
+	/* The same messages, by key, so we can find what to replace. */
+	struct broadcast_map by_key;
+
+	/* Tombstones up to here have been pruned: a reader which last saw
+	 * an earlier index may have missed a removal. */
+	u64 pruned_index;
 };
 
 struct broadcast_state *new_broadcast_state(tal_t *ctx);
 
+/* Gossip we accept is immutable, and held by the broadcast queue and the
+ * routing state's caches at once: rather than each having a copy, they
+ * share one, which is freed when the last holder unrefs it. */
+const u8 *new_shared_payload(const u8 *payload TAKES);
+const u8 *shared_payload_ref(const u8 *payload);
+/* Does nothing if payload is NULL. */
+void shared_payload_unref(const u8 *payload);
+
 /* Queue a new message to be broadcast and replace any outdated
- * broadcast. Replacement is done by comparing the `type` and the
- * `tag`, if both match the old message is dropped from the queue. The
- * new message is added to the top of the broadcast queue. Returns
- * true if a previous entry with the same tag has been evicted. */
+ * broadcast. Replacement is done by comparing the `key`: if it
+ * matches the old message is dropped from the queue. The new message
+ * is added to the top of the broadcast queue, taking a reference to
+ * payload (from new_shared_payload). Returns true if a previous entry
+ * (other than a tombstone) with the same key has been evicted.
+ *
+ * A NULL payload queues a tombstone: nothing is sent for it, but it
+ * records where in the queue the gossip for `key` went away. */
 bool queue_broadcast(struct broadcast_state *bstate,
-			     const int type,
-			     const u8 *tag,
-			     const u8 *payload);
+		     const struct broadcast_key *key,
+		     const u8 *payload);
 
+/* Drop any queued message with this key, without a tombstone.  Returns
+ * true if there was one (other than a tombstone). */
+bool broadcast_del(struct broadcast_state *bstate,
+		   const struct broadcast_key *key);
+
+/* Drop tombstones with index <= max_index. */
+void broadcast_prune_tombstones(struct broadcast_state *bstate, u64 max_index);
+
+/* The next message to send after last_index, skipping tombstones. */
 struct queued_message *next_broadcast_message(struct broadcast_state *bstate, u64 last_index);
 
+/* The next entry after last_index, including tombstones. */
+struct queued_message *next_broadcast_change(struct broadcast_state *bstate,
+					     u64 last_index);
+
 #endif /* LIGHTNING_LIGHTNINGD_GOSSIP_BROADCAST_H */
@@ -1,3 +1,4 @@
+#include <ccan/asort/asort.h>
 #include <ccan/build_assert/build_assert.h>
 #include <ccan/container_of/container_of.h>
 #include <ccan/crypto/hkdf_sha256/hkdf_sha256.h>
@@ -29,6 +30,7 @@
 #include <fcntl.h>
 #include <gossipd/broadcast.h>
 #include <gossipd/gen_gossip_wire.h>
+#include <gossipd/gossip_store.h>
 #include <gossipd/handshake.h>
 #include <gossipd/routing.h>
 #include <hsmd/client.h>
@@ -43,12 +45,25 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <wire/gen_onion_wire.h>
 #include <wire/gen_peer_wire.h>
 #include <wire/wire_io.h>
 #include <wire/wire_sync.h>
 
 #define HSM_FD 3
 
+/* How many gossip messages we check signatures for at once. */
+#define GOSSIP_SIGCHECK_BATCH 128
+
+/* Most broadcast messages we encrypt into a single write to a peer. */
+#define GOSSIP_FLUSH_BATCH 64
+
+/* How often we rewrite the gossip_store without superseded messages. */
+#define GOSSIP_STORE_COMPACT_INTERVAL_SECS (60 * 60)
+
+/* How long a getroute request waits for others to search alongside. */
+#define ROUTE_BATCH_MSEC 1
+
 struct daemon {
 	/* Who am I? */
 	struct pubkey id;
@@ -81,6 +96,29 @@ struct daemon {
 
 	/* To make sure our node_announcement timestamps increase */
 	u32 last_announce_timestamp;
+
+	/* Gossip from peers waiting for its signatures to be checked, in
+	 * the order it arrived. */
+	u8 **gossip_in;
+
+	/* Have we a timer set to process gossip_in? */
+	bool gossip_in_scheduled;
+
+	/* getroute requests waiting to be answered together, in the order
+	 * they arrived (which is the order master expects replies). */
+	u8 **route_reqs;
+
+	/* Have we a timer set to answer route_reqs? */
+	bool route_reqs_scheduled;
+
+	/* Master wants to know when there's gossip after changes_after. */
+	bool changes_watched;
+	u64 changes_after;
+
+	/* Broadcast index when we last compacted: tombstones up to here are
+	 * pruned next time, so getgossipchanges readers get at least one
+	 * interval to see them. */
+	u64 tombstone_mark;
 };
 
 /* Peers we're trying to reach. */
@@ -475,6 +513,116 @@ static void handle_gossip_msg(struct daemon *daemon, u8 *msg)
 	}
 }
 
+/* Check signatures for (up to) a batch of gossip_in at once, then handle
+ * those messages in order. */
+static void process_gossip_batch(struct daemon *daemon)
+{
+	const tal_t *tmpctx = tal_tmpctx(daemon);
+	size_t i, j, n = tal_count(daemon->gossip_in), total = 0;
+	struct gossip_sig *sigs;
+	size_t *nsigs;
+	bool ok, *redundant;
+
+	if (n > GOSSIP_SIGCHECK_BATCH)
+		n = GOSSIP_SIGCHECK_BATCH;
+
+	sigs = tal_arr(tmpctx, struct gossip_sig, n * GOSSIP_MAX_SIGS);
+	nsigs = tal_arr(tmpctx, size_t, n);
+	redundant = tal_arr(tmpctx, bool, n);
+	for (i = 0; i < n; i++) {
+		/* Don't waste signature checks on repeats. */
+		redundant[i] = gossip_msg_redundant(daemon->rstate,
+						    daemon->gossip_in[i]);
+		if (redundant[i])
+			nsigs[i] = 0;
+		else
+			nsigs[i] = gossip_msg_sigs(daemon->rstate,
+						   daemon->gossip_in[i],
+						   sigs + total);
+		total += nsigs[i];
+	}
+
+	check_gossip_sigs(sigs, total);
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		const u8 *msg = daemon->gossip_in[i];
+		const struct short_channel_id *scid;
+
+		if (redundant[i])
+			continue;
+
+		/* We couldn't tell what signs it: do it the slow way. */
+		if (nsigs[i] == 0) {
+			handle_gossip_msg(daemon, daemon->gossip_in[i]);
+			continue;
+		}
+
+		ok = true;
+		for (j = 0; j < nsigs[i]; j++)
+			ok &= sigs[total + j].ok;
+		total += nsigs[i];
+
+		if (!ok) {
+			status_trace("Ignoring %s, signature verification"
+				     " failed",
+				     wire_type_name(fromwire_peektype(msg)));
+			daemon->rstate->drops.bad_signature++;
+			continue;
+		}
+
+		scid = handle_checked_gossip(daemon->rstate, msg);
+		if (scid)
+			daemon_conn_send(&daemon->master,
+					 take(towire_gossip_get_txout(daemon,
+								      scid)));
+	}
+
+	for (i = 0; i < n; i++)
+		tal_free(daemon->gossip_in[i]);
+	memmove(daemon->gossip_in, daemon->gossip_in + n,
+		(tal_count(daemon->gossip_in) - n) * sizeof(u8 *));
+	tal_resize(&daemon->gossip_in, tal_count(daemon->gossip_in) - n);
+	tal_free(tmpctx);
+}
+
+/* Handle everything in gossip_in now, eg. before something which
+ * depends on it. */
+static void flush_gossip_in(struct daemon *daemon)
+{
+	while (tal_count(daemon->gossip_in))
+		process_gossip_batch(daemon);
+}
+
+static void gossip_in_timer(struct daemon *daemon)
+{
+	daemon->gossip_in_scheduled = false;
+	process_gossip_batch(daemon);
+
+	/* Let everything else have a turn before the next batch. */
+	if (tal_count(daemon->gossip_in)) {
+		new_reltimer(&daemon->timers, daemon, time_from_msec(0),
+			     gossip_in_timer, daemon);
+		daemon->gossip_in_scheduled = true;
+	}
+}
+
+/* Peers can send gossip faster than we can check signatures: queue it up
+ * and check it in batches, without starving everything else. */
+static void queue_gossip_msg(struct daemon *daemon, const u8 *msg)
+{
+	size_t n = tal_count(daemon->gossip_in);
+
+	tal_resize(&daemon->gossip_in, n + 1);
+	daemon->gossip_in[n] = tal_dup_arr(daemon->gossip_in, u8,
+					   msg, tal_len(msg), 0);
+	if (!daemon->gossip_in_scheduled) {
+		new_reltimer(&daemon->timers, daemon, time_from_msec(0),
+			     gossip_in_timer, daemon);
+		daemon->gossip_in_scheduled = true;
+	}
+}
+
 static void handle_ping(struct peer *peer, u8 *ping)
 {
 	u8 *pong;
@@ -576,7 +724,7 @@ static struct io_plan *peer_msgin(struct io_conn *conn,
 	case WIRE_CHANNEL_ANNOUNCEMENT:
 	case WIRE_NODE_ANNOUNCEMENT:
 	case WIRE_CHANNEL_UPDATE:
-		handle_gossip_msg(peer->daemon, msg);
+		queue_gossip_msg(peer->daemon, msg);
 		return peer_next_in(conn, peer);
 
 	case WIRE_PING:
@@ -649,13 +797,6 @@ static void wake_pkt_out(struct peer *peer)
 /* Mutual recursion. */
 static struct io_plan *peer_pkt_out(struct io_conn *conn, struct peer *peer);
 
-static struct io_plan *local_gossip_broadcast_done(struct io_conn *conn,
-						   struct peer *peer)
-{
-	peer->broadcast_index++;
-	return peer_pkt_out(conn, peer);
-}
-
 static struct io_plan *peer_pkt_out(struct io_conn *conn, struct peer *peer)
 {
 	/* First priority is queued packets, if any */
@@ -679,15 +820,23 @@ static struct io_plan *peer_pkt_out(struct io_conn *conn, struct peer *peer)
 
 	/* If we're supposed to be sending gossip, do so now. */
 	if (peer->gossip_sync) {
+		const u8 *batch[GOSSIP_FLUSH_BATCH];
 		struct queued_message *next;
+		size_t num = 0;
+
+		/* Coalesce as much pending gossip as we can into one write:
+		 * during the initial dump there are thousands of these. */
+		while (num < GOSSIP_FLUSH_BATCH
+		       && (next = next_broadcast_message(
+				   peer->daemon->rstate->broadcasts,
+				   peer->broadcast_index)) != NULL) {
+			batch[num++] = next->payload;
+			peer->broadcast_index = next->index;
+		}
 
-		next = next_broadcast_message(peer->daemon->rstate->broadcasts,
-					      peer->broadcast_index);
-
-		if (next)
-			return peer_write_message(conn, &peer->local->pcs,
-						  next->payload,
-						  local_gossip_broadcast_done);
+		if (num)
+			return peer_write_messages(conn, &peer->local->pcs,
+						   batch, num, peer_pkt_out);
 
 		/* Gossip is drained.  Wait for next timer. */
 		peer->gossip_sync = false;
@@ -758,13 +907,13 @@ static void handle_local_add_channel(struct peer *peer, u8 *msg)
 	struct pubkey remote_node_id;
 	u16 flags, cltv_expiry_delta, direction;
 	u32 fee_base_msat, fee_proportional_millionths;
-	u64 htlc_minimum_msat;
+	u64 htlc_minimum_msat, satoshis;
 	struct node_connection *c;
 
 	if (!fromwire_gossip_local_add_channel(
 		msg, NULL, &scid, &chain_hash, &remote_node_id, &flags,
 		&cltv_expiry_delta, &htlc_minimum_msat, &fee_base_msat,
-		&fee_proportional_millionths)) {
+		&fee_proportional_millionths, &satoshis)) {
 		status_trace("Unable to parse local_add_channel message: %s", tal_hex(msg, msg));
 		return;
 	}
@@ -790,6 +939,8 @@ static void handle_local_add_channel(struct peer *peer, u8 *msg)
 	c->htlc_minimum_msat = htlc_minimum_msat;
 	c->base_fee = fee_base_msat;
 	c->proportional_fee = fee_proportional_millionths;
+	c->satoshis = satoshis;
+	routing_connection_changed(rstate, c);
 	status_trace("Channel %s(%d) was updated (LOCAL)",
 		     type_to_string(msg, struct short_channel_id, &scid),
 		     direction);
@@ -808,10 +959,12 @@ static struct io_plan *owner_msg_in(struct io_conn *conn,
 	int type = fromwire_peektype(msg);
 	if (type == WIRE_CHANNEL_ANNOUNCEMENT || type == WIRE_CHANNEL_UPDATE ||
 	    type == WIRE_NODE_ANNOUNCEMENT) {
-		handle_gossip_msg(peer->daemon, dc->msg_in);
+		queue_gossip_msg(peer->daemon, dc->msg_in);
 	} else if (type == WIRE_GOSSIP_GET_UPDATE) {
+		flush_gossip_in(peer->daemon);
 		handle_get_update(peer, dc->msg_in);
 	} else if (type == WIRE_GOSSIP_LOCAL_ADD_CHANNEL) {
+		flush_gossip_in(peer->daemon);
 		handle_local_add_channel(peer, dc->msg_in);
 	} else {
 		status_failed(
@@ -1030,88 +1183,487 @@ static struct io_plan *release_peer(struct io_conn *conn, struct daemon *daemon,
 	return daemon_conn_read_next(conn, &daemon->master);
 }
 
+/* Answer every queued getroute request, searching for routes in parallel. */
+static void route_reqs_timer(struct daemon *daemon)
+{
+	tal_t *tmpctx = tal_tmpctx(daemon);
+	size_t i, n = tal_count(daemon->route_reqs);
+	struct route_query *queries = tal_arr(tmpctx, struct route_query, n);
+
+	daemon->route_reqs_scheduled = false;
+	for (i = 0; i < n; i++) {
+		struct route_query *q = &queries[i];
+		u16 riskfactor;
+
+		fromwire_gossip_getroute_request(daemon->route_reqs[i], NULL,
+						 &q->source, &q->destination,
+						 &q->msatoshi, &riskfactor,
+						 &q->final_cltv);
+		q->riskfactor = 1;
+		status_trace("Trying to find a route from %s to %s for %d msatoshi",
+			     pubkey_to_hexstr(tmpctx, &q->source),
+			     pubkey_to_hexstr(tmpctx, &q->destination),
+			     q->msatoshi);
+	}
+
+	get_route_batch(tmpctx, daemon->rstate, queries, n);
+
+	for (i = 0; i < n; i++)
+		daemon_conn_send(&daemon->master,
+				 take(towire_gossip_getroute_reply(daemon,
+							   queries[i].hops)));
+
+	for (i = 0; i < n; i++)
+		tal_free(daemon->route_reqs[i]);
+	tal_resize(&daemon->route_reqs, 0);
+	tal_free(tmpctx);
+}
+
+/* Route searches can be slow on a big graph: rather than answer each as
+ * it comes, give concurrent requests a moment to arrive and search for
+ * them all at once, across CPUs. */
 static struct io_plan *getroute_req(struct io_conn *conn, struct daemon *daemon,
 				    u8 *msg)
+{
+	size_t n = tal_count(daemon->route_reqs);
+
+	tal_resize(&daemon->route_reqs, n + 1);
+	daemon->route_reqs[n] = tal_dup_arr(daemon->route_reqs, u8,
+					    msg, tal_len(msg), 0);
+	if (!daemon->route_reqs_scheduled) {
+		new_reltimer(&daemon->timers, daemon,
+			     time_from_msec(ROUTE_BATCH_MSEC),
+			     route_reqs_timer, daemon);
+		daemon->route_reqs_scheduled = true;
+	}
+	return daemon_conn_read_next(conn, &daemon->master);
+}
+
+static struct io_plan *getroutes_req(struct io_conn *conn,
+				     struct daemon *daemon, u8 *msg)
 {
 	tal_t *tmpctx = tal_tmpctx(msg);
 	struct pubkey source, destination;
 	u32 msatoshi, final_cltv;
-	u16 riskfactor;
+	u16 riskfactor, max_routes;
 	u8 *out;
-	struct route_hop *hops;
-
-	fromwire_gossip_getroute_request(msg, NULL, &source, &destination,
-					 &msatoshi, &riskfactor, &final_cltv);
-	status_trace("Trying to find a route from %s to %s for %d msatoshi",
+	struct route_hop **routes, *hops;
+	u16 *route_lens;
+	size_t i, num_hops = 0;
+
+	fromwire_gossip_getroutes_request(msg, NULL, &source, &destination,
+					  &msatoshi, &riskfactor, &final_cltv,
+					  &max_routes);
+	status_trace("Trying to find %u routes from %s to %s for %d msatoshi",
+		     max_routes,
 		     pubkey_to_hexstr(tmpctx, &source),
 		     pubkey_to_hexstr(tmpctx, &destination), msatoshi);
 
-	hops = get_route(tmpctx, daemon->rstate, &source, &destination,
-			 msatoshi, 1, final_cltv);
+	routes = get_routes(tmpctx, daemon->rstate, &source, &destination,
+			    msatoshi, 1, final_cltv, max_routes);
+
+	route_lens = tal_arr(tmpctx, u16, tal_count(routes));
+	hops = tal_arr(tmpctx, struct route_hop, 0);
+	for (i = 0; i < tal_count(routes); i++) {
+		route_lens[i] = tal_count(routes[i]);
+		tal_resize(&hops, num_hops + route_lens[i]);
+		memcpy(hops + num_hops, routes[i],
+		       route_lens[i] * sizeof(*hops));
+		num_hops += route_lens[i];
+	}
 
-	out = towire_gossip_getroute_reply(msg, hops);
+	out = towire_gossip_getroutes_reply(msg, route_lens, hops);
 	tal_free(tmpctx);
 	daemon_conn_send(&daemon->master, out);
 	return daemon_conn_read_next(conn, &daemon->master);
 }
 
+static struct io_plan *getstats_req(struct io_conn *conn,
+				   struct daemon *daemon)
+{
+	const struct gossip_drops *drops = &daemon->rstate->drops;
+	const struct route_cache *cache = &daemon->rstate->route_cache;
+	u8 *out;
+
+	out = towire_gossip_getstats_reply(daemon,
+					   drops->duplicate_channel_announcement,
+					   drops->stale_channel_update,
+					   drops->stale_node_announcement,
+					   drops->bad_signature,
+					   drops->unknown_channel_or_node,
+					   drops->bad_txout,
+					   drops->invalid,
+					   cache->num_entries,
+					   cache->hits,
+					   cache->misses,
+					   cache->invalidations);
+	daemon_conn_send(&daemon->master, take(out));
+	return daemon_conn_read_next(conn, &daemon->master);
+}
+
+/* Channel directions are listed in (short_channel_id, direction) order, so
+ * a listing can be resumed from where the last one stopped. */
+static int scid_direction_cmp(const struct short_channel_id *a, u8 adir,
+			      const struct short_channel_id *b, u8 bdir)
+{
+	u64 ua = short_channel_id_to_uint(a), ub = short_channel_id_to_uint(b);
+
+	if (ua != ub)
+		return ua < ub ? -1 : 1;
+	return (int)adir - (int)bdir;
+}
+
+static int conn_order(struct node_connection *const *a,
+		      struct node_connection *const *b,
+		      void *unused)
+{
+	return scid_direction_cmp(&(*a)->short_channel_id, (*a)->flags & 0x1,
+				  &(*b)->short_channel_id, (*b)->flags & 0x1);
+}
+
+static void fill_getchannels_entry(struct gossip_getchannels_entry *entry,
+				   const struct node_connection *c)
+{
+	entry->source = c->src->id;
+	entry->destination = c->dst->id;
+	entry->active = c->active;
+	entry->flags = c->flags;
+	entry->public = (c->channel_update != NULL);
+	entry->short_channel_id = c->short_channel_id;
+	entry->last_update_timestamp = c->last_timestamp;
+	if (entry->last_update_timestamp >= 0) {
+		entry->base_fee_msat = c->base_fee;
+		entry->fee_per_millionth = c->proportional_fee;
+		entry->delay = c->delay;
+	}
+}
+
+struct getchannels_filter {
+	struct short_channel_id start_scid, end_scid;
+	u8 start_direction;
+	bool active_only;
+	u32 since;
+};
+
+static bool getchannels_wanted(const struct node_connection *c,
+			       const struct getchannels_filter *f)
+{
+	if (scid_direction_cmp(&c->short_channel_id, c->flags & 0x1,
+			       &f->start_scid, f->start_direction) < 0)
+		return false;
+	if (short_channel_id_to_uint(&c->short_channel_id)
+	    > short_channel_id_to_uint(&f->end_scid))
+		return false;
+	if (f->active_only && !c->active)
+		return false;
+	if (f->since && c->last_timestamp < f->since)
+		return false;
+	return true;
+}
+
+static void add_wanted_conns(struct node_connection ***conns,
+			     const struct node *n,
+			     const struct getchannels_filter *f)
+{
+	size_t i, num = tal_count(*conns);
+
+	for (i = 0; i < tal_count(n->out); i++) {
+		if (!getchannels_wanted(n->out[i], f))
+			continue;
+		tal_resize(conns, num + 1);
+		(*conns)[num++] = n->out[i];
+	}
+}
+
+/* Walk channels in order from the start of the filter, so a page costs
+ * O(limit log channels) however far into the listing it is. */
+static void add_wanted_conns_from(struct node_connection ***conns,
+				  struct routing_state *rstate,
+				  const struct getchannels_filter *f,
+				  size_t max)
+{
+	u64 index = short_channel_id_to_uint(&f->start_scid);
+	u64 end = short_channel_id_to_uint(&f->end_scid);
+	size_t num = tal_count(*conns);
+	const struct node_connection *any;
+	struct node_connection *c;
+	int dir;
+
+	any = uintmap_get(&rstate->scid_order, index);
+	if (!any)
+		any = uintmap_after(&rstate->scid_order, &index);
+
+	while (any && index <= end && num < max) {
+		for (dir = 0; dir < 2 && num < max; dir++) {
+			c = get_connection_by_scid(rstate,
+						   &any->short_channel_id, dir);
+			if (!c || !getchannels_wanted(c, f))
+				continue;
+			tal_resize(conns, num + 1);
+			(*conns)[num++] = c;
+		}
+		any = uintmap_after(&rstate->scid_order, &index);
+	}
+}
+
 static struct io_plan *getchannels_req(struct io_conn *conn, struct daemon *daemon,
 				    u8 *msg)
 {
 	tal_t *tmpctx = tal_tmpctx(daemon);
 	u8 *out;
-	size_t j, num_chans = 0;
+	size_t j, num_chans;
+	u16 limit;
+	bool filter_source, more;
+	struct pubkey source;
+	struct getchannels_filter f;
+	struct short_channel_id next_scid;
+	u8 next_direction;
+	struct node_connection **conns;
 	struct gossip_getchannels_entry *entries;
 	struct node *n;
-	struct node_map_iter i;
 
-	entries = tal_arr(tmpctx, struct gossip_getchannels_entry, num_chans);
-	n = node_map_first(daemon->rstate->nodes, &i);
-	while (n != NULL) {
-		for (j=0; j<tal_count(n->out); j++){
-			tal_resize(&entries, num_chans + 1);
-			entries[num_chans].source = n->out[j]->src->id;
-			entries[num_chans].destination = n->out[j]->dst->id;
-			entries[num_chans].active = n->out[j]->active;
-			entries[num_chans].flags = n->out[j]->flags;
-			entries[num_chans].public = (n->out[j]->channel_update != NULL);
-			entries[num_chans].short_channel_id = n->out[j]->short_channel_id;
-			entries[num_chans].last_update_timestamp = n->out[j]->last_timestamp;
-			if (entries[num_chans].last_update_timestamp >= 0) {
-				entries[num_chans].base_fee_msat = n->out[j]->base_fee;
-				entries[num_chans].fee_per_millionth = n->out[j]->proportional_fee;
-				entries[num_chans].delay = n->out[j]->delay;
-			}
-			num_chans++;
-		}
-		n = node_map_next(daemon->rstate->nodes, &i);
+	if (!fromwire_gossip_getchannels_request(msg, NULL, &limit,
+						 &f.start_scid,
+						 &f.start_direction,
+						 &f.end_scid,
+						 &filter_source, &source,
+						 &f.active_only, &f.since))
+		master_badmsg(WIRE_GOSSIP_GETCHANNELS_REQUEST, msg);
+
+	/* Only pointers to the matches: we copy out at most limit of them,
+	 * and need one more to know where the next page starts. */
+	conns = tal_arr(tmpctx, struct node_connection *, 0);
+	if (filter_source) {
+		n = node_map_get(daemon->rstate->nodes, &source.pubkey);
+		if (n)
+			add_wanted_conns(&conns, n, &f);
+		asort(conns, tal_count(conns), conn_order, NULL);
+	} else
+		add_wanted_conns_from(&conns, daemon->rstate, &f,
+				      (size_t)limit + 1);
+
+	num_chans = tal_count(conns);
+	more = (num_chans > limit);
+	if (more) {
+		num_chans = limit;
+		next_scid = conns[limit]->short_channel_id;
+		next_direction = conns[limit]->flags & 0x1;
+	} else {
+		memset(&next_scid, 0, sizeof(next_scid));
+		next_direction = 0;
 	}
 
-	out = towire_gossip_getchannels_reply(daemon, entries);
+	entries = tal_arr(tmpctx, struct gossip_getchannels_entry, num_chans);
+	for (j = 0; j < num_chans; j++)
+		fill_getchannels_entry(&entries[j], conns[j]);
+
+	out = towire_gossip_getchannels_reply(daemon, more,
+					      &next_scid, next_direction,
+					      entries);
 	daemon_conn_send(&daemon->master, take(out));
 	tal_free(tmpctx);
 	return daemon_conn_read_next(conn, &daemon->master);
 }
 
-static struct io_plan *getnodes(struct io_conn *conn, struct daemon *daemon)
+static struct io_plan *getnodes(struct io_conn *conn, struct daemon *daemon,
+				const u8 *msg)
 {
 	tal_t *tmpctx = tal_tmpctx(daemon);
 	u8 *out;
 	struct node *n;
-	struct node_map_iter i;
+	struct node **matches;
 	struct gossip_getnodes_entry *nodes;
-	size_t node_count = 0;
+	size_t i, j, node_count = 0;
+	u16 limit;
+	bool has_start, more;
+	struct pubkey start, next;
+	u32 since;
+
+	if (!fromwire_gossip_getnodes_request(msg, NULL, &limit,
+					      &has_start, &start, &since))
+		master_badmsg(WIRE_GOSSIP_GETNODES_REQUEST, msg);
+
+	/* One more than we return, to tell where the next page starts. */
+	matches = tal_arr(tmpctx, struct node *, node_count);
+	i = has_start ? node_by_id_index(daemon->rstate, &start) : 0;
+	for (; i < tal_count(daemon->rstate->nodes_by_id)
+		     && node_count <= limit;
+	     i++) {
+		n = daemon->rstate->nodes_by_id[i];
+		if (since && n->last_timestamp < since)
+			continue;
+		tal_resize(&matches, node_count + 1);
+		matches[node_count++] = n;
+	}
+
+	more = (node_count > limit);
+	if (more) {
+		node_count = limit;
+		next = matches[limit]->id;
+	} else
+		next = daemon->id;
 
 	nodes = tal_arr(tmpctx, struct gossip_getnodes_entry, node_count);
-	n = node_map_first(daemon->rstate->nodes, &i);
-	while (n != NULL) {
-		tal_resize(&nodes, node_count + 1);
-		nodes[node_count].nodeid = n->id;
-		nodes[node_count].addresses = n->addresses;
-		node_count++;
-		n = node_map_next(daemon->rstate->nodes, &i);
-	}
-	out = towire_gossip_getnodes_reply(daemon, nodes);
+	for (j = 0; j < node_count; j++) {
+		nodes[j].nodeid = matches[j]->id;
+		nodes[j].addresses = matches[j]->addresses;
+	}
+	out = towire_gossip_getnodes_reply(daemon, more, &next, nodes);
+	daemon_conn_send(&daemon->master, take(out));
+	tal_free(tmpctx);
+	return daemon_conn_read_next(conn, &daemon->master);
+}
+
+static void add_changed_channel(struct routing_state *rstate,
+				struct gossip_getchannels_entry **channels,
+				const struct short_channel_id *scid,
+				int direction)
+{
+	struct node_connection *c = get_connection_by_scid(rstate, scid,
+							   direction);
+	size_t n = tal_count(*channels);
+
+	/* It may have been closed since. */
+	if (!c)
+		return;
+	tal_resize(channels, n + 1);
+	fill_getchannels_entry(&(*channels)[n], c);
+}
+
+/* Report what a queued broadcast is about, as it stands now: a tombstone
+ * means the channel or node is gone. */
+static void add_changed(struct routing_state *rstate,
+			const struct queued_message *qm,
+			struct gossip_getchannels_entry **channels,
+			struct gossip_getnodes_entry **nodes,
+			struct short_channel_id **removed_channels,
+			struct pubkey **removed_nodes)
+{
+	struct short_channel_id scid;
+	struct pubkey id;
+	struct node *node;
+	u16 direction;
+	size_t n;
+
+	switch ((enum wire_type)qm->key.type) {
+	case WIRE_CHANNEL_ANNOUNCEMENT:
+		channel_broadcast_key_decode(&qm->key, &scid, &direction);
+		if (!qm->payload) {
+			n = tal_count(*removed_channels);
+			tal_resize(removed_channels, n + 1);
+			(*removed_channels)[n] = scid;
+			return;
+		}
+		add_changed_channel(rstate, channels, &scid, 0);
+		add_changed_channel(rstate, channels, &scid, 1);
+		return;
+	case WIRE_CHANNEL_UPDATE:
+		channel_broadcast_key_decode(&qm->key, &scid, &direction);
+		add_changed_channel(rstate, channels, &scid, direction);
+		return;
+	case WIRE_NODE_ANNOUNCEMENT:
+		if (!pubkey_from_der(qm->key.tag, PUBKEY_DER_LEN, &id))
+			return;
+		if (!qm->payload) {
+			n = tal_count(*removed_nodes);
+			tal_resize(removed_nodes, n + 1);
+			(*removed_nodes)[n] = id;
+			return;
+		}
+		node = node_map_get(rstate->nodes, &id.pubkey);
+		if (!node)
+			return;
+		n = tal_count(*nodes);
+		tal_resize(nodes, n + 1);
+		(*nodes)[n].nodeid = node->id;
+		(*nodes)[n].addresses = node->addresses;
+		return;
+	default:
+		break;
+	}
+	status_failed(STATUS_FAIL_INTERNAL_ERROR,
+		      "Unknown broadcast type %i", qm->key.type);
+}
+
+static void check_changes(struct daemon *daemon)
+{
+	if (!next_broadcast_change(daemon->rstate->broadcasts,
+				    daemon->changes_after)) {
+		new_reltimer(&daemon->timers, daemon,
+			     time_from_msec(daemon->broadcast_interval),
+			     check_changes, daemon);
+		return;
+	}
+
+	daemon->changes_watched = false;
+	daemon_conn_send(&daemon->master,
+			 take(towire_gossip_changes_available(daemon)));
+}
+
+static struct io_plan *getchanges_req(struct io_conn *conn,
+				      struct daemon *daemon,
+				      const u8 *msg)
+{
+	tal_t *tmpctx = tal_tmpctx(daemon);
+	struct broadcast_state *bstate = daemon->rstate->broadcasts;
+	struct queued_message *qm;
+	struct gossip_getchannels_entry *channels;
+	struct gossip_getnodes_entry *nodes;
+	struct short_channel_id *removed_channels;
+	struct pubkey *removed_nodes;
+	u64 since, last_index;
+	u16 limit, num = 0;
+	bool more, expired;
+	u8 *out;
+
+	if (!fromwire_gossip_getchanges_request(msg, NULL, &since, &limit))
+		master_badmsg(WIRE_GOSSIP_GETCHANGES_REQUEST, msg);
+
+	channels = tal_arr(tmpctx, struct gossip_getchannels_entry, 0);
+	nodes = tal_arr(tmpctx, struct gossip_getnodes_entry, 0);
+	removed_channels = tal_arr(tmpctx, struct short_channel_id, 0);
+	removed_nodes = tal_arr(tmpctx, struct pubkey, 0);
+
+	/* Removals after since may have been pruned: the reader has to
+	 * start again. */
+	expired = (since && since < bstate->pruned_index);
+	if (expired) {
+		out = towire_gossip_getchanges_reply(daemon, since, false, true,
+						     channels, nodes,
+						     removed_channels,
+						     removed_nodes);
+		goto send;
+	}
+
+	/* Superseded gossip has left the queue, so this only visits what
+	 * changed, once each. */
+	last_index = since;
+	while (num < limit
+	       && (qm = next_broadcast_change(bstate, last_index)) != NULL) {
+		add_changed(daemon->rstate, qm, &channels, &nodes,
+			    &removed_channels, &removed_nodes);
+		last_index = qm->index;
+		num++;
+	}
+	more = (next_broadcast_change(bstate, last_index) != NULL);
+
+	/* Nothing yet: tell master when there is, at the same pace we
+	 * broadcast to peers. */
+	if (!num) {
+		if (!daemon->changes_watched) {
+			daemon->changes_watched = true;
+			daemon->changes_after = last_index;
+			new_reltimer(&daemon->timers, daemon,
+				     time_from_msec(daemon->broadcast_interval),
+				     check_changes, daemon);
+		} else if (last_index < daemon->changes_after)
+			daemon->changes_after = last_index;
+	}
+
+	out = towire_gossip_getchanges_reply(daemon, last_index, more, false,
+					     channels, nodes,
+					     removed_channels, removed_nodes);
+send:
 	daemon_conn_send(&daemon->master, take(out));
 	tal_free(tmpctx);
 	return daemon_conn_read_next(conn, &daemon->master);
@@ -1297,6 +1849,39 @@ static void setup_listeners(struct daemon *daemon, u16 portnum)
 }
 
 
+static void gossip_store_compact_timer(struct daemon *daemon)
+{
+	struct broadcast_state *bstate = daemon->rstate->broadcasts;
+
+	broadcast_prune_tombstones(bstate, daemon->tombstone_mark);
+	daemon->tombstone_mark = bstate->next_index - 1;
+	gossip_store_compact(daemon->rstate->store, daemon->rstate);
+	new_reltimer(&daemon->timers, daemon,
+		     time_from_sec(GOSSIP_STORE_COMPACT_INTERVAL_SECS),
+		     gossip_store_compact_timer, daemon);
+}
+
+/* Anything in the store was unspent when we got it, but we may have been
+ * down a while: ask master again, and handle_pending_cannouncement()
+ * drops what's gone. */
+static void check_stored_channels(struct daemon *daemon)
+{
+	struct queued_message *qm;
+	struct short_channel_id scid;
+	u16 direction;
+
+	for (qm = next_broadcast_message(daemon->rstate->broadcasts, 0);
+	     qm;
+	     qm = next_broadcast_message(daemon->rstate->broadcasts,
+					 qm->index)) {
+		if (qm->key.type != WIRE_CHANNEL_ANNOUNCEMENT)
+			continue;
+		channel_broadcast_key_decode(&qm->key, &scid, &direction);
+		daemon_conn_send(&daemon->master,
+				 take(towire_gossip_get_txout(daemon, &scid)));
+	}
+}
+
 /* Parse an incoming gossip init message and assign config variables
  * to the daemon.
  */
@@ -1305,6 +1890,7 @@ static struct io_plan *gossip_init(struct daemon_conn *master,
 				   const u8 *msg)
 {
 	struct bitcoin_blkid chain_hash;
+	struct gossip_store *store;
 	u16 port;
 
 	if (!fromwire_gossipctl_init(daemon, msg, NULL,
@@ -1318,6 +1904,16 @@ static struct io_plan *gossip_init(struct daemon_conn *master,
 	}
 	daemon->rstate = new_routing_state(daemon, &chain_hash, &daemon->id);
 
+	/* Replay before we hand the store to rstate, which would
+	 * append everything again. */
+	store = gossip_store_new(daemon->rstate, GOSSIP_STORE_FILENAME);
+	gossip_store_load(store, daemon->rstate);
+	daemon->rstate->store = store;
+	check_stored_channels(daemon);
+	new_reltimer(&daemon->timers, daemon,
+		     time_from_sec(GOSSIP_STORE_COMPACT_INTERVAL_SECS),
+		     gossip_store_compact_timer, daemon);
+
 	setup_listeners(daemon, port);
 	return daemon_conn_read_next(master->conn, master);
 }
@@ -1575,17 +2171,103 @@ static struct io_plan *handle_txout_reply(struct io_conn *conn,
 					  struct daemon *daemon, const u8 *msg)
 {
 	struct short_channel_id scid;
+	u64 satoshis;
 	u8 *outscript;
 
-	if (!fromwire_gossip_get_txout_reply(msg, msg, NULL, &scid, &outscript))
+	if (!fromwire_gossip_get_txout_reply(msg, msg, NULL, &scid, &satoshis,
+					     &outscript))
 		master_badmsg(WIRE_GOSSIP_GET_TXOUT_REPLY, msg);
 
-	if (handle_pending_cannouncement(daemon->rstate, &scid, outscript))
+	if (handle_pending_cannouncement(daemon->rstate, &scid, satoshis,
+					 outscript))
 		send_node_announcement(daemon);
 
 	return daemon_conn_read_next(conn, &daemon->master);
 }
 
+static struct io_plan *handle_routing_failure(struct io_conn *conn,
+					      struct daemon *daemon,
+					      const u8 *msg)
+{
+	struct short_channel_id scid;
+	u8 direction, *channel_update;
+	u16 failcode, origin_index;
+
+	if (!fromwire_gossip_routing_failure(msg, msg, NULL, &scid, &direction,
+					     &failcode, &origin_index,
+					     &channel_update))
+		master_badmsg(WIRE_GOSSIP_ROUTING_FAILURE, msg);
+
+	/* The erring node told us what it wants now: if that's news, and
+	 * it's not simply out of capacity, that's all we need to route
+	 * through it again.  An update we dropped (stale, duplicate, bad
+	 * signature) changes nothing, so penalize as usual. */
+	if (tal_count(channel_update)) {
+		flush_gossip_in(daemon);
+		if (handle_channel_update(daemon->rstate, channel_update)
+		    && failcode != WIRE_TEMPORARY_CHANNEL_FAILURE)
+			return daemon_conn_read_next(conn, &daemon->master);
+	}
+
+	routing_failure(daemon->rstate, &scid, direction, failcode,
+			origin_index, time_now().ts.tv_sec);
+
+	return daemon_conn_read_next(conn, &daemon->master);
+}
+
+static struct io_plan *handle_channel_closed(struct io_conn *conn,
+					     struct daemon *daemon,
+					     const u8 *msg)
+{
+	struct short_channel_id scid;
+
+	if (!fromwire_gossip_channel_closed(msg, NULL, &scid))
+		master_badmsg(WIRE_GOSSIP_CHANNEL_CLOSED, msg);
+
+	/* Don't let gossip we already have bring it back. */
+	flush_gossip_in(daemon);
+	routing_channel_closed(daemon->rstate, &scid);
+
+	return daemon_conn_read_next(conn, &daemon->master);
+}
+
+static struct io_plan *getroutingfailures_req(struct io_conn *conn,
+					      struct daemon *daemon)
+{
+	tal_t *tmpctx = tal_tmpctx(daemon);
+	u8 *out;
+	size_t j, num = 0;
+	struct gossip_routing_failure_entry *entries;
+	struct node *n;
+	struct node_map_iter i;
+	u64 now = time_now().ts.tv_sec;
+
+	entries = tal_arr(tmpctx, struct gossip_routing_failure_entry, num);
+	for (n = node_map_first(daemon->rstate->nodes, &i);
+	     n;
+	     n = node_map_next(daemon->rstate->nodes, &i)) {
+		for (j = 0; j < tal_count(n->out); j++) {
+			const struct node_connection *c = n->out[j];
+
+			if (routing_failure_expiry(c) <= now)
+				continue;
+			tal_resize(&entries, num + 1);
+			entries[num].short_channel_id = c->short_channel_id;
+			entries[num].direction = c->flags & 0x1;
+			entries[num].failcode = c->failcode;
+			entries[num].origin_index = c->fail_origin_index;
+			entries[num].penalized_until
+				= routing_failure_expiry(c);
+			num++;
+		}
+	}
+
+	out = towire_gossip_getroutingfailures_reply(daemon, entries);
+	daemon_conn_send(&daemon->master, take(out));
+	tal_free(tmpctx);
+	return daemon_conn_read_next(conn, &daemon->master);
+}
+
 static struct io_plan *recv_req(struct io_conn *conn, struct daemon_conn *master)
 {
 	struct daemon *daemon = container_of(master, struct daemon, master);
@@ -1602,7 +2284,7 @@ static struct io_plan *recv_req(struct io_conn *conn, struct daemon_conn *master
 		return release_peer(conn, daemon, master->msg_in);
 
 	case WIRE_GOSSIP_GETNODES_REQUEST:
-		return getnodes(conn, daemon);
+		return getnodes(conn, daemon, daemon->master.msg_in);
 
 	case WIRE_GOSSIP_GETROUTE_REQUEST:
 		return getroute_req(conn, daemon, daemon->master.msg_in);
@@ -1631,6 +2313,24 @@ static struct io_plan *recv_req(struct io_conn *conn, struct daemon_conn *master
 	case WIRE_GOSSIP_GET_TXOUT_REPLY:
 		return handle_txout_reply(conn, daemon, master->msg_in);
 
+	case WIRE_GOSSIP_GETSTATS_REQUEST:
+		return getstats_req(conn, daemon);
+
+	case WIRE_GOSSIP_GETROUTES_REQUEST:
+		return getroutes_req(conn, daemon, master->msg_in);
+
+	case WIRE_GOSSIP_ROUTING_FAILURE:
+		return handle_routing_failure(conn, daemon, master->msg_in);
+
+	case WIRE_GOSSIP_GETROUTINGFAILURES_REQUEST:
+		return getroutingfailures_req(conn, daemon);
+
+	case WIRE_GOSSIP_GETCHANGES_REQUEST:
+		return getchanges_req(conn, daemon, master->msg_in);
+
+	case WIRE_GOSSIP_CHANNEL_CLOSED:
+		return handle_channel_closed(conn, daemon, master->msg_in);
+
 	/* We send these, we don't receive them */
 	case WIRE_GOSSIPCTL_RELEASE_PEER_REPLY:
 	case WIRE_GOSSIPCTL_RELEASE_PEER_REPLYFAIL:
@@ -1648,6 +2348,11 @@ static struct io_plan *recv_req(struct io_conn *conn, struct daemon_conn *master
 	case WIRE_GOSSIP_SEND_GOSSIP:
 	case WIRE_GOSSIP_LOCAL_ADD_CHANNEL:
 	case WIRE_GOSSIP_GET_TXOUT:
+	case WIRE_GOSSIP_GETSTATS_REPLY:
+	case WIRE_GOSSIP_GETROUTES_REPLY:
+	case WIRE_GOSSIP_GETROUTINGFAILURES_REPLY:
+	case WIRE_GOSSIP_GETCHANGES_REPLY:
+	case WIRE_GOSSIP_CHANGES_AVAILABLE:
 		break;
 	}
 
@@ -1677,6 +2382,12 @@ int main(int argc, char *argv[])
 	timers_init(&daemon->timers, time_mono());
 	daemon->broadcast_interval = 30000;
 	daemon->last_announce_timestamp = 0;
+	daemon->gossip_in = tal_arr(daemon, u8 *, 0);
+	daemon->gossip_in_scheduled = false;
+	daemon->route_reqs = tal_arr(daemon, u8 *, 0);
+	daemon->route_reqs_scheduled = false;
+	daemon->changes_watched = false;
+	daemon->tombstone_mark = 0;
 
 	/* stdin == control */
 	daemon_conn_init(daemon, &daemon->master, STDIN_FILENO, recv_req,
@@ -0,0 +1,304 @@
+#include <ccan/array_size/array_size.h>
+#include <ccan/endian/endian.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <ccan/tal/path/path.h>
+#include <ccan/tal/str/str.h>
+#include <common/status.h>
+#include <common/utils.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gossipd/broadcast.h>
+#include <gossipd/gossip_store.h>
+#include <gossipd/routing.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <wire/gen_peer_wire.h>
+
+struct gossip_store {
+	const char *filename;
+
+	/* -1 if we've given up on it. */
+	int fd;
+
+	/* Records appended since we last compacted. */
+	size_t appended;
+};
+
+static void destroy_gossip_store(struct gossip_store *gs)
+{
+	if (gs->fd >= 0)
+		close(gs->fd);
+}
+
+/* Losing the store only costs us a slow restart: don't die for it. */
+static void gossip_store_broken(struct gossip_store *gs, const char *what)
+{
+	status_trace("gossip_store %s: %s: %s; no longer storing gossip",
+		     gs->filename, what, strerror(errno));
+	close(gs->fd);
+	gs->fd = -1;
+}
+
+static void append_record(u8 **buf, const u8 *msg)
+{
+	size_t off = tal_len(*buf);
+	be32 len = cpu_to_be32(tal_len(msg));
+
+	tal_resize(buf, off + sizeof(len) + tal_len(msg));
+	memcpy(*buf + off, &len, sizeof(len));
+	memcpy(*buf + off + sizeof(len), msg, tal_len(msg));
+}
+
+static void append_channel_record(u8 **buf, const u8 *announce, u64 satoshis)
+{
+	size_t off = tal_len(*buf);
+	be32 len = cpu_to_be32(tal_len(announce) + sizeof(be64));
+	be64 besatoshis = cpu_to_be64(satoshis);
+
+	tal_resize(buf, off + sizeof(len) + tal_len(announce) + sizeof(be64));
+	memcpy(*buf + off, &len, sizeof(len));
+	off += sizeof(len);
+	memcpy(*buf + off, announce, tal_len(announce));
+	off += tal_len(announce);
+	memcpy(*buf + off, &besatoshis, sizeof(besatoshis));
+}
+
+struct gossip_store *gossip_store_new(const tal_t *ctx, const char *filename)
+{
+	struct gossip_store *gs = tal(ctx, struct gossip_store);
+	u8 version = GOSSIP_STORE_VERSION;
+
+	gs->filename = tal_strdup(gs, filename);
+	gs->appended = 0;
+	gs->fd = open(filename, O_RDWR|O_APPEND|O_CREAT, 0600);
+	if (gs->fd < 0) {
+		status_trace("gossip_store %s: opening: %s",
+			     filename, strerror(errno));
+		return gs;
+	}
+	tal_add_destructor(gs, destroy_gossip_store);
+
+	if (lseek(gs->fd, 0, SEEK_END) == 0
+	    && !write_all(gs->fd, &version, sizeof(version)))
+		gossip_store_broken(gs, "writing version");
+	return gs;
+}
+
+static void write_records(struct gossip_store *gs, const u8 *buf)
+{
+	if (!write_all(gs->fd, buf, tal_len(buf)))
+		gossip_store_broken(gs, "appending");
+	else
+		gs->appended++;
+}
+
+void gossip_store_append(struct gossip_store *gs, const u8 *msg)
+{
+	u8 *buf;
+
+	/* We're called with NULL while loading. */
+	if (!gs || gs->fd < 0)
+		return;
+
+	buf = tal_arr(gs, u8, 0);
+	append_record(&buf, msg);
+	write_records(gs, buf);
+	tal_free(buf);
+}
+
+void gossip_store_append_channel_announcement(struct gossip_store *gs,
+					      const u8 *announce,
+					      u64 satoshis)
+{
+	u8 *buf;
+
+	if (!gs || gs->fd < 0)
+		return;
+
+	buf = tal_arr(gs, u8, 0);
+	append_channel_record(&buf, announce, satoshis);
+	write_records(gs, buf);
+	tal_free(buf);
+}
+
+void gossip_store_removed(struct gossip_store *gs)
+{
+	if (gs)
+		gs->appended++;
+}
+
+/* Split the capacity back off the end of a channel_announcement record.
+ * The record belongs to our caller, so we trim a copy. */
+static void replay_channel_announcement(struct routing_state *rstate,
+					const u8 *rec)
+{
+	size_t len = tal_len(rec);
+	be64 besatoshis;
+	u8 *announce;
+
+	if (len < sizeof(besatoshis))
+		return;
+	memcpy(&besatoshis, rec + len - sizeof(besatoshis), sizeof(besatoshis));
+	announce = tal_dup_arr(rstate, u8, rec, len - sizeof(besatoshis), 0);
+	routing_add_channel_announcement(rstate, announce,
+					 be64_to_cpu(besatoshis));
+	tal_free(announce);
+}
+
+void gossip_store_load(struct gossip_store *gs, struct routing_state *rstate)
+{
+	const tal_t *tmpctx = tal_tmpctx(gs);
+	struct stat st;
+	u8 *contents;
+	const u8 *p;
+	size_t i, pass, num, remaining;
+	u8 **msgs = tal_arr(tmpctx, u8 *, 0);
+	/* Channels before their updates, and nodes once they have channels */
+	const int order[] = { WIRE_CHANNEL_ANNOUNCEMENT,
+			      WIRE_CHANNEL_UPDATE,
+			      WIRE_NODE_ANNOUNCEMENT };
+
+	if (gs->fd < 0)
+		goto out;
+
+	if (fstat(gs->fd, &st) != 0) {
+		gossip_store_broken(gs, "stat");
+		goto out;
+	}
+	contents = tal_arr(tmpctx, u8, st.st_size);
+	if (lseek(gs->fd, 0, SEEK_SET) != 0
+	    || !read_all(gs->fd, contents, st.st_size)) {
+		gossip_store_broken(gs, "reading");
+		goto out;
+	}
+
+	if (st.st_size == 0 || contents[0] != GOSSIP_STORE_VERSION) {
+		status_trace("gossip_store %s: unknown version %u, ignoring",
+			     gs->filename, st.st_size ? contents[0] : 0);
+		goto compact;
+	}
+
+	p = contents + 1;
+	remaining = st.st_size - 1;
+	while (remaining >= sizeof(be32)) {
+		be32 belen;
+		u32 len;
+
+		memcpy(&belen, p, sizeof(belen));
+		len = be32_to_cpu(belen);
+		if (len > remaining - sizeof(belen)) {
+			/* We died mid-write: compaction will drop it. */
+			status_trace("gossip_store %s: truncated record",
+				     gs->filename);
+			break;
+		}
+		num = tal_count(msgs);
+		tal_resize(&msgs, num + 1);
+		msgs[num] = tal_dup_arr(msgs, u8, p + sizeof(belen), len, 0);
+		p += sizeof(belen) + len;
+		remaining -= sizeof(belen) + len;
+	}
+
+	/* Appends are in the order we accepted things, which isn't
+	 * always an order we can replay in (eg. updates for our own
+	 * channels can precede their announcement). */
+	for (pass = 0; pass < ARRAY_SIZE(order); pass++) {
+		for (i = 0; i < tal_count(msgs); i++) {
+			if (fromwire_peektype(msgs[i]) != order[pass])
+				continue;
+			switch (order[pass]) {
+			case WIRE_CHANNEL_ANNOUNCEMENT:
+				replay_channel_announcement(rstate, msgs[i]);
+				break;
+			case WIRE_CHANNEL_UPDATE:
+				routing_add_channel_update(rstate, msgs[i]);
+				break;
+			case WIRE_NODE_ANNOUNCEMENT:
+				routing_add_node_announcement(rstate, msgs[i]);
+				break;
+			}
+		}
+	}
+	status_trace("gossip_store %s: loaded %zu records",
+		     gs->filename, tal_count(msgs));
+
+compact:
+	/* Make sure we rewrite, even if nothing was appended. */
+	gs->appended = 1;
+	gossip_store_compact(gs, rstate);
+out:
+	tal_free(tmpctx);
+}
+
+/* Make a rename() into this file's directory durable. */
+static void fsync_dir(const char *filename)
+{
+	char *dir = path_dirname(NULL, filename);
+	int fd = open(dir, O_RDONLY);
+
+	if (fd < 0 || fsync(fd) != 0)
+		status_trace("gossip_store %s: syncing directory %s: %s",
+			     filename, dir, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	tal_free(dir);
+}
+
+void gossip_store_compact(struct gossip_store *gs,
+			  const struct routing_state *rstate)
+{
+	const tal_t *tmpctx;
+	struct queued_message *msg;
+	char *tmpname;
+	u8 *buf;
+	size_t count = 0;
+	int fd;
+
+	if (gs->fd < 0 || gs->appended == 0)
+		return;
+
+	tmpctx = tal_tmpctx(gs);
+	buf = tal_arr(tmpctx, u8, 1);
+	buf[0] = GOSSIP_STORE_VERSION;
+	for (msg = next_broadcast_message(rstate->broadcasts, 0);
+	     msg;
+	     msg = next_broadcast_message(rstate->broadcasts, msg->index)) {
+		if (msg->key.type == WIRE_CHANNEL_ANNOUNCEMENT)
+			append_channel_record(&buf, msg->payload,
+					      channel_broadcast_satoshis(rstate,
+								 &msg->key));
+		else
+			append_record(&buf, msg->payload);
+		count++;
+	}
+
+	tmpname = tal_fmt(tmpctx, "%s.tmp", gs->filename);
+	fd = open(tmpname, O_RDWR|O_APPEND|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0) {
+		status_trace("gossip_store %s: opening: %s",
+			     tmpname, strerror(errno));
+		goto out;
+	}
+	/* It has to be on disk before it replaces the old one, or a crash
+	 * could leave us with neither. */
+	if (!write_all(fd, buf, tal_len(buf))
+	    || fsync(fd) != 0
+	    || rename(tmpname, gs->filename) != 0) {
+		status_trace("gossip_store %s: writing: %s",
+			     tmpname, strerror(errno));
+		close(fd);
+		unlink(tmpname);
+		goto out;
+	}
+	fsync_dir(gs->filename);
+
+	status_trace("gossip_store %s: compacted to %zu records",
+		     gs->filename, count);
+	close(gs->fd);
+	gs->fd = fd;
+	gs->appended = 0;
+out:
+	tal_free(tmpctx);
+}
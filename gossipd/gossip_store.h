@@ -0,0 +1,46 @@
+#ifndef LIGHTNING_GOSSIPD_GOSSIP_STORE_H
+#define LIGHTNING_GOSSIPD_GOSSIP_STORE_H
+#include "config.h"
+#include <ccan/short_types/short_types.h>
+#include <ccan/tal/tal.h>
+
+/* The gossip store is an append-only file (in the lightning dir) of
+ * every channel_announcement, channel_update and node_announcement
+ * we accepted, so a restart doesn't have to learn (and re-verify)
+ * the whole network again.
+ *
+ * It starts with a version byte; each record is a 32-bit big-endian
+ * length followed by the message itself.  A channel_announcement is
+ * followed (inside the same record) by the channel capacity in satoshis,
+ * as a 64-bit big-endian number. */
+#define GOSSIP_STORE_FILENAME "gossip_store"
+#define GOSSIP_STORE_VERSION 2
+
+struct broadcast_state;
+struct routing_state;
+
+/* Opens (creating if necessary) the store. */
+struct gossip_store *gossip_store_new(const tal_t *ctx, const char *filename);
+
+/* Record a message we've validated. */
+void gossip_store_append(struct gossip_store *gs, const u8 *msg);
+void gossip_store_append_channel_announcement(struct gossip_store *gs,
+					      const u8 *announce,
+					      u64 satoshis);
+
+/* Something we stored is gone from the routing state: make sure the
+ * next compaction rewrites the store without it. */
+void gossip_store_removed(struct gossip_store *gs);
+
+/* Replay the store into rstate, without checking signatures: we only
+ * ever wrote messages which passed.  Then compact it.  Funding outputs
+ * may have been spent while we were down, so the caller should check
+ * the channels' txouts again. */
+void gossip_store_load(struct gossip_store *gs, struct routing_state *rstate);
+
+/* Rewrite the store with only what's still in rstate's broadcast queue,
+ * dropping everything which has since been superseded. */
+void gossip_store_compact(struct gossip_store *gs,
+			  const struct routing_state *rstate);
+
+#endif /* LIGHTNING_GOSSIPD_GOSSIP_STORE_H */
@@ -2,18 +2,23 @@
 #include <arpa/inet.h>
 #include <bitcoin/block.h>
 #include <bitcoin/script.h>
-#include <ccan/array_size/array_size.h>
 #include <ccan/crypto/siphash24/siphash24.h>
 #include <ccan/endian/endian.h>
+#include <ccan/ilog/ilog.h>
 #include <ccan/structeq/structeq.h>
 #include <ccan/tal/str/str.h>
+#include <ccan/time/time.h>
 #include <common/features.h>
 #include <common/pseudorand.h>
 #include <common/status.h>
 #include <common/type_to_string.h>
 #include <common/wireaddr.h>
+#include <gossipd/gossip_store.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <wire/gen_peer_wire.h>
+#include <wire/onion_defs.h>
 
 #ifndef SUPERVERBOSE
 #define SUPERVERBOSE(...)
@@ -28,11 +33,23 @@
 /* Proportional fee must be less than 24 bits, so never overflows. */
 #define MAX_PROPORTIONAL_FEE (1 << 24)
 
+/* After a payment fails through a connection, routes through it cost
+ * extra: the amount again at first, halving this often... */
+#define ROUTING_TEMPFAIL_HALFLIFE_SECS 60
+#define ROUTING_PERMFAIL_HALFLIFE_SECS (60 * 60)
+/* ... until it's under a thousandth of the amount, when we forget it. */
+#define ROUTING_FAIL_HALFLIVES 10
+
+/* Most threads get_route_batch searches with: more would just fight
+ * lightningd and bitcoind for CPU. */
+#define MAX_ROUTE_THREADS 8
+
+/* How many routes get_route remembers. */
+#define ROUTE_CACHE_MAX_ENTRIES 256
+
 /* We've unpacked and checked its signatures, now we wait for master to tell
  * us the txout to check */
 struct pending_cannouncement {
-	struct list_node list;
-
 	/* Unpacked fields here */
 	struct short_channel_id short_channel_id;
 	struct pubkey node_id_1;
@@ -56,16 +73,51 @@ static struct node_map *empty_node_map(const tal_t *ctx)
 	return map;
 }
 
+/* The connections are our children, so this runs before they're freed:
+ * their destructors then find an empty (but valid) map. */
+static void destroy_routing_state(struct routing_state *rstate)
+{
+	scid_map_clear(&rstate->scids);
+	route_cache_map_clear(&rstate->route_cache.map);
+	uintmap_clear(&rstate->pending_cannouncements);
+	uintmap_clear(&rstate->scid_order);
+}
+
 struct routing_state *new_routing_state(const tal_t *ctx,
 					const struct bitcoin_blkid *chain_hash,
 					const struct pubkey *local_id)
 {
 	struct routing_state *rstate = tal(ctx, struct routing_state);
 	rstate->nodes = empty_node_map(rstate);
+	scid_map_init(&rstate->scids);
+	route_cache_map_init(&rstate->route_cache.map);
+	list_head_init(&rstate->route_cache.lru);
+	rstate->route_cache.num_entries = 0;
+	rstate->route_cache.hits = rstate->route_cache.misses = 0;
+	rstate->route_cache.invalidations = 0;
+	tal_add_destructor(rstate, destroy_routing_state);
+	rstate->graph.dirty = true;
+	rstate->graph.nodes = tal_arr(rstate, struct node *, 0);
+	rstate->graph.in_start = tal_arr(rstate, u32, 0);
+	rstate->graph.src = tal_arr(rstate, u32, 0);
+	rstate->graph.base_fee = tal_arr(rstate, u32, 0);
+	rstate->graph.proportional_fee = tal_arr(rstate, u32, 0);
+	rstate->graph.delay = tal_arr(rstate, u32, 0);
+	rstate->graph.htlc_minimum_msat = tal_arr(rstate, u32, 0);
+	rstate->graph.capacity_msat = tal_arr(rstate, u64, 0);
+	rstate->graph.active = tal_arr(rstate, bool, 0);
+	rstate->graph.fail_time = tal_arr(rstate, u64, 0);
+	rstate->graph.fail_halflife = tal_arr(rstate, u32, 0);
+	rstate->graph.conns = tal_arr(rstate, struct node_connection *, 0);
+	rstate->route_scratch = tal_arr(rstate, struct route_scratch *, 0);
 	rstate->broadcasts = new_broadcast_state(rstate);
+	rstate->store = NULL;
 	rstate->chain_hash = *chain_hash;
 	rstate->local_id = *local_id;
-	list_head_init(&rstate->pending_cannouncement);
+	uintmap_init(&rstate->pending_cannouncements);
+	uintmap_init(&rstate->scid_order);
+	rstate->nodes_by_id = tal_arr(rstate, struct node *, 0);
+	memset(&rstate->drops, 0, sizeof(rstate->drops));
 	return rstate;
 }
 
@@ -85,8 +137,153 @@ bool node_map_node_eq(const struct node *n, const secp256k1_pubkey *key)
 	return structeq(&n->id.pubkey, key);
 }
 
-static void destroy_node(struct node *node)
+const struct short_channel_id *scid_map_keyof_conn(const struct node_connection *c)
+{
+	return &c->short_channel_id;
+}
+
+size_t scid_map_hash_key(const struct short_channel_id *scid)
+{
+	/* Don't hash the bitfield padding. */
+	u64 key = short_channel_id_to_uint(scid);
+	return siphash24(siphash_seed(), &key, sizeof(key));
+}
+
+bool scid_map_conn_eq(const struct node_connection *c,
+		      const struct short_channel_id *scid)
+{
+	return short_channel_id_eq(&c->short_channel_id, scid);
+}
+
+const struct route_cache_key *route_cache_keyof(const struct route_cache_entry *e)
+{
+	return &e->key;
+}
+
+size_t route_cache_hash_key(const struct route_cache_key *key)
 {
+	struct siphash24_ctx ctx;
+
+	siphash24_init(&ctx, siphash_seed());
+	siphash24_update(&ctx, &key->source.pubkey, sizeof(key->source.pubkey));
+	siphash24_update(&ctx, &key->destination.pubkey,
+			 sizeof(key->destination.pubkey));
+	siphash24_u8(&ctx, key->amount_bucket);
+	siphash24_u8(&ctx, key->riskfactor_bucket);
+	return siphash24_done(&ctx);
+}
+
+bool route_cache_entry_eq(const struct route_cache_entry *e,
+			  const struct route_cache_key *key)
+{
+	return pubkey_eq(&e->key.source, &key->source)
+		&& pubkey_eq(&e->key.destination, &key->destination)
+		&& e->key.amount_bucket == key->amount_bucket
+		&& e->key.riskfactor_bucket == key->riskfactor_bucket;
+}
+
+static void remove_cached_route(struct node_connection *nc,
+				const struct route_cache_entry *e)
+{
+	size_t i, n = tal_count(nc->cached_routes);
+
+	for (i = 0; i < n; i++) {
+		if (nc->cached_routes[i] != e)
+			continue;
+		nc->cached_routes[i] = nc->cached_routes[n - 1];
+		tal_resize(&nc->cached_routes, n - 1);
+		return;
+	}
+	abort();
+}
+
+static void add_cached_route(struct node_connection *nc,
+			     struct route_cache_entry *e)
+{
+	size_t n = tal_count(nc->cached_routes);
+
+	tal_resize(&nc->cached_routes, n + 1);
+	nc->cached_routes[n] = e;
+}
+
+static void destroy_route_cache_entry(struct route_cache_entry *e,
+				      struct routing_state *rstate)
+{
+	size_t i;
+
+	route_cache_map_del(&rstate->route_cache.map, e);
+	list_del(&e->list);
+	rstate->route_cache.num_entries--;
+
+	remove_cached_route(e->first_conn, e);
+	for (i = 0; i < tal_count(e->route); i++)
+		remove_cached_route(e->route[i], e);
+}
+
+/* Forget every cached route through this connection. */
+static void route_cache_invalidate(struct routing_state *rstate,
+				   const struct node_connection *nc)
+{
+	while (tal_count(nc->cached_routes)) {
+		rstate->route_cache.invalidations++;
+		tal_free(nc->cached_routes[0]);
+	}
+}
+
+static void route_cache_key_init(struct route_cache_key *key,
+				 const struct pubkey *source,
+				 const struct pubkey *destination,
+				 u64 msatoshi, double riskfactor)
+{
+	double scaled = riskfactor * 1000;
+	u64 scaled_riskfactor;
+
+	/* Converting a NaN, negative or too-large double is undefined. */
+	if (!(scaled > 0))
+		scaled_riskfactor = 0;
+	else if (scaled >= (double)UINT64_MAX)
+		scaled_riskfactor = UINT64_MAX;
+	else
+		scaled_riskfactor = scaled;
+
+	key->source = *source;
+	key->destination = *destination;
+	key->amount_bucket = ilog64(msatoshi);
+	key->riskfactor_bucket = ilog64(scaled_riskfactor);
+}
+
+static void route_cache_add(struct routing_state *rstate,
+			    const struct route_cache_key *key,
+			    struct node_connection *first_conn,
+			    struct node_connection **route)
+{
+	struct route_cache *cache = &rstate->route_cache;
+	struct route_cache_entry *e;
+	size_t i;
+
+	if (cache->num_entries == ROUTE_CACHE_MAX_ENTRIES)
+		tal_free(list_tail(&cache->lru, struct route_cache_entry, list));
+
+	e = tal(rstate, struct route_cache_entry);
+	e->key = *key;
+	e->first_conn = first_conn;
+	e->route = tal_dup_arr(e, struct node_connection *, route,
+			       tal_count(route), 0);
+	route_cache_map_add(&cache->map, e);
+	list_add(&cache->lru, &e->list);
+	cache->num_entries++;
+
+	add_cached_route(first_conn, e);
+	for (i = 0; i < tal_count(route); i++)
+		add_cached_route(route[i], e);
+	tal_add_destructor2(e, destroy_route_cache_entry, rstate);
+}
+
+static void destroy_node(struct node *node, struct routing_state *rstate)
+{
+	rstate->graph.dirty = true;
+	shared_payload_unref(node->node_announcement);
+
 	/* These remove themselves from the array. */
 	while (tal_count(node->in))
 		tal_free(node->in[0]);
@@ -100,10 +297,26 @@ static struct node *get_node(struct routing_state *rstate,
 	return node_map_get(rstate->nodes, &id->pubkey);
 }
 
+size_t node_by_id_index(const struct routing_state *rstate,
+			const struct pubkey *id)
+{
+	size_t lo = 0, hi = tal_count(rstate->nodes_by_id);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (pubkey_cmp(&rstate->nodes_by_id[mid]->id, id) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 static struct node *new_node(struct routing_state *rstate,
 			     const struct pubkey *id)
 {
 	struct node *n;
+	size_t i, num = tal_count(rstate->nodes_by_id);
 
 	assert(!get_node(rstate, id));
 
@@ -116,7 +329,14 @@ static struct node *new_node(struct routing_state *rstate,
 	n->last_timestamp = -1;
 	n->addresses = tal_arr(n, struct wireaddr, 0);
 	node_map_add(rstate->nodes, n);
-	tal_add_destructor(n, destroy_node);
+	tal_add_destructor2(n, destroy_node, rstate);
+
+	i = node_by_id_index(rstate, id);
+	tal_resize(&rstate->nodes_by_id, num + 1);
+	memmove(rstate->nodes_by_id + i + 1, rstate->nodes_by_id + i,
+		(num - i) * sizeof(*rstate->nodes_by_id));
+	rstate->nodes_by_id[i] = n;
+	rstate->graph.dirty = true;
 
 	return n;
 }
@@ -138,8 +358,30 @@ static bool remove_conn_from_array(struct node_connection ***conns,
 	return false;
 }
 
-static void destroy_connection(struct node_connection *nc)
+/* Point scid_order's entry for scid at a connection which still has it, or
+ * drop it if none does.  Call after changing rstate->scids. */
+static void order_scid(struct routing_state *rstate,
+		       const struct short_channel_id *scid)
 {
+	u64 index = short_channel_id_to_uint(scid);
+	struct scid_map_iter it;
+	struct node_connection *c;
+
+	c = scid_map_getfirst(&rstate->scids, scid, &it);
+	uintmap_del(&rstate->scid_order, index);
+	if (c)
+		uintmap_add(&rstate->scid_order, index, c);
+}
+
+static void destroy_connection(struct node_connection *nc,
+			       struct routing_state *rstate)
+{
+	rstate->graph.dirty = true;
+	scid_map_del(&rstate->scids, nc);
+	order_scid(rstate, &nc->short_channel_id);
+	route_cache_invalidate(rstate, nc);
+	shared_payload_unref(nc->channel_announcement);
+	shared_payload_unref(nc->channel_update);
 	if (!remove_conn_from_array(&nc->dst->in, nc)
 	    || !remove_conn_from_array(&nc->src->out, nc))
 		/* FIXME! */
@@ -169,25 +411,73 @@ struct node_connection *get_connection_by_scid(const struct routing_state *rstat
 					      const struct short_channel_id *schanid,
 					      const u8 direction)
 {
-	struct node *n;
-	int i, num_conn;
-	struct node_map *nodes = rstate->nodes;
 	struct node_connection *c;
-	struct node_map_iter it;
+	struct scid_map_iter it;
 
-	//FIXME(cdecker) We probably want to speed this up by indexing by chanid.
-	for (n = node_map_first(nodes, &it); n; n = node_map_next(nodes, &it)) {
-	        num_conn = tal_count(n->out);
-		for (i = 0; i < num_conn; i++){
-			c = n->out[i];
-			if (short_channel_id_eq(&c->short_channel_id, schanid) &&
-			    (c->flags&0x1) == direction)
-			    return c;
-		}
+	for (c = scid_map_getfirst(&rstate->scids, schanid, &it);
+	     c;
+	     c = scid_map_getnext(&rstate->scids, schanid, &it)) {
+		if ((c->flags & 0x1) == direction)
+			return c;
 	}
 	return NULL;
 }
 
+struct node_connection *routing_failure(struct routing_state *rstate,
+					const struct short_channel_id *scid,
+					u8 direction, u16 failcode,
+					u16 origin_index, u64 now)
+{
+	struct node_connection *nc;
+
+	nc = get_connection_by_scid(rstate, scid, direction);
+	if (!nc) {
+		status_trace("routing_failure: unknown channel %s/%u",
+			     type_to_string(trc, struct short_channel_id, scid),
+			     direction);
+		return NULL;
+	}
+
+	if (origin_index == ROUTING_FAILURE_LOCAL)
+		status_trace("routing_failure: %s/%u failed locally with 0x%04x",
+			     type_to_string(trc, struct short_channel_id, scid),
+			     direction, failcode);
+	else
+		status_trace("routing_failure: %s/%u failed with 0x%04x at hop %u",
+			     type_to_string(trc, struct short_channel_id, scid),
+			     direction, failcode, origin_index);
+	nc->failcode = failcode;
+	nc->fail_origin_index = origin_index;
+	nc->fail_time = now;
+	if (failcode & PERM)
+		nc->fail_halflife = ROUTING_PERMFAIL_HALFLIFE_SECS;
+	else
+		nc->fail_halflife = ROUTING_TEMPFAIL_HALFLIFE_SECS;
+	routing_connection_changed(rstate, nc);
+	return nc;
+}
+
+u64 routing_failure_expiry(const struct node_connection *c)
+{
+	if (!c->fail_halflife)
+		return 0;
+	return c->fail_time + (u64)c->fail_halflife * ROUTING_FAIL_HALFLIVES;
+}
+
+/* Connections are only indexed once they have a short_channel_id;
+ * call this whenever it changes. */
+static void set_connection_scid(struct routing_state *rstate,
+				struct node_connection *nc,
+				const struct short_channel_id *schanid)
+{
+	/* Removes by pointer, so harmless if it wasn't indexed yet. */
+	scid_map_del(&rstate->scids, nc);
+	order_scid(rstate, &nc->short_channel_id);
+	nc->short_channel_id = *schanid;
+	scid_map_add(&rstate->scids, nc);
+	order_scid(rstate, &nc->short_channel_id);
+}
+
 static struct node_connection *
 get_or_make_connection(struct routing_state *rstate,
 		       const struct pubkey *from_id,
@@ -225,6 +515,16 @@ get_or_make_connection(struct routing_state *rstate,
 	nc->dst = to;
 	nc->channel_announcement = NULL;
 	nc->channel_update = NULL;
+	nc->base_fee = nc->proportional_fee = nc->delay = 0;
+	nc->htlc_minimum_msat = 0;
+	nc->satoshis = 0;
+	nc->active = false;
+	nc->failcode = nc->fail_origin_index = 0;
+	nc->fail_time = 0;
+	nc->fail_halflife = 0;
+	nc->cached_routes = tal_arr(nc, struct route_cache_entry *, 0);
+	/* Not in rstate->scids until half_add_connection gives it one. */
+	memset(&nc->short_channel_id, 0, sizeof(nc->short_channel_id));
 
 	/* Hook it into in/out arrays. */
 	i = tal_count(to->in);
@@ -234,7 +534,8 @@ get_or_make_connection(struct routing_state *rstate,
 	tal_resize(&from->out, i+1);
 	from->out[i] = nc;
 
-	tal_add_destructor(nc, destroy_connection);
+	tal_add_destructor2(nc, destroy_connection, rstate);
+	rstate->graph.dirty = true;
 	return nc;
 }
 
@@ -248,42 +549,279 @@ struct node_connection *half_add_connection(
 {
 	struct node_connection *nc;
 	nc = get_or_make_connection(rstate, from, to);
-	nc->short_channel_id = *schanid;
+	set_connection_scid(rstate, nc, schanid);
 	nc->active = false;
 	nc->flags = flags;
 	nc->last_timestamp = -1;
+	routing_connection_changed(rstate, nc);
 	return nc;
 }
 
 
 
-/* Too big to reach, but don't overflow if added. */
-#define INFINITE 0x3FFFFFFFFFFFFFFFULL
+static void route_graph_set_edge(struct route_graph *graph, u32 e,
+				 const struct node_connection *c)
+{
+	graph->base_fee[e] = c->base_fee;
+	graph->proportional_fee[e] = c->proportional_fee;
+	graph->delay[e] = c->delay;
+	graph->htlc_minimum_msat[e] = c->htlc_minimum_msat;
+	graph->capacity_msat[e] = c->satoshis * 1000;
+	graph->active[e] = c->active;
+	graph->fail_time[e] = c->fail_time;
+	graph->fail_halflife[e] = c->fail_halflife;
+}
 
-static void clear_bfg(struct node_map *nodes)
+void routing_connection_changed(struct routing_state *rstate,
+				const struct node_connection *nc)
 {
+	route_cache_invalidate(rstate, nc);
+
+	/* If it's dirty, the rebuild will pick it up anyway. */
+	if (!rstate->graph.dirty)
+		route_graph_set_edge(&rstate->graph, nc->edge_index, nc);
+}
+
+static void route_graph_rebuild(struct routing_state *rstate)
+{
+	struct route_graph *graph = &rstate->graph;
 	struct node *n;
 	struct node_map_iter it;
+	u32 num_nodes = 0, num_edges = 0, i, e;
 
-	for (n = node_map_first(nodes, &it); n; n = node_map_next(nodes, &it)) {
-		size_t i;
-		for (i = 0; i < ARRAY_SIZE(n->bfg); i++) {
-			n->bfg[i].total = INFINITE;
-			n->bfg[i].risk = 0;
+	for (n = node_map_first(rstate->nodes, &it);
+	     n;
+	     n = node_map_next(rstate->nodes, &it)) {
+		n->index = num_nodes++;
+		num_edges += tal_count(n->in);
+	}
+
+	tal_resize(&graph->nodes, num_nodes);
+	tal_resize(&graph->in_start, num_nodes + 1);
+	tal_resize(&graph->src, num_edges);
+	tal_resize(&graph->base_fee, num_edges);
+	tal_resize(&graph->proportional_fee, num_edges);
+	tal_resize(&graph->delay, num_edges);
+	tal_resize(&graph->htlc_minimum_msat, num_edges);
+	tal_resize(&graph->capacity_msat, num_edges);
+	tal_resize(&graph->active, num_edges);
+	tal_resize(&graph->fail_time, num_edges);
+	tal_resize(&graph->fail_halflife, num_edges);
+	tal_resize(&graph->conns, num_edges);
+
+	e = 0;
+	for (n = node_map_first(rstate->nodes, &it);
+	     n;
+	     n = node_map_next(rstate->nodes, &it)) {
+		graph->nodes[n->index] = n;
+		graph->in_start[n->index] = e;
+		for (i = 0; i < tal_count(n->in); i++) {
+			struct node_connection *c = n->in[i];
+
+			c->edge_index = e;
+			graph->src[e] = c->src->index;
+			graph->conns[e] = c;
+			route_graph_set_edge(graph, e, c);
+			e++;
 		}
 	}
+	graph->in_start[num_nodes] = e;
+	assert(e == num_edges);
+
+	graph->dirty = false;
 }
 
-static u64 connection_fee(const struct node_connection *c, u64 msatoshi)
+/* Too big to reach, but don't overflow if added. */
+#define INFINITE 0x3FFFFFFFFFFFFFFFULL
+
+/* Marker for nodes which are not (or no longer) in the search heap. */
+#define NOT_IN_HEAP ((u32)-1)
+
+/* Per-query state for route_search_path, indexed by node index.  It
+ * lives as long as rstate: rather than reset every node before each
+ * search, we bump epoch, and a node's slots are only valid if its stamp
+ * matches; so a search only touches the nodes it reaches. */
+struct route_scratch {
+	/* Total to get to here from target. */
+	u64 *total;
+	/* Total risk premium of this route. */
+	u64 *risk;
+	/* Edge that came from. */
+	u32 *prev;
+	/* Number of hops from target. */
+	u32 *hops;
+	/* Position in heap, or NOT_IN_HEAP. */
+	u32 *heapidx;
+	/* Which search the above are for: others are unset. */
+	u32 *stamp;
+	u32 epoch;
+
+	/* Binary min-heap of node indices, ordered by total + risk. */
+	u32 *heap;
+	u32 heapcount;
+};
+
+/* Make room for num_nodes, as the graph grows.  tal isn't thread-safe, so
+ * this is only ever done on the main thread, by route_scratch(). */
+static void grow_route_scratch(struct route_scratch *scratch, u32 num_nodes)
+{
+	if (num_nodes <= tal_count(scratch->stamp))
+		return;
+
+	tal_resize(&scratch->total, num_nodes);
+	tal_resize(&scratch->risk, num_nodes);
+	tal_resize(&scratch->prev, num_nodes);
+	tal_resize(&scratch->hops, num_nodes);
+	tal_resize(&scratch->heapidx, num_nodes);
+	tal_resizez(&scratch->stamp, num_nodes);
+	/* Each node is in the heap at most once. */
+	tal_resize(&scratch->heap, num_nodes);
+}
+
+/* Start a new search (search threads call this, so it doesn't allocate). */
+static void reset_route_scratch(struct route_scratch *scratch, u32 num_nodes)
+{
+	assert(tal_count(scratch->stamp) >= num_nodes);
+
+	scratch->heapcount = 0;
+	/* Once in 4 billion searches, we do have to clear them all. */
+	if (++scratch->epoch == 0) {
+		memset(scratch->stamp, 0,
+		       tal_count(scratch->stamp) * sizeof(*scratch->stamp));
+		scratch->epoch = 1;
+	}
+}
+
+/* Start a node's slots off unreached, unless this search already has. */
+static void visit_node(struct route_scratch *scratch, u32 n)
+{
+	if (scratch->stamp[n] == scratch->epoch)
+		return;
+	scratch->stamp[n] = scratch->epoch;
+	scratch->total[n] = INFINITE;
+	scratch->risk[n] = 0;
+	scratch->hops[n] = 0;
+	scratch->heapidx[n] = NOT_IN_HEAP;
+}
+
+static struct route_scratch *new_route_scratch(const tal_t *ctx)
+{
+	struct route_scratch *scratch = tal(ctx, struct route_scratch);
+
+	scratch->total = tal_arr(scratch, u64, 0);
+	scratch->risk = tal_arr(scratch, u64, 0);
+	scratch->prev = tal_arr(scratch, u32, 0);
+	scratch->hops = tal_arr(scratch, u32, 0);
+	scratch->heapidx = tal_arr(scratch, u32, 0);
+	scratch->stamp = tal_arr(scratch, u32, 0);
+	scratch->epoch = 0;
+	scratch->heap = tal_arr(scratch, u32, 0);
+	return scratch;
+}
+
+/* The i'th search thread's scratch ([0] is the main thread's), big enough
+ * for the current graph.  Call it on the main thread, before searching. */
+static struct route_scratch *route_scratch(struct routing_state *rstate,
+					   size_t i)
+{
+	size_t n = tal_count(rstate->route_scratch);
+
+	if (i >= n) {
+		tal_resize(&rstate->route_scratch, i + 1);
+		while (n <= i)
+			rstate->route_scratch[n++] = new_route_scratch(rstate);
+	}
+	grow_route_scratch(rstate->route_scratch[i],
+			   tal_count(rstate->graph.nodes));
+	return rstate->route_scratch[i];
+}
+
+static u64 dijkstra_cost(const struct route_scratch *scratch, u32 n)
+{
+	return scratch->total[n] + scratch->risk[n];
+}
+
+static void heap_swap(struct route_scratch *scratch, u32 a, u32 b)
+{
+	u32 tmp = scratch->heap[a];
+
+	scratch->heap[a] = scratch->heap[b];
+	scratch->heap[b] = tmp;
+	scratch->heapidx[scratch->heap[a]] = a;
+	scratch->heapidx[scratch->heap[b]] = b;
+}
+
+static void heap_sift_up(struct route_scratch *scratch, u32 i)
+{
+	while (i > 0) {
+		u32 parent = (i - 1) / 2;
+
+		if (dijkstra_cost(scratch, scratch->heap[parent])
+		    <= dijkstra_cost(scratch, scratch->heap[i]))
+			break;
+		heap_swap(scratch, i, parent);
+		i = parent;
+	}
+}
+
+static void heap_sift_down(struct route_scratch *scratch, u32 i)
+{
+	for (;;) {
+		u32 l = 2 * i + 1, r = 2 * i + 2, smallest = i;
+
+		if (l < scratch->heapcount
+		    && dijkstra_cost(scratch, scratch->heap[l])
+		    < dijkstra_cost(scratch, scratch->heap[smallest]))
+			smallest = l;
+		if (r < scratch->heapcount
+		    && dijkstra_cost(scratch, scratch->heap[r])
+		    < dijkstra_cost(scratch, scratch->heap[smallest]))
+			smallest = r;
+		if (smallest == i)
+			break;
+		heap_swap(scratch, i, smallest);
+		i = smallest;
+	}
+}
+
+/* Insert node, or move it up if its cost just decreased. */
+static void heap_update(struct route_scratch *scratch, u32 n)
+{
+	if (scratch->heapidx[n] == NOT_IN_HEAP) {
+		scratch->heapidx[n] = scratch->heapcount;
+		scratch->heap[scratch->heapcount++] = n;
+	}
+	heap_sift_up(scratch, scratch->heapidx[n]);
+}
+
+/* Returns false if heap is empty. */
+static bool heap_pop(struct route_scratch *scratch, u32 *n)
+{
+	if (scratch->heapcount == 0)
+		return false;
+
+	*n = scratch->heap[0];
+	heap_swap(scratch, 0, --scratch->heapcount);
+	heap_sift_down(scratch, 0);
+	scratch->heapidx[*n] = NOT_IN_HEAP;
+	return true;
+}
+
+static u64 fee_for(u32 base_fee, u32 proportional_fee, u64 msatoshi)
 {
 	u64 fee;
 
 	assert(msatoshi < MAX_MSATOSHI);
-	assert(c->proportional_fee < MAX_PROPORTIONAL_FEE);
+	assert(proportional_fee < MAX_PROPORTIONAL_FEE);
 
-	fee = (c->proportional_fee * msatoshi) / 1000000;
-	/* This can't overflow: c->base_fee is a u32 */
-	return c->base_fee + fee;
+	fee = (proportional_fee * msatoshi) / 1000000;
+	/* This can't overflow: base_fee is a u32 */
+	return base_fee + fee;
+}
+
+static u64 connection_fee(const struct node_connection *c, u64 msatoshi)
+{
+	return fee_for(c->base_fee, c->proportional_fee, msatoshi);
 }
 
 /* Risk of passing through this channel.  We insert a tiny constant here
@@ -293,148 +831,228 @@ static u64 risk_fee(u64 amount, u32 delay, double riskfactor)
 	return 1 + amount * delay * riskfactor;
 }
 
+/* Bias against channels this amount would take a big share of, which are
+ * less likely to have enough on the right side: as a proportional fee of
+ * 1 per million for each thousandth of the capacity used. */
+static u64 capacity_bias(u64 amount, u64 capacity_msat)
+{
+	/* Unknown */
+	if (!capacity_msat)
+		return 0;
+	return amount * (amount * 1000 / capacity_msat) / 1000000;
+}
+
+/* A recent failure makes an edge dearer, rather than unusable: if it's
+ * the only way, we'll still try it. */
+static u64 failure_penalty(const struct route_graph *graph, u32 e,
+			   u64 amount, u64 now)
+{
+	u64 halvings;
+
+	if (!graph->fail_halflife[e])
+		return 0;
+	if (now <= graph->fail_time[e])
+		return amount;
+	halvings = (now - graph->fail_time[e]) / graph->fail_halflife[e];
+	if (halvings >= ROUTING_FAIL_HALFLIVES)
+		return 0;
+	return amount >> halvings;
+}
+
 /* We track totals, rather than costs.  That's because the fee depends
  * on the current amount passing through. */
-static void bfg_one_edge(struct node *node, size_t edgenum, double riskfactor)
+static void dijkstra_one_edge(const struct route_graph *graph,
+			      struct route_scratch *scratch,
+			      u32 node, u32 e, double riskfactor, u64 now)
 {
-	struct node_connection *c = node->in[edgenum];
-	size_t h;
+	u32 src = graph->src[e];
+	u64 fee, risk;
 
-	assert(c->dst == node);
-	for (h = 0; h < ROUTING_MAX_HOPS; h++) {
-		/* FIXME: Bias against smaller channels. */
-		u64 fee;
-		u64 risk;
+	visit_node(scratch, src);
 
-		if (node->bfg[h].total == INFINITE)
-			continue;
+	/* The HTLC over this edge carries what we need to get here. */
+	if (scratch->total[node] < graph->htlc_minimum_msat[e]) {
+		SUPERVERBOSE("...below htlc minimum %u",
+			     graph->htlc_minimum_msat[e]);
+		return;
+	}
 
-		fee = connection_fee(c, node->bfg[h].total);
-		risk = node->bfg[h].risk + risk_fee(node->bfg[h].total + fee,
-						    c->delay, riskfactor);
+	/* ... which it can't if the whole channel is smaller. */
+	if (graph->capacity_msat[e]
+	    && scratch->total[node] > graph->capacity_msat[e]) {
+		SUPERVERBOSE("...above capacity %"PRIu64,
+			     graph->capacity_msat[e]);
+		return;
+	}
 
-		if (node->bfg[h].total + fee + risk >= MAX_MSATOSHI) {
-			SUPERVERBOSE("...extreme %"PRIu64
-				     " + fee %"PRIu64
-				     " + risk %"PRIu64" ignored",
-				     node->bfg[h].total, fee, risk);
-			continue;
-		}
+	fee = fee_for(graph->base_fee[e], graph->proportional_fee[e],
+		      scratch->total[node]);
+	risk = scratch->risk[node] + risk_fee(scratch->total[node] + fee,
+					      graph->delay[e], riskfactor)
+		+ capacity_bias(scratch->total[node], graph->capacity_msat[e])
+		+ failure_penalty(graph, e, scratch->total[node], now);
+
+	if (scratch->total[node] + fee + risk >= MAX_MSATOSHI) {
+		SUPERVERBOSE("...extreme %"PRIu64
+			     " + fee %"PRIu64
+			     " + risk %"PRIu64" ignored",
+			     scratch->total[node], fee, risk);
+		return;
+	}
 
-		if (node->bfg[h].total + fee + risk
-		    < c->src->bfg[h+1].total + c->src->bfg[h+1].risk) {
-			SUPERVERBOSE("...%s can reach here in hoplen %zu total %"PRIu64,
-				     type_to_string(trc, struct pubkey,
-						    &c->src->id),
-				     h, node->bfg[h].total + fee);
-			c->src->bfg[h+1].total = node->bfg[h].total + fee;
-			c->src->bfg[h+1].risk = risk;
-			c->src->bfg[h+1].prev = c;
-		}
+	if (scratch->total[node] + fee + risk < dijkstra_cost(scratch, src)) {
+		SUPERVERBOSE("...%s can reach here in hoplen %u total %"PRIu64,
+			     type_to_string(trc, struct pubkey,
+					    &graph->nodes[src]->id),
+			     scratch->hops[node] + 1,
+			     scratch->total[node] + fee);
+		scratch->total[src] = scratch->total[node] + fee;
+		scratch->risk[src] = risk;
+		scratch->prev[src] = e;
+		scratch->hops[src] = scratch->hops[node] + 1;
+		heap_update(scratch, src);
 	}
 }
 
-/* riskfactor is already scaled to per-block amount */
-static struct node_connection *
-find_route(const tal_t *ctx, struct routing_state *rstate,
-	   const struct pubkey *from, const struct pubkey *to, u64 msatoshi,
-	   double riskfactor, u64 *fee, struct node_connection ***route)
+/* Look up (reversed!) endpoints for a search, and make sure the graph is
+ * current.  Returns false if there can be no route. */
+static bool route_endpoints(struct routing_state *rstate,
+			    const struct pubkey *from, const struct pubkey *to,
+			    u64 msatoshi, struct node **src, struct node **dst)
 {
-	struct node *n, *src, *dst;
-	struct node_map_iter it;
-	struct node_connection *first_conn;
-	int runs, i, best;
-
 	/* Note: we map backwards, since we know the amount of satoshi we want
 	 * at the end, and need to derive how much we need to send. */
-	dst = get_node(rstate, from);
-	src = get_node(rstate, to);
+	*dst = get_node(rstate, from);
+	*src = get_node(rstate, to);
 
-	if (!src) {
+	if (!*src) {
 		status_trace("find_route: cannot find %s",
 			     type_to_string(trc, struct pubkey, to));
-		return NULL;
-	} else if (!dst) {
+		return false;
+	} else if (!*dst) {
 		status_trace("find_route: cannot find myself (%s)",
 			     type_to_string(trc, struct pubkey, to));
-		return NULL;
-	} else if (dst == src) {
+		return false;
+	} else if (*dst == *src) {
 		status_trace("find_route: this is %s, refusing to create empty route",
 			     type_to_string(trc, struct pubkey, to));
-		return NULL;
+		return false;
 	}
 
 	if (msatoshi >= MAX_MSATOSHI) {
 		status_trace("find_route: can't route huge amount %"PRIu64,
 			     msatoshi);
-		return NULL;
+		return false;
 	}
 
-	/* Reset all the information. */
-	clear_bfg(rstate->nodes);
-
-	/* Bellman-Ford-Gibson: like Bellman-Ford, but keep values for
-	 * every path length. */
-	src->bfg[0].total = msatoshi;
-	src->bfg[0].risk = 0;
-
-	for (runs = 0; runs < ROUTING_MAX_HOPS; runs++) {
-		SUPERVERBOSE("Run %i", runs);
-		/* Run through every edge. */
-		for (n = node_map_first(rstate->nodes, &it);
-		     n;
-		     n = node_map_next(rstate->nodes, &it)) {
-			size_t num_edges = tal_count(n->in);
-			for (i = 0; i < num_edges; i++) {
-				SUPERVERBOSE("Node %s edge %i/%zu",
-					     type_to_string(trc, struct pubkey,
-							    &n->id),
-					     i, num_edges);
-				if (!n->in[i]->active) {
-					SUPERVERBOSE("...inactive");
-					continue;
-				}
-				bfg_one_edge(n, i, riskfactor);
-				SUPERVERBOSE("...done");
+	if (rstate->graph.dirty)
+		route_graph_rebuild(rstate);
+	return true;
+}
+
+/* Where a search ended up: the edges from us to the destination. */
+struct route_path {
+	u32 num_edges;
+	u32 edges[ROUTING_MAX_HOPS];
+	/* What the intermediaries charge (including our own first hop). */
+	u64 fee;
+};
+
+/* One search over the graph, skipping edges marked in excluded (if
+ * non-NULL).  This only reads the graph (and the connections it points
+ * to) and writes scratch and path, so get_route_batch can run several
+ * at once. */
+static bool route_search_path(const struct route_graph *graph,
+			      struct route_scratch *scratch,
+			      u32 src, u32 dst, u64 msatoshi,
+			      double riskfactor, u64 now,
+			      const bool *excluded, struct route_path *path)
+{
+	u32 n, e, i;
+
+	reset_route_scratch(scratch, tal_count(graph->nodes));
+
+	/* Dijkstra: settle nodes in order of increasing total + risk,
+	 * starting at the destination, and stop as soon as we reach
+	 * ourselves.  Fees and risk only ever grow along a path, so a
+	 * settled node can never be improved later. */
+	visit_node(scratch, src);
+	scratch->total[src] = msatoshi;
+	heap_update(scratch, src);
+
+	while (heap_pop(scratch, &n)) {
+		if (n == dst)
+			break;
+
+		/* We don't extend paths past the hop limit; a longer
+		 * but cheaper path simply gets pruned here. */
+		if (scratch->hops[n] == ROUTING_MAX_HOPS)
+			continue;
+
+		for (e = graph->in_start[n]; e < graph->in_start[n+1]; e++) {
+			SUPERVERBOSE("Node %s edge %u",
+				     type_to_string(trc, struct pubkey,
+						    &graph->nodes[n]->id), e);
+			if (!graph->active[e]) {
+				SUPERVERBOSE("...inactive");
+				continue;
 			}
+			if (excluded && excluded[e]) {
+				SUPERVERBOSE("...already used");
+				continue;
+			}
+			dijkstra_one_edge(graph, scratch, n, e, riskfactor,
+					  now);
+			SUPERVERBOSE("...done");
 		}
 	}
 
-	best = 0;
-	for (i = 1; i <= ROUTING_MAX_HOPS; i++) {
-		if (dst->bfg[i].total < dst->bfg[best].total)
-			best = i;
-	}
-
 	/* No route? */
-	if (dst->bfg[best].total >= INFINITE) {
-		status_trace("find_route: No route to %s",
-			     type_to_string(trc, struct pubkey, to));
-		return NULL;
+	visit_node(scratch, dst);
+	if (scratch->total[dst] >= INFINITE)
+		return false;
+
+	path->num_edges = scratch->hops[dst];
+	assert(path->num_edges <= ROUTING_MAX_HOPS);
+	for (i = 0, n = dst; i < path->num_edges; i++) {
+		e = scratch->prev[n];
+		path->edges[i] = e;
+		n = graph->conns[e]->dst->index;
+		if (i == 0)
+			path->fee = scratch->total[n] - msatoshi;
 	}
+	assert(n == src);
+	return true;
+}
 
-	/* Save route from *next* hop (we return first hop as peer).
-	 * Note that we take our own fees into account for routing, even
-	 * though we don't pay them: it presumably effects preference. */
-	first_conn = dst->bfg[best].prev;
-	dst = dst->bfg[best].prev->dst;
-	best--;
+/* Turn what route_search_path found back into connections: we return the
+ * first hop (the peer), and the route from the *next* hop on.  Note that
+ * we take our own fees into account for routing, even though we don't
+ * pay them: it presumably effects preference. */
+static struct node_connection *
+path_to_route(const tal_t *ctx, const struct route_graph *graph,
+	      const struct route_path *path, u64 msatoshi, bool *excluded,
+	      u64 *fee, struct node_connection ***route)
+{
+	struct node_connection *first_conn;
+	u32 i, num_hops = path->num_edges - 1;
 
-	*fee = dst->bfg[best].total - msatoshi;
-	*route = tal_arr(ctx, struct node_connection *, best);
-	for (i = 0, n = dst;
-	     i < best;
-	     n = n->bfg[best-i].prev->dst, i++) {
-		(*route)[i] = n->bfg[best-i].prev;
+	if (excluded) {
+		for (i = 0; i < path->num_edges; i++)
+			excluded[path->edges[i]] = true;
 	}
-	assert(n == src);
+	first_conn = graph->conns[path->edges[0]];
+	*fee = path->fee;
+	*route = tal_arr(ctx, struct node_connection *, num_hops);
+	for (i = 0; i < num_hops; i++)
+		(*route)[i] = graph->conns[path->edges[i + 1]];
 
 	msatoshi += *fee;
 	status_trace("find_route: via %s",
 		     type_to_string(trc, struct pubkey, &first_conn->dst->id));
 	/* If there are intermediaries, dump them, and total fees. */
-	if (best != 0) {
-		for (i = 0; i < best; i++) {
+	if (num_hops != 0) {
+		for (i = 0; i < num_hops; i++) {
 			status_trace(" %s (%i+%i=%"PRIu64")",
 				     type_to_string(trc, struct pubkey,
 						    &(*route)[i]->dst->id),
@@ -444,11 +1062,32 @@ find_route(const tal_t *ctx, struct routing_state *rstate,
 			msatoshi -= connection_fee((*route)[i], msatoshi);
 		}
 		status_trace(" =%"PRIi64"(%+"PRIi64")",
-			     (*route)[best-1]->dst->bfg[best-1].total, *fee);
+			     msatoshi + *fee, *fee);
 	}
 	return first_conn;
 }
 
+/* One search, marking the edges of the route found in excluded (if
+ * non-NULL), so the next search avoids them. */
+static struct node_connection *
+route_search(const tal_t *ctx, const struct route_graph *graph,
+	     struct route_scratch *scratch,
+	     const struct node *src, const struct node *dst,
+	     u64 msatoshi, double riskfactor, u64 now, bool *excluded,
+	     u64 *fee, struct node_connection ***route)
+{
+	struct route_path path;
+
+	if (!route_search_path(graph, scratch, src->index, dst->index,
+			       msatoshi, riskfactor, now, excluded, &path)) {
+		status_trace("find_route: No route to %s",
+			     type_to_string(trc, struct pubkey, &src->id));
+		return NULL;
+	}
+	return path_to_route(ctx, graph, &path, msatoshi, excluded, fee,
+			     route);
+}
+
 static struct node_connection *
 add_channel_direction(struct routing_state *rstate, const struct pubkey *from,
 		      const struct pubkey *to,
@@ -467,8 +1106,7 @@ add_channel_direction(struct routing_state *rstate, const struct pubkey *from,
 	} else if (c1) {
 		/* We found the channel by its endpoints, not by scid,
 		 * so update its scid */
-		memcpy(&c1->short_channel_id, short_channel_id,
-		       sizeof(c->short_channel_id));
+		set_connection_scid(rstate, c1, short_channel_id);
 		c1->flags = direction;
 		c = c1;
 	} else {
@@ -478,9 +1116,8 @@ add_channel_direction(struct routing_state *rstate, const struct pubkey *from,
 
 	/* Remember the announcement so we can forward it to new peers */
 	if (announcement) {
-		tal_free(c->channel_announcement);
-		c->channel_announcement = tal_dup_arr(c, u8, announcement,
-						      tal_count(announcement), 0);
+		shared_payload_unref(c->channel_announcement);
+		c->channel_announcement = shared_payload_ref(announcement);
 	}
 
 	return c;
@@ -519,9 +1156,9 @@ static bool check_channel_announcement(
 	       check_signed_hash(&hash, bitcoin2_sig, bitcoin2_key);
 }
 
-const struct short_channel_id *handle_channel_announcement(
-	struct routing_state *rstate,
-	const u8 *announce TAKES)
+static const struct short_channel_id *
+process_channel_announcement(struct routing_state *rstate,
+			     const u8 *announce TAKES, bool check_sigs)
 {
 	struct pending_cannouncement *pending;
 	struct bitcoin_blkid chain_hash;
@@ -530,6 +1167,12 @@ const struct short_channel_id *handle_channel_announcement(
 	secp256k1_ecdsa_signature node_signature_1, node_signature_2;
 	secp256k1_ecdsa_signature bitcoin_signature_1, bitcoin_signature_2;
 
+	if (gossip_msg_redundant(rstate, announce)) {
+		if (taken(announce))
+			tal_free(announce);
+		return NULL;
+	}
+
 	pending = tal(rstate, struct pending_cannouncement);
 	pending->updates[0] = NULL;
 	pending->updates[1] = NULL;
@@ -548,6 +1191,7 @@ const struct short_channel_id *handle_channel_announcement(
 					   &pending->node_id_2,
 					   &pending->bitcoin_key_1,
 					   &pending->bitcoin_key_2)) {
+		rstate->drops.invalid++;
 		tal_free(pending);
 		return NULL;
 	}
@@ -565,6 +1209,7 @@ const struct short_channel_id *handle_channel_announcement(
 	if (unsupported_features(features, NULL)) {
 		status_trace("Ignoring channel announcement, unsupported features %s.",
 			     tal_hex(pending, features));
+		rstate->drops.invalid++;
 		tal_free(pending);
 		return NULL;
 	}
@@ -579,11 +1224,13 @@ const struct short_channel_id *handle_channel_announcement(
 		    "Received channel_announcement %s for unknown chain %s",
 		    tag,
 		    type_to_string(pending, struct bitcoin_blkid, &chain_hash));
+		rstate->drops.invalid++;
 		tal_free(pending);
 		return NULL;
 	}
 
-	if (!check_channel_announcement(&pending->node_id_1, &pending->node_id_2,
+	if (check_sigs
+	    && !check_channel_announcement(&pending->node_id_1, &pending->node_id_2,
 					&pending->bitcoin_key_1,
 					&pending->bitcoin_key_2,
 					&node_signature_1,
@@ -593,6 +1240,7 @@ const struct short_channel_id *handle_channel_announcement(
 					pending->announce)) {
 		status_trace("Signature verification of channel_announcement"
 			     " for %s failed", tag);
+		rstate->drops.bad_signature++;
 		tal_free(pending);
 		return NULL;
 	}
@@ -600,39 +1248,237 @@ const struct short_channel_id *handle_channel_announcement(
 	status_trace("Received channel_announcement for channel %s", tag);
 	tal_free(tag);
 
-	/* FIXME: Handle duplicates as per BOLT #7 */
-	list_add_tail(&rstate->pending_cannouncement, &pending->list);
+	/* gossip_msg_redundant() caught duplicates of anything pending */
+	if (!uintmap_add(&rstate->pending_cannouncements,
+			 short_channel_id_to_uint(&pending->short_channel_id),
+			 pending))
+		abort();
 	return &pending->short_channel_id;
 }
 
+const struct short_channel_id *
+handle_channel_announcement(struct routing_state *rstate,
+			    const u8 *announce TAKES)
+{
+	return process_channel_announcement(rstate, announce, true);
+}
+
 /* While master always processes in order, bitcoind is async, so they could
  * theoretically return out of order. */
 static struct pending_cannouncement *
 find_pending_cannouncement(struct routing_state *rstate,
 			   const struct short_channel_id *scid)
 {
-	struct pending_cannouncement *i;
+	return uintmap_get(&rstate->pending_cannouncements,
+			   short_channel_id_to_uint(scid));
+}
+
+/* Channel announcements and updates replace earlier ones for the same
+ * channel (and direction, for updates: announcements use 0). */
+static void channel_broadcast_key(struct broadcast_key *key, int type,
+				  const struct short_channel_id *scid,
+				  u16 direction)
+{
+	u64 id = short_channel_id_to_uint(scid);
 
-	list_for_each(&rstate->pending_cannouncement, i, list) {
-		if (short_channel_id_eq(scid, &i->short_channel_id))
-			return i;
+	memset(key, 0, sizeof(*key));
+	key->type = type;
+	memcpy(key->tag, &id, sizeof(id));
+	memcpy(key->tag + sizeof(id), &direction, sizeof(direction));
+}
+
+void channel_broadcast_key_decode(const struct broadcast_key *key,
+				  struct short_channel_id *scid,
+				  u16 *direction)
+{
+	u64 id;
+
+	memcpy(&id, key->tag, sizeof(id));
+	memcpy(direction, key->tag + sizeof(id), sizeof(*direction));
+	short_channel_id_from_uint(scid, id);
+}
+
+u64 channel_broadcast_satoshis(const struct routing_state *rstate,
+			       const struct broadcast_key *key)
+{
+	struct short_channel_id scid;
+	struct node_connection *c;
+	u16 direction;
+
+	channel_broadcast_key_decode(key, &scid, &direction);
+	c = get_connection_by_scid(rstate, &scid, 0);
+	if (!c)
+		c = get_connection_by_scid(rstate, &scid, 1);
+	return c ? c->satoshis : 0;
+}
+
+/* A node with no channels left is no use to anyone: forget it too. */
+static void remove_node_if_unused(struct routing_state *rstate,
+				  struct node *node)
+{
+	struct broadcast_key key;
+	size_t i, num;
+
+	if (tal_count(node->in) || tal_count(node->out))
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.type = WIRE_NODE_ANNOUNCEMENT;
+	pubkey_to_der(key.tag, &node->id);
+	if (broadcast_del(rstate->broadcasts, &key)) {
+		queue_broadcast(rstate->broadcasts, &key, NULL);
+		gossip_store_removed(rstate->store);
 	}
-	return NULL;
+	node_map_del(rstate->nodes, node);
+
+	i = node_by_id_index(rstate, &node->id);
+	num = tal_count(rstate->nodes_by_id) - 1;
+	assert(rstate->nodes_by_id[i] == node);
+	memmove(rstate->nodes_by_id + i, rstate->nodes_by_id + i + 1,
+		(num - i) * sizeof(*rstate->nodes_by_id));
+	tal_resize(&rstate->nodes_by_id, num);
+	tal_free(node);
+}
+
+void routing_channel_closed(struct routing_state *rstate,
+			    const struct short_channel_id *scid)
+{
+	struct broadcast_key key;
+	struct node_connection *c;
+	struct node *ends[2] = { NULL, NULL };
+	bool queued = false;
+	int dir;
+
+	for (dir = 0; dir < 2; dir++) {
+		channel_broadcast_key(&key, WIRE_CHANNEL_UPDATE, scid, dir);
+		queued |= broadcast_del(rstate->broadcasts, &key);
+
+		c = get_connection_by_scid(rstate, scid, dir);
+		if (!c)
+			continue;
+		ends[0] = c->src;
+		ends[1] = c->dst;
+		tal_free(c);
+	}
+
+	/* If we ever broadcast it, leave a tombstone in its place so
+	 * getgossipchanges can report it gone. */
+	channel_broadcast_key(&key, WIRE_CHANNEL_ANNOUNCEMENT, scid, 0);
+	if (broadcast_del(rstate->broadcasts, &key) || queued) {
+		queue_broadcast(rstate->broadcasts, &key, NULL);
+		gossip_store_removed(rstate->store);
+	}
+
+	if (!ends[0])
+		return;
+
+	status_trace("Channel %s closed",
+		     type_to_string(trc, struct short_channel_id, scid));
+	remove_node_if_unused(rstate, ends[0]);
+	remove_node_if_unused(rstate, ends[1]);
+}
+
+/* Add both directions of a channel_announcement we've validated.
+ * Returns true if the channel is new (and so was queued to broadcast). */
+static bool add_channel_announcement(struct routing_state *rstate,
+				     const struct pubkey *node_id_1,
+				     const struct pubkey *node_id_2,
+				     const struct short_channel_id *scid,
+				     u64 satoshis,
+				     const u8 *announce)
+{
+	bool forward;
+	struct node_connection *c0, *c1;
+	struct broadcast_key key;
+	const u8 *shared = new_shared_payload(announce);
+
+	/* Is this a new connection? It is if we don't know the
+	 * channel yet, or do not have a matching announcement in the
+	 * case of side-loaded channels*/
+	c0 = get_connection(rstate, node_id_2, node_id_1);
+	c1 = get_connection(rstate, node_id_1, node_id_2);
+	forward = !c0 || !c1 || !c0->channel_announcement || !c1->channel_announcement;
+
+	c0 = add_channel_direction(rstate, node_id_1, node_id_2, scid, shared);
+	c1 = add_channel_direction(rstate, node_id_2, node_id_1, scid, shared);
+	if (satoshis) {
+		c0->satoshis = c1->satoshis = satoshis;
+		routing_connection_changed(rstate, c0);
+		routing_connection_changed(rstate, c1);
+	}
+
+	if (forward) {
+		channel_broadcast_key(&key, WIRE_CHANNEL_ANNOUNCEMENT, scid, 0);
+		if (queue_broadcast(rstate->broadcasts, &key, shared))
+			status_failed(STATUS_FAIL_INTERNAL_ERROR,
+				      "Announcement %s was replaced?",
+				      tal_hex(trc, shared));
+		gossip_store_append_channel_announcement(rstate->store,
+							 shared, satoshis);
+	}
+	shared_payload_unref(shared);
+	return forward;
+}
+
+bool routing_add_channel_announcement(struct routing_state *rstate,
+				      const u8 *announce, u64 satoshis)
+{
+	const tal_t *tmpctx = tal_tmpctx(rstate);
+	secp256k1_ecdsa_signature node_signature_1, node_signature_2;
+	secp256k1_ecdsa_signature bitcoin_signature_1, bitcoin_signature_2;
+	struct bitcoin_blkid chain_hash;
+	struct short_channel_id scid;
+	struct pubkey node_id_1, node_id_2, bitcoin_key_1, bitcoin_key_2;
+	u8 *features;
+	bool added;
+
+	if (!fromwire_channel_announcement(tmpctx, announce, NULL,
+					   &node_signature_1,
+					   &node_signature_2,
+					   &bitcoin_signature_1,
+					   &bitcoin_signature_2,
+					   &features,
+					   &chain_hash,
+					   &scid,
+					   &node_id_1,
+					   &node_id_2,
+					   &bitcoin_key_1,
+					   &bitcoin_key_2)
+	    || !structeq(&chain_hash, &rstate->chain_hash)) {
+		tal_free(tmpctx);
+		return false;
+	}
+
+	added = add_channel_announcement(rstate, &node_id_1, &node_id_2,
+					 &scid, satoshis, announce);
+	tal_free(tmpctx);
+	return added;
 }
 
 bool handle_pending_cannouncement(struct routing_state *rstate,
 				  const struct short_channel_id *scid,
+				  u64 satoshis,
 				  const u8 *outscript)
 {
 	bool forward, local;
-	struct node_connection *c0, *c1;
 	const char *tag;
 	const u8 *s;
 	struct pending_cannouncement *pending;
 
 	pending = find_pending_cannouncement(rstate, scid);
-	assert(pending);
-	list_del_from(&rstate->pending_cannouncement, &pending->list);
+	if (!pending) {
+		/* We're checking a channel we replayed from the store. */
+		if (tal_len(outscript) == 0) {
+			status_trace("Stored channel %s is spent",
+				     type_to_string(trc,
+						    struct short_channel_id,
+						    scid));
+			routing_channel_closed(rstate, scid);
+		}
+		return false;
+	}
+	uintmap_del(&rstate->pending_cannouncements,
+		    short_channel_id_to_uint(scid));
 
 	tag = type_to_string(pending, struct short_channel_id, scid);
 
@@ -642,6 +1488,7 @@ bool handle_pending_cannouncement(struct routing_state *rstate,
 	 */
 	if (tal_len(outscript) == 0) {
 		status_trace("channel_announcement: no unspent txout %s", tag);
+		rstate->drops.bad_txout++;
 		tal_free(pending);
 		return false;
 	}
@@ -662,30 +1509,16 @@ bool handle_pending_cannouncement(struct routing_state *rstate,
 	if (!scripteq(s, outscript)) {
 		status_trace("channel_announcement: txout %s expectes %s, got %s",
 			     tag, tal_hex(trc, s), tal_hex(trc, outscript));
+		rstate->drops.bad_txout++;
 		tal_free(pending);
 		return false;
 	}
 
-	/* Is this a new connection? It is if we don't know the
-	 * channel yet, or do not have a matching announcement in the
-	 * case of side-loaded channels*/
-	c0 = get_connection(rstate, &pending->node_id_2, &pending->node_id_1);
-	c1 = get_connection(rstate, &pending->node_id_1, &pending->node_id_2);
-	forward = !c0 || !c1 || !c0->channel_announcement || !c1->channel_announcement;
-
-	add_channel_direction(rstate, &pending->node_id_1, &pending->node_id_2,
-			      &pending->short_channel_id, pending->announce);
-	add_channel_direction(rstate, &pending->node_id_2, &pending->node_id_1,
-			      &pending->short_channel_id, pending->announce);
-
-	if (forward) {
-		if (queue_broadcast(rstate->broadcasts,
-				    WIRE_CHANNEL_ANNOUNCEMENT,
-				    (u8*)tag, pending->announce))
-			status_failed(STATUS_FAIL_INTERNAL_ERROR,
-				      "Announcement %s was replaced?",
-				      tal_hex(trc, pending->announce));
-	}
+	forward = add_channel_announcement(rstate, &pending->node_id_1,
+					   &pending->node_id_2,
+					   &pending->short_channel_id,
+					   satoshis,
+					   pending->announce);
 
 	local = pubkey_eq(&pending->node_id_1, &rstate->local_id) ||
 		pubkey_eq(&pending->node_id_2, &rstate->local_id);
@@ -720,7 +1553,8 @@ static bool update_to_pending(struct routing_state *rstate,
 	return true;
 }
 
-void handle_channel_update(struct routing_state *rstate, const u8 *update)
+static bool process_channel_update(struct routing_state *rstate,
+				   const u8 *update, bool check_sig)
 {
 	u8 *serialized;
 	struct node_connection *c;
@@ -735,16 +1569,24 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update)
 	const tal_t *tmpctx = tal_tmpctx(rstate);
 	struct bitcoin_blkid chain_hash;
 	u8 direction;
+	struct broadcast_key key;
+	const u8 *shared;
 	size_t len = tal_len(update);
 
+	if (gossip_msg_redundant(rstate, update)) {
+		tal_free(tmpctx);
+		return false;
+	}
+
 	serialized = tal_dup_arr(tmpctx, u8, update, len, 0);
 	if (!fromwire_channel_update(serialized, NULL, &signature,
 				     &chain_hash, &short_channel_id,
 				     &timestamp, &flags, &expiry,
 				     &htlc_minimum_msat, &fee_base_msat,
 				     &fee_proportional_millionths)) {
+		rstate->drops.invalid++;
 		tal_free(tmpctx);
-		return;
+		return false;
 	}
 	direction = flags & 0x1;
 
@@ -757,8 +1599,9 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update)
 		status_trace("Received channel_update for unknown chain %s",
 			     type_to_string(tmpctx, struct bitcoin_blkid,
 					    &chain_hash));
+		rstate->drops.invalid++;
 		tal_free(tmpctx);
-		return;
+		return false;
 	}
 
 	status_trace("Received channel_update for channel %s(%d)",
@@ -771,7 +1614,7 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update)
 			     type_to_string(trc, struct short_channel_id,
 					    &short_channel_id), direction);
 		tal_free(tmpctx);
-		return;
+		return false;
 	}
 
 	c = get_connection_by_scid(rstate, &short_channel_id, direction);
@@ -780,16 +1623,20 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update)
 		status_trace("Ignoring update for unknown channel %s",
 			     type_to_string(trc, struct short_channel_id,
 					    &short_channel_id));
+		rstate->drops.unknown_channel_or_node++;
 		tal_free(tmpctx);
-		return;
+		return false;
 	} else if (c->last_timestamp >= timestamp) {
 		status_trace("Ignoring outdated update.");
+		rstate->drops.stale_channel_update++;
 		tal_free(tmpctx);
-		return;
-	} else if (!check_channel_update(&c->src->id, &signature, serialized)) {
+		return false;
+	} else if (check_sig
+		   && !check_channel_update(&c->src->id, &signature, serialized)) {
 		status_trace("Signature verification failed.");
+		rstate->drops.bad_signature++;
 		tal_free(tmpctx);
-		return;
+		return false;
 	}
 
 	//FIXME(cdecker) Check signatures
@@ -799,6 +1646,7 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update)
 	c->base_fee = fee_base_msat;
 	c->proportional_fee = fee_proportional_millionths;
 	c->active = (flags & ROUTING_FLAGS_DISABLED) == 0;
+	routing_connection_changed(rstate, c);
 	status_trace("Channel %s(%d) was updated.",
 		     type_to_string(trc, struct short_channel_id,
 				    &short_channel_id),
@@ -812,19 +1660,31 @@ void handle_channel_update(struct routing_state *rstate, const u8 *update)
 			     direction,
 			     fee_proportional_millionths);
 		c->active = false;
+		routing_connection_changed(rstate, c);
 	}
 
-	u8 *tag = tal_arr(tmpctx, u8, 0);
-	towire_short_channel_id(&tag, &short_channel_id);
-	towire_u16(&tag, direction);
-	queue_broadcast(rstate->broadcasts,
-			WIRE_CHANNEL_UPDATE,
-			tag,
-			serialized);
+	channel_broadcast_key(&key, WIRE_CHANNEL_UPDATE, &short_channel_id,
+			      direction);
+	shared = new_shared_payload(take(serialized));
+	queue_broadcast(rstate->broadcasts, &key, shared);
+	gossip_store_append(rstate->store, shared);
 
-	tal_free(c->channel_update);
-	c->channel_update = tal_steal(c, serialized);
+	/* Our reference passes to the connection */
+	shared_payload_unref(c->channel_update);
+	c->channel_update = shared;
 	tal_free(tmpctx);
+	return true;
+}
+
+bool handle_channel_update(struct routing_state *rstate, const u8 *update)
+{
+	return process_channel_update(rstate, update, true);
+}
+
+void routing_add_channel_update(struct routing_state *rstate,
+				const u8 *update)
+{
+	process_channel_update(rstate, update, false);
 }
 
 static struct wireaddr *read_addresses(const tal_t *ctx, const u8 *ser)
@@ -861,8 +1721,8 @@ static struct wireaddr *read_addresses(const tal_t *ctx, const u8 *ser)
 	return wireaddrs;
 }
 
-void handle_node_announcement(
-	struct routing_state *rstate, const u8 *node_ann)
+static void process_node_announcement(struct routing_state *rstate,
+				      const u8 *node_ann, bool check_sig)
 {
 	u8 *serialized;
 	struct sha256_double hash;
@@ -875,13 +1735,21 @@ void handle_node_announcement(
 	u8 *features, *addresses;
 	const tal_t *tmpctx = tal_tmpctx(rstate);
 	struct wireaddr *wireaddrs;
+	struct broadcast_key key;
+	const u8 *shared;
 	size_t len = tal_len(node_ann);
 
+	if (gossip_msg_redundant(rstate, node_ann)) {
+		tal_free(tmpctx);
+		return;
+	}
+
 	serialized = tal_dup_arr(tmpctx, u8, node_ann, len, 0);
 	if (!fromwire_node_announcement(tmpctx, serialized, NULL,
 					&signature, &features, &timestamp,
 					&node_id, rgb_color, alias,
 					&addresses)) {
+		rstate->drops.invalid++;
 		tal_free(tmpctx);
 		return;
 	}
@@ -895,6 +1763,7 @@ void handle_node_announcement(
 	if (unsupported_features(features, NULL)) {
 		status_trace("Ignoring node announcement, unsupported features %s.",
 			     tal_hex(tmpctx, features));
+		rstate->drops.invalid++;
 		tal_free(tmpctx);
 		return;
 	}
@@ -902,24 +1771,32 @@ void handle_node_announcement(
 	status_trace("Received node_announcement for node %s",
 		     type_to_string(trc, struct pubkey, &node_id));
 
-	sha256_double(&hash, serialized + 66, tal_count(serialized) - 66);
-	if (!check_signed_hash(&hash, &signature, &node_id)) {
-		status_trace("Ignoring node announcement, signature verification failed.");
-		tal_free(tmpctx);
-		return;
-	}
 	node = get_node(rstate, &node_id);
 
 	if (!node) {
 		status_trace("Node not found, was the node_announcement preceded by at least channel_announcement?");
+		rstate->drops.unknown_channel_or_node++;
 		tal_free(tmpctx);
 		return;
 	} else if (node->last_timestamp >= timestamp) {
 		status_trace("Ignoring node announcement, it's outdated.");
+		rstate->drops.stale_node_announcement++;
 		tal_free(tmpctx);
 		return;
 	}
 
+	/* Only now it's worth checking the signature. */
+	if (check_sig) {
+		sha256_double(&hash, serialized + 66,
+			      tal_count(serialized) - 66);
+		if (!check_signed_hash(&hash, &signature, &node_id)) {
+			status_trace("Ignoring node announcement, signature verification failed.");
+			rstate->drops.bad_signature++;
+			tal_free(tmpctx);
+			return;
+		}
+	}
+
 	wireaddrs = read_addresses(tmpctx, addresses);
 	if (!wireaddrs) {
 		status_trace("Unable to parse addresses.");
@@ -933,40 +1810,184 @@ void handle_node_announcement(
 
 	memcpy(node->rgb_color, rgb_color, 3);
 
-	u8 *tag = tal_arr(tmpctx, u8, 0);
-	towire_pubkey(&tag, &node_id);
-	queue_broadcast(rstate->broadcasts,
-			WIRE_NODE_ANNOUNCEMENT,
-			tag,
-			serialized);
-	tal_free(node->node_announcement);
-	node->node_announcement = tal_steal(node, serialized);
+	memset(&key, 0, sizeof(key));
+	key.type = WIRE_NODE_ANNOUNCEMENT;
+	pubkey_to_der(key.tag, &node_id);
+	shared = new_shared_payload(take(serialized));
+	queue_broadcast(rstate->broadcasts, &key, shared);
+	gossip_store_append(rstate->store, shared);
+
+	/* Our reference passes to the node */
+	shared_payload_unref(node->node_announcement);
+	node->node_announcement = shared;
 	tal_free(tmpctx);
 }
 
-struct route_hop *get_route(tal_t *ctx, struct routing_state *rstate,
-			    const struct pubkey *source,
-			    const struct pubkey *destination,
-			    const u32 msatoshi, double riskfactor,
-			    u32 final_cltv)
+void handle_node_announcement(struct routing_state *rstate, const u8 *node_ann)
 {
-	struct node_connection **route;
-	u64 total_amount;
-	unsigned int total_delay;
-	u64 fee;
-	struct route_hop *hops;
-	int i;
-	struct node_connection *first_conn;
+	process_node_announcement(rstate, node_ann, true);
+}
 
-	first_conn = find_route(ctx, rstate, source, destination, msatoshi,
-				riskfactor / BLOCKS_PER_YEAR / 10000,
-				&fee, &route);
+void routing_add_node_announcement(struct routing_state *rstate,
+				   const u8 *node_ann)
+{
+	process_node_announcement(rstate, node_ann, false);
+}
 
-	if (!first_conn) {
-		return NULL;
+bool gossip_msg_redundant(struct routing_state *rstate, const u8 *msg)
+{
+	const u8 *cursor = msg;
+	size_t max = tal_len(msg);
+	struct short_channel_id scid;
+	struct node_connection *c0, *c1;
+	struct pubkey node_id;
+	struct node *node;
+	u32 timestamp;
+	u16 flags, len;
+
+	switch (fromwire_peektype(msg)) {
+	case WIRE_CHANNEL_ANNOUNCEMENT:
+		/* type, 4 signatures, then features and chain_hash */
+		fromwire_pad(&cursor, &max, 2 + 256);
+		len = fromwire_u16(&cursor, &max);
+		fromwire_pad(&cursor, &max, len + 32);
+		fromwire_short_channel_id(&cursor, &max, &scid);
+		if (!cursor)
+			return false;
+		c0 = get_connection_by_scid(rstate, &scid, 0);
+		c1 = get_connection_by_scid(rstate, &scid, 1);
+		if (find_pending_cannouncement(rstate, &scid)
+		    || (c0 && c0->channel_announcement
+			&& c1 && c1->channel_announcement)) {
+			rstate->drops.duplicate_channel_announcement++;
+			return true;
+		}
+		return false;
+
+	case WIRE_CHANNEL_UPDATE:
+		/* type, signature, chain_hash */
+		fromwire_pad(&cursor, &max, 2 + 64 + 32);
+		fromwire_short_channel_id(&cursor, &max, &scid);
+		timestamp = fromwire_u32(&cursor, &max);
+		flags = fromwire_u16(&cursor, &max);
+		if (!cursor)
+			return false;
+		c0 = get_connection_by_scid(rstate, &scid, flags & 0x1);
+		if (c0 && c0->last_timestamp >= timestamp) {
+			rstate->drops.stale_channel_update++;
+			return true;
+		}
+		return false;
+
+	case WIRE_NODE_ANNOUNCEMENT:
+		/* type, signature, then features */
+		fromwire_pad(&cursor, &max, 2 + 64);
+		len = fromwire_u16(&cursor, &max);
+		fromwire_pad(&cursor, &max, len);
+		timestamp = fromwire_u32(&cursor, &max);
+		fromwire_pubkey(&cursor, &max, &node_id);
+		if (!cursor)
+			return false;
+		node = get_node(rstate, &node_id);
+		if (node && node->last_timestamp >= timestamp) {
+			rstate->drops.stale_node_announcement++;
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+size_t gossip_msg_sigs(struct routing_state *rstate, const u8 *msg,
+		       struct gossip_sig sigs[GOSSIP_MAX_SIGS])
+{
+	const tal_t *tmpctx = tal_tmpctx(rstate);
+	secp256k1_ecdsa_signature sig[GOSSIP_MAX_SIGS];
+	struct pubkey key[GOSSIP_MAX_SIGS];
+	struct bitcoin_blkid chain_hash;
+	struct short_channel_id scid;
+	struct node_connection *c;
+	u8 *features, *addresses, rgb_color[3], alias[32];
+	u32 timestamp, fee_base_msat, fee_proportional_millionths;
+	u16 flags, expiry;
+	u64 htlc_minimum_msat;
+	size_t i, num = 0, offset = 0;
+
+	switch (fromwire_peektype(msg)) {
+	case WIRE_CHANNEL_ANNOUNCEMENT:
+		/* 2 byte msg type + 256 byte signatures */
+		offset = 258;
+		if (fromwire_channel_announcement(tmpctx, msg, NULL,
+						  &sig[0], &sig[1],
+						  &sig[2], &sig[3],
+						  &features, &chain_hash, &scid,
+						  &key[0], &key[1],
+						  &key[2], &key[3]))
+			num = 4;
+		break;
+	case WIRE_CHANNEL_UPDATE:
+		/* 2 byte msg type + 64 byte signature */
+		offset = 66;
+		if (!fromwire_channel_update(msg, NULL, &sig[0], &chain_hash,
+					     &scid, &timestamp, &flags,
+					     &expiry, &htlc_minimum_msat,
+					     &fee_base_msat,
+					     &fee_proportional_millionths))
+			break;
+		/* If we don't know the channel, we don't know who signs:
+		 * handle_channel_update will defer or ignore it anyway. */
+		c = get_connection_by_scid(rstate, &scid, flags & 0x1);
+		if (c) {
+			key[0] = c->src->id;
+			num = 1;
+		}
+		break;
+	case WIRE_NODE_ANNOUNCEMENT:
+		offset = 66;
+		if (fromwire_node_announcement(tmpctx, msg, NULL, &sig[0],
+					       &features, &timestamp, &key[0],
+					       rgb_color, alias, &addresses))
+			num = 1;
+		break;
 	}
 
-	/* Fees, delays need to be calculated backwards along route. */
+	for (i = 0; i < num; i++) {
+		sigs[i].msg = msg;
+		sigs[i].offset = offset;
+		sigs[i].sig = sig[i];
+		sigs[i].key = key[i];
+	}
+	tal_free(tmpctx);
+	return num;
+}
+
+const struct short_channel_id *handle_checked_gossip(struct routing_state *rstate,
+						     const u8 *msg)
+{
+	switch (fromwire_peektype(msg)) {
+	case WIRE_CHANNEL_ANNOUNCEMENT:
+		return process_channel_announcement(rstate, msg, false);
+	case WIRE_CHANNEL_UPDATE:
+		process_channel_update(rstate, msg, false);
+		break;
+	case WIRE_NODE_ANNOUNCEMENT:
+		process_node_announcement(rstate, msg, false);
+		break;
+	}
+	return NULL;
+}
+
+/* Fees, delays need to be calculated backwards along route. */
+static struct route_hop *route_to_hops(const tal_t *ctx,
+				       const struct node_connection *first_conn,
+				       struct node_connection **route,
+				       u32 msatoshi, u32 final_cltv)
+{
+	struct route_hop *hops;
+	u64 total_amount;
+	unsigned int total_delay;
+	int i;
+
 	hops = tal_arr(ctx, struct route_hop, tal_count(route) + 1);
 	total_amount = msatoshi;
 	total_delay = final_cltv;
@@ -990,3 +2011,231 @@ struct route_hop *get_route(tal_t *ctx, struct routing_state *rstate,
 	/* FIXME: Shadow route! */
 	return hops;
 }
+
+static bool connection_can_carry(const struct node_connection *c,
+				 u64 msatoshi)
+{
+	return msatoshi >= c->htlc_minimum_msat
+		&& (!c->satoshis || msatoshi <= c->satoshis * 1000);
+}
+
+/* A cached route was found for a similar amount: it still has to respect
+ * each connection's htlc minimum and capacity for this one. */
+static bool cached_route_usable(const struct route_cache_entry *e,
+				u64 msatoshi)
+{
+	int i;
+
+	for (i = tal_count(e->route) - 1; i >= 0; i--) {
+		if (!connection_can_carry(e->route[i], msatoshi))
+			return false;
+		msatoshi += connection_fee(e->route[i], msatoshi);
+	}
+	return connection_can_carry(e->first_conn, msatoshi)
+		&& msatoshi < MAX_MSATOSHI;
+}
+
+/* A query cache missed, waiting for (or with) its search result. */
+struct route_job {
+	struct route_query *query;
+	struct route_cache_key key;
+	u32 src, dst;
+	double riskfactor;
+
+	/* Filled in by run_route_jobs */
+	bool found;
+	struct route_path path;
+};
+
+/* One thread's share of the jobs: every stride'th, from first. */
+struct route_worker {
+	const struct route_graph *graph;
+	struct route_scratch *scratch;
+	struct route_job *jobs;
+	size_t first, stride;
+	u64 now;
+};
+
+/* Only writes its own scratch and jobs: the graph doesn't change until
+ * every worker is joined. */
+static void *run_route_jobs(void *arg)
+{
+	struct route_worker *w = arg;
+	size_t i;
+
+	for (i = w->first; i < tal_count(w->jobs); i += w->stride) {
+		struct route_job *j = &w->jobs[i];
+		j->found = route_search_path(w->graph, w->scratch,
+					     j->src, j->dst,
+					     j->query->msatoshi,
+					     j->riskfactor, w->now, NULL,
+					     &j->path);
+	}
+	return NULL;
+}
+
+void get_route_batch(const tal_t *ctx, struct routing_state *rstate,
+		     struct route_query *queries, size_t num)
+{
+	tal_t *tmpctx = tal_tmpctx(ctx);
+	struct route_job *jobs = tal_arr(tmpctx, struct route_job, 0);
+	struct route_worker workers[MAX_ROUTE_THREADS];
+	pthread_t threads[MAX_ROUTE_THREADS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i, n = 0, nthreads, started = 0;
+	u64 now = time_now().ts.tv_sec;
+
+	for (i = 0; i < num; i++) {
+		struct route_query *q = &queries[i];
+		struct route_cache_entry *e;
+		struct route_cache_key key;
+		struct node *src, *dst;
+
+		q->hops = NULL;
+		route_cache_key_init(&key, &q->source, &q->destination,
+				     q->msatoshi, q->riskfactor);
+		e = route_cache_map_get(&rstate->route_cache.map, &key);
+		if (e && cached_route_usable(e, q->msatoshi)) {
+			rstate->route_cache.hits++;
+			list_del_from(&rstate->route_cache.lru, &e->list);
+			list_add(&rstate->route_cache.lru, &e->list);
+			q->hops = route_to_hops(ctx, e->first_conn, e->route,
+						q->msatoshi, q->final_cltv);
+			continue;
+		}
+		rstate->route_cache.misses++;
+
+		if (!route_endpoints(rstate, &q->source, &q->destination,
+				     q->msatoshi, &src, &dst))
+			continue;
+
+		tal_resize(&jobs, n + 1);
+		jobs[n].query = q;
+		jobs[n].key = key;
+		jobs[n].src = src->index;
+		jobs[n].dst = dst->index;
+		jobs[n].riskfactor = q->riskfactor / BLOCKS_PER_YEAR / 10000;
+		n++;
+	}
+
+	nthreads = n;
+	if (cpus > 0 && nthreads > (size_t)cpus)
+		nthreads = cpus;
+	if (nthreads > MAX_ROUTE_THREADS)
+		nthreads = MAX_ROUTE_THREADS;
+
+	for (i = 0; i < nthreads; i++) {
+		workers[i].graph = &rstate->graph;
+		workers[i].scratch = route_scratch(rstate, i);
+		workers[i].jobs = jobs;
+		workers[i].first = i;
+		workers[i].stride = nthreads;
+		workers[i].now = now;
+	}
+
+	/* As in sigcheck: our own thread does the first share, and any
+	 * share we couldn't start a thread for. */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, run_route_jobs,
+				   &workers[i]) != 0) {
+			status_trace("get_route_batch: can't start thread,"
+				     " searching inline");
+			break;
+		}
+		started = i;
+	}
+	if (nthreads)
+		run_route_jobs(&workers[0]);
+	for (i = started + 1; i < nthreads; i++)
+		run_route_jobs(&workers[i]);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < n; i++) {
+		struct route_query *q = jobs[i].query;
+		struct node_connection *first_conn, **route;
+		u64 fee;
+
+		if (!jobs[i].found) {
+			status_trace("find_route: No route to %s",
+				     type_to_string(trc, struct pubkey,
+						    &q->destination));
+			continue;
+		}
+
+		first_conn = path_to_route(tmpctx, &rstate->graph,
+					   &jobs[i].path, q->msatoshi, NULL,
+					   &fee, &route);
+
+		/* Replaces any cached route which didn't suit this amount
+		 * (or which an earlier query in this batch just found). */
+		tal_free(route_cache_map_get(&rstate->route_cache.map,
+					     &jobs[i].key));
+		route_cache_add(rstate, &jobs[i].key, first_conn, route);
+
+		q->hops = route_to_hops(ctx, first_conn, route,
+					q->msatoshi, q->final_cltv);
+	}
+	tal_free(tmpctx);
+}
+
+struct route_hop *get_route(tal_t *ctx, struct routing_state *rstate,
+			    const struct pubkey *source,
+			    const struct pubkey *destination,
+			    const u32 msatoshi, double riskfactor,
+			    u32 final_cltv)
+{
+	struct route_query q;
+
+	q.source = *source;
+	q.destination = *destination;
+	q.msatoshi = msatoshi;
+	q.riskfactor = riskfactor;
+	q.final_cltv = final_cltv;
+	get_route_batch(ctx, rstate, &q, 1);
+	return q.hops;
+}
+
+struct route_hop **get_routes(const tal_t *ctx, struct routing_state *rstate,
+			      const struct pubkey *source,
+			      const struct pubkey *destination,
+			      const u32 msatoshi, double riskfactor,
+			      u32 final_cltv, size_t max_routes)
+{
+	struct route_hop **routes = tal_arr(ctx, struct route_hop *, 0);
+	tal_t *tmpctx;
+	struct route_scratch *scratch;
+	struct node *src, *dst;
+	bool *excluded;
+	size_t n = 0;
+	u64 now = time_now().ts.tv_sec;
+
+	if (!route_endpoints(rstate, source, destination, msatoshi, &src, &dst))
+		return routes;
+
+	/* Each search reuses the same graph and scratch space, and leaves
+	 * out every edge an earlier route used: the cheapest route comes
+	 * first, and no two routes share a channel direction. */
+	tmpctx = tal_tmpctx(routes);
+	scratch = route_scratch(rstate, 0);
+	excluded = tal_arrz(tmpctx, bool, tal_count(rstate->graph.src));
+
+	while (n < max_routes) {
+		struct node_connection *first_conn, **route;
+		u64 fee;
+
+		first_conn = route_search(tmpctx, &rstate->graph, scratch,
+					  src, dst, msatoshi,
+					  riskfactor / BLOCKS_PER_YEAR / 10000,
+					  now, excluded, &fee, &route);
+		if (!first_conn)
+			break;
+
+		tal_resize(&routes, n + 1);
+		routes[n++] = route_to_hops(routes, first_conn, route,
+					    msatoshi, final_cltv);
+		tal_free(route);
+	}
+	tal_free(tmpctx);
+	return routes;
+}
@@ -3,7 +3,9 @@
 #include "config.h"
 #include <bitcoin/pubkey.h>
 #include <ccan/htable/htable_type.h>
+#include <ccan/list/list.h>
 #include <gossipd/broadcast.h>
+#include <gossipd/sigcheck.h>
 #include <wire/wire.h>
 
 #define ROUTING_MAX_HOPS 20
@@ -27,6 +29,9 @@ struct node_connection {
 	/* Minimum number of msatoshi in an HTLC */
 	u32 htlc_minimum_msat;
 
+	/* Channel capacity (the funding output amount), 0 if unknown */
+	u64 satoshis;
+
 	/* The channel ID, as determined by the anchor transaction */
 	struct short_channel_id short_channel_id;
 
@@ -34,9 +39,25 @@ struct node_connection {
 	 * things indicated direction wrt the `channel_id` */
 	u16 flags;
 
-	/* Cached `channel_announcement` and `channel_update` we might forward to new peers*/
-	u8 *channel_announcement;
-	u8 *channel_update;
+	/* Cached `channel_announcement` and `channel_update` we might forward
+	 * to new peers (shared with the broadcast queue) */
+	const u8 *channel_announcement;
+	const u8 *channel_update;
+
+	/* Our index in the route_graph edge arrays (if it's not dirty) */
+	u32 edge_index;
+
+	/* Last failure a payment reported for this connection, at
+	 * fail_time: routes through it cost extra, by a penalty which
+	 * halves every fail_halflife seconds (0 if it never failed).
+	 * fail_origin_index is ROUTING_FAILURE_LOCAL if we failed it. */
+	u16 failcode;
+	u16 fail_origin_index;
+	u64 fail_time;
+	u32 fail_halflife;
+
+	/* Cached routes which go through us. */
+	struct route_cache_entry **cached_routes;
 };
 
 struct node {
@@ -51,15 +72,8 @@ struct node {
 	/* Routes connecting to us, from us. */
 	struct node_connection **in, **out;
 
-	/* Temporary data for routefinding. */
-	struct {
-		/* Total to get to here from target. */
-		u64 total;
-		/* Total risk premium of this route. */
-		u64 risk;
-		/* Where that came from. */
-		struct node_connection *prev;
-	} bfg[ROUTING_MAX_HOPS+1];
+	/* Our index in the route_graph (if it's not dirty) */
+	u32 index;
 
 	/* UTF-8 encoded alias as tal_arr, not zero terminated */
 	u8 *alias;
@@ -67,8 +81,9 @@ struct node {
 	/* Color to be used when displaying the name */
 	u8 rgb_color[3];
 
-	/* Cached `node_announcement` we might forward to new peers. */
-	u8 *node_announcement;
+	/* Cached `node_announcement` we might forward to new peers
+	 * (shared with the broadcast queue). */
+	const u8 *node_announcement;
 };
 
 const secp256k1_pubkey *node_map_keyof_node(const struct node *n);
@@ -76,19 +91,137 @@ size_t node_map_hash_key(const secp256k1_pubkey *key);
 bool node_map_node_eq(const struct node *n, const secp256k1_pubkey *key);
 HTABLE_DEFINE_TYPE(struct node, node_map_keyof_node, node_map_hash_key, node_map_node_eq, node_map);
 
+/* Both directions of a channel share a short_channel_id, so there can be
+ * two entries per key: the direction bit in flags tells them apart. */
+const struct short_channel_id *scid_map_keyof_conn(const struct node_connection *c);
+size_t scid_map_hash_key(const struct short_channel_id *scid);
+bool scid_map_conn_eq(const struct node_connection *c,
+		      const struct short_channel_id *scid);
+HTABLE_DEFINE_TYPE(struct node_connection, scid_map_keyof_conn, scid_map_hash_key, scid_map_conn_eq, scid_map);
+
+/* Compact copy of the graph for route searches: nodes get dense indices,
+ * the incoming edges of each node are stored contiguously (CSR), and the
+ * fields route finding looks at live in one array per field.  It's
+ * rebuilt lazily after nodes or connections come and go; changes to an
+ * existing connection are written through by routing_connection_changed. */
+struct route_graph {
+	/* Do we need to rebuild before next use? */
+	bool dirty;
+
+	/* Nodes, by index */
+	struct node **nodes;
+
+	/* Incoming edges of node n are in_start[n] to in_start[n+1]-1 */
+	u32 *in_start;
+
+	/* Per edge: index of source node, and routing parameters. */
+	u32 *src;
+	u32 *base_fee;
+	u32 *proportional_fee;
+	u32 *delay;
+	u32 *htlc_minimum_msat;
+	u64 *capacity_msat;
+	bool *active;
+	u64 *fail_time;
+	u32 *fail_halflife;
+
+	/* The node_connection each edge was built from. */
+	struct node_connection **conns;
+};
+
+/* What a cached route was found for: amount and riskfactor are
+ * log2-bucketed, so similar payments share a route. */
+struct route_cache_key {
+	struct pubkey source, destination;
+	u8 amount_bucket, riskfactor_bucket;
+};
+
+struct route_cache_entry {
+	/* rstate->route_cache.lru, most recently used first */
+	struct list_node list;
+
+	struct route_cache_key key;
+
+	/* As route_search returns them: first hop, then the rest. */
+	struct node_connection *first_conn;
+	struct node_connection **route;
+};
+
+const struct route_cache_key *route_cache_keyof(const struct route_cache_entry *e);
+size_t route_cache_hash_key(const struct route_cache_key *key);
+bool route_cache_entry_eq(const struct route_cache_entry *e,
+			  const struct route_cache_key *key);
+HTABLE_DEFINE_TYPE(struct route_cache_entry, route_cache_keyof, route_cache_hash_key, route_cache_entry_eq, route_cache_map);
+
+/* get_route() remembers what it found, until a connection on the route
+ * changes or goes away, or it falls off the end of the LRU list. */
+struct route_cache {
+	struct route_cache_map map;
+	struct list_head lru;
+	size_t num_entries;
+
+	u64 hits, misses, invalidations;
+};
+
+/* How much gossip we've dropped, by the stage which dropped it. */
+struct gossip_drops {
+	/* Nothing new: mostly caught by gossip_msg_redundant(), before any
+	 * signature check, otherwise when the message is processed */
+	u64 duplicate_channel_announcement;
+	u64 stale_channel_update;
+	u64 stale_node_announcement;
+
+	/* Failed signature check */
+	u64 bad_signature;
+
+	/* For a channel or node we don't know */
+	u64 unknown_channel_or_node;
+
+	/* channel_announcement whose funding output is spent or wrong */
+	u64 bad_txout;
+
+	/* Malformed, wrong chain, unsupported features, outdated... */
+	u64 invalid;
+};
+
 struct routing_state {
 	/* All known nodes. */
 	struct node_map *nodes;
 
-	/* channel_announcement which are pending short_channel_id lookup */
-	struct list_head pending_cannouncement;
+	/* All known connections, by short_channel_id. */
+	struct scid_map scids;
+
+	/* Every short_channel_id in scids, in order, by
+	 * short_channel_id_to_uint(): the value is one of its connections. */
+	UINTMAP(struct node_connection *) scid_order;
+
+	/* Every node in nodes, sorted by pubkey_cmp() of its id. */
+	struct node **nodes_by_id;
+
+	/* What find_route actually walks. */
+	struct route_graph graph;
+
+	/* What it searches with: one per search thread. */
+	struct route_scratch **route_scratch;
+
+	/* What it found recently. */
+	struct route_cache route_cache;
+
+	/* channel_announcement which are pending short_channel_id lookup,
+	 * by short_channel_id_to_uint() */
+	UINTMAP(struct pending_cannouncement *) pending_cannouncements;
 
 	struct broadcast_state *broadcasts;
 
+	/* Where we persist what we broadcast (NULL while loading it) */
+	struct gossip_store *store;
+
 	struct bitcoin_blkid chain_hash;
 
 	/* Our own ID so we can identify local channels */
 	struct pubkey local_id;
+
+	struct gossip_drops drops;
 };
 
 struct route_hop {
@@ -111,6 +244,50 @@ struct node_connection *half_add_connection(struct routing_state *rstate,
 					    const struct short_channel_id *schanid,
 					    const u16 flags);
 
+/* Tell route finding that fees, delay, htlc minimum or active flag of
+ * this connection changed. */
+void routing_connection_changed(struct routing_state *rstate,
+				const struct node_connection *nc);
+
+/* origin_index of a failure we hit ourselves, before the HTLC left. */
+#define ROUTING_FAILURE_LOCAL 0xFFFF
+
+/* A payment through this connection failed with failcode, reported by the
+ * origin_index'th hop (or ROUTING_FAILURE_LOCAL): penalize routes through
+ * it, starting at the whole amount and halving every minute (every hour
+ * if PERM).  Returns the connection, or NULL if we don't know it. */
+struct node_connection *routing_failure(struct routing_state *rstate,
+					const struct short_channel_id *scid,
+					u8 direction, u16 failcode,
+					u16 origin_index, u64 now);
+
+/* The funding output of one of our channels was spent (we aren't told
+ * about anyone else's, except for stored channels we find spent when we
+ * restart): forget both directions, and either node if it has no
+ * channels left. */
+/* When the penalty for c's last failure has decayed to nothing (0 if it
+ * never failed). */
+u64 routing_failure_expiry(const struct node_connection *c);
+
+void routing_channel_closed(struct routing_state *rstate,
+			    const struct short_channel_id *scid);
+
+/* Which channel (and direction: always 0 for announcements) a queued
+ * channel_announcement or channel_update broadcast is for. */
+void channel_broadcast_key_decode(const struct broadcast_key *key,
+				  struct short_channel_id *scid,
+				  u16 *direction);
+
+/* Capacity of the channel a queued channel_announcement is for (0 if
+ * unknown), so the gossip_store can keep it. */
+u64 channel_broadcast_satoshis(const struct routing_state *rstate,
+			       const struct broadcast_key *key);
+
+/* Index of the first node in rstate->nodes_by_id whose id is not below
+ * @id (tal_count() of it if there is none). */
+size_t node_by_id_index(const struct routing_state *rstate,
+			const struct pubkey *id);
+
 /* Given a short_channel_id, retrieve the matching connection, or NULL if it is
  * unknown. */
 struct node_connection *get_connection_by_scid(const struct routing_state *rstate,
@@ -132,16 +309,48 @@ handle_channel_announcement(struct routing_state *rstate,
  * handle_pending_cannouncement -- handle channel_announce once we've
  * completed short_channel_id lookup.
  *
+ * If nothing is pending for @scid, this was a check of a channel
+ * replayed from the gossip_store, which we forget if it's been spent.
+ *
  * Returns true if the channel was new and is local. This means that
  * if we haven't sent a node_announcement just yet, now would be a
  * good time.
  */
 bool handle_pending_cannouncement(struct routing_state *rstate,
 				  const struct short_channel_id *scid,
+				  u64 satoshis,
 				  const u8 *txscript);
-void handle_channel_update(struct routing_state *rstate, const u8 *update);
+/* Returns true if @update was newer than what we had, and applied. */
+bool handle_channel_update(struct routing_state *rstate, const u8 *update);
 void handle_node_announcement(struct routing_state *rstate, const u8 *node);
 
+/* Add messages replayed from the gossip_store: we checked them before we
+ * stored them, so they skip signature (and txout) checks.  Returns true
+ * if the channel was new. */
+bool routing_add_channel_announcement(struct routing_state *rstate,
+				      const u8 *announce, u64 satoshis);
+void routing_add_channel_update(struct routing_state *rstate,
+				const u8 *update);
+void routing_add_node_announcement(struct routing_state *rstate,
+				   const u8 *node_ann);
+
+/* Is this gossip something we have already (or older)?  Only peeks at
+ * a few fixed fields, so it's cheap enough to do before anything else;
+ * counts it in rstate->drops if so. */
+bool gossip_msg_redundant(struct routing_state *rstate, const u8 *msg);
+
+/* Fill in the signatures a gossip message carries, so they can be checked
+ * in bulk.  Returns how many: 0 if it doesn't parse, or if it's a
+ * channel_update for a channel we don't know (so don't know the key). */
+size_t gossip_msg_sigs(struct routing_state *rstate, const u8 *msg,
+		       struct gossip_sig sigs[GOSSIP_MAX_SIGS]);
+
+/* Handle a gossip message whose signatures from gossip_msg_sigs() have
+ * all been checked, and passed.  The channel_update key came from rstate,
+ * so only other gossip may be handled in between.  Returns the short_channel_id to look up for a channel_announcement. */
+const struct short_channel_id *handle_checked_gossip(struct routing_state *rstate,
+						     const u8 *msg);
+
 /* Compute a route to a destination, for a given amount and riskfactor. */
 struct route_hop *get_route(tal_t *ctx, struct routing_state *rstate,
 			    const struct pubkey *source,
@@ -149,6 +358,31 @@ struct route_hop *get_route(tal_t *ctx, struct routing_state *rstate,
 			    const u32 msatoshi, double riskfactor,
 			    u32 final_cltv);
 
+/* One route wanted from get_route_batch(). */
+struct route_query {
+	struct pubkey source, destination;
+	u32 msatoshi;
+	double riskfactor;
+	u32 final_cltv;
+
+	/* Filled in by get_route_batch: NULL if there's no route. */
+	struct route_hop *hops;
+};
+
+/* get_route() for each of queries[], searching in parallel (a thread per
+ * CPU, up to a limit) for those not in the route cache. */
+void get_route_batch(const tal_t *ctx, struct routing_state *rstate,
+		     struct route_query *queries, size_t num);
+
+/* Compute up to max_routes routes to a destination, cheapest first, no
+ * two of which use the same channel in the same direction.  Returns an
+ * empty array if there is no route at all. */
+struct route_hop **get_routes(const tal_t *ctx, struct routing_state *rstate,
+			      const struct pubkey *source,
+			      const struct pubkey *destination,
+			      const u32 msatoshi, double riskfactor,
+			      u32 final_cltv, size_t max_routes);
+
 /* Utility function that, given a source and a destination, gives us
  * the direction bit the matching channel should get */
 #define get_channel_direction(from, to) (pubkey_cmp(from, to) > 0)
@@ -0,0 +1,76 @@
+#include <bitcoin/shadouble.h>
+#include <ccan/tal/tal.h>
+#include <common/status.h>
+#include <gossipd/sigcheck.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Beyond this, we'd just be fighting lightningd and bitcoind for CPU. */
+#define MAX_SIGCHECK_THREADS 8
+
+/* Below this, starting threads costs more than it saves. */
+#define MIN_SIGS_PER_THREAD 16
+
+struct sigcheck_range {
+	struct gossip_sig *sigs;
+	size_t num;
+};
+
+/* Only touches the sigs it was given (and secp256k1_ctx, read-only), so
+ * no locking needed. */
+static void *check_range(void *arg)
+{
+	struct sigcheck_range *range = arg;
+	struct sha256_double hash;
+	size_t i;
+
+	for (i = 0; i < range->num; i++) {
+		struct gossip_sig *s = &range->sigs[i];
+		sha256_double(&hash, s->msg + s->offset,
+			      tal_len(s->msg) - s->offset);
+		s->ok = check_signed_hash(&hash, &s->sig, &s->key);
+	}
+	return NULL;
+}
+
+void check_gossip_sigs(struct gossip_sig *sigs, size_t num)
+{
+	struct sigcheck_range ranges[MAX_SIGCHECK_THREADS];
+	pthread_t threads[MAX_SIGCHECK_THREADS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i, nthreads, per_thread, started = 0;
+
+	nthreads = num / MIN_SIGS_PER_THREAD;
+	if (cpus > 0 && nthreads > (size_t)cpus)
+		nthreads = cpus;
+	if (nthreads > MAX_SIGCHECK_THREADS)
+		nthreads = MAX_SIGCHECK_THREADS;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	per_thread = (num + nthreads - 1) / nthreads;
+	for (i = 0; i < nthreads; i++) {
+		size_t start = i * per_thread;
+		ranges[i].sigs = sigs + start;
+		ranges[i].num = start < num ? num - start : 0;
+		if (ranges[i].num > per_thread)
+			ranges[i].num = per_thread;
+	}
+
+	/* Our own thread does the first range; if we can't start a
+	 * thread, we do that range ourselves too. */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, check_range,
+				   &ranges[i]) != 0) {
+			status_trace("sigcheck: can't start thread, checking"
+				     " inline");
+			break;
+		}
+		started = i;
+	}
+	check_range(&ranges[0]);
+	for (i = started + 1; i < nthreads; i++)
+		check_range(&ranges[i]);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+}
@@ -0,0 +1,27 @@
+#ifndef LIGHTNING_GOSSIPD_SIGCHECK_H
+#define LIGHTNING_GOSSIPD_SIGCHECK_H
+#include "config.h"
+#include <bitcoin/pubkey.h>
+#include <bitcoin/signature.h>
+#include <ccan/short_types/short_types.h>
+
+/* channel_announcement carries the most: two nodes, two bitcoin keys. */
+#define GOSSIP_MAX_SIGS 4
+
+/* One signature in a gossip message: it signs the double-SHA256 of
+ * everything in msg from offset on. */
+struct gossip_sig {
+	const u8 *msg;
+	size_t offset;
+	secp256k1_ecdsa_signature sig;
+	struct pubkey key;
+
+	/* Filled in by check_gossip_sigs */
+	bool ok;
+};
+
+/* Check all of sigs[], spread over a thread per CPU (up to a limit).
+ * The messages must not change until it returns. */
+void check_gossip_sigs(struct gossip_sig *sigs, size_t num);
+
+#endif /* LIGHTNING_GOSSIPD_SIGCHECK_H */
@@ -0,0 +1,59 @@
+#include "../broadcast.c"
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+static void key(struct broadcast_key *k, int type, u8 tag)
+{
+	memset(k, 0, sizeof(*k));
+	k->type = type;
+	k->tag[0] = tag;
+}
+
+int main(void)
+{
+	const tal_t *ctx = tal(NULL, char);
+	struct broadcast_state *bstate = new_broadcast_state(tal(ctx, char));
+	struct broadcast_key k1, k2, k3;
+	const u8 *payload = new_shared_payload(take(tal_arr(NULL, u8, 1)));
+	struct queued_message *m;
+
+	key(&k1, 1, 1);
+	key(&k2, 1, 2);
+	key(&k3, 1, 3);
+
+	/* 1: k1, 2: k2, 3: k3 */
+	assert(!queue_broadcast(bstate, &k1, payload));
+	assert(!queue_broadcast(bstate, &k2, payload));
+	assert(!queue_broadcast(bstate, &k3, payload));
+
+	/* k2 goes: its tombstone is 4. */
+	assert(queue_broadcast(bstate, &k2, NULL));
+
+	/* Senders skip the tombstone; changes include it. */
+	m = next_broadcast_message(bstate, 3);
+	assert(!m);
+	m = next_broadcast_change(bstate, 3);
+	assert(m && m->index == 4 && !m->payload);
+
+	/* Replacing a tombstone isn't an eviction. */
+	assert(!queue_broadcast(bstate, &k2, payload));
+	assert(queue_broadcast(bstate, &k2, NULL));
+	assert(queue_broadcast(bstate, &k1, NULL));
+
+	/* 3: k3, 6: k2 tombstone, 7: k1 tombstone. */
+	assert(!broadcast_del(bstate, &k1));
+	/* 3: k3, 6: k2 tombstone. */
+	broadcast_prune_tombstones(bstate, 5);
+	assert(bstate->pruned_index == 0);
+	assert(next_broadcast_change(bstate, 3)->index == 6);
+	broadcast_prune_tombstones(bstate, 6);
+	assert(bstate->pruned_index == 6);
+	assert(!next_broadcast_change(bstate, 3));
+	assert(next_broadcast_change(bstate, 0)->index == 3);
+
+	shared_payload_unref(payload);
+	tal_free(ctx);
+	return 0;
+}
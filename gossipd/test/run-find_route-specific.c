@@ -18,7 +18,16 @@ struct broadcast_state *new_broadcast_state(tal_t *ctx UNNEEDED)
 	return NULL;
 }
 
+/* We never share any payloads, but connections unref theirs when freed */
+void shared_payload_unref(const u8 *payload UNNEEDED)
+{
+}
+
 /* AUTOGENERATED MOCKS START */
+/* Generated stub for broadcast_del */
+bool broadcast_del(struct broadcast_state *bstate UNNEEDED,
+		   const struct broadcast_key *key UNNEEDED)
+{ fprintf(stderr, "broadcast_del called!\n"); abort(); }
 /* Generated stub for fromwire_channel_announcement */
 bool fromwire_channel_announcement(const tal_t *ctx UNNEEDED, const void *p UNNEEDED, size_t *plen UNNEEDED, secp256k1_ecdsa_signature *node_signature_1 UNNEEDED, secp256k1_ecdsa_signature *node_signature_2 UNNEEDED, secp256k1_ecdsa_signature *bitcoin_signature_1 UNNEEDED, secp256k1_ecdsa_signature *bitcoin_signature_2 UNNEEDED, u8 **features UNNEEDED, struct bitcoin_blkid *chain_hash UNNEEDED, struct short_channel_id *short_channel_id UNNEEDED, struct pubkey *node_id_1 UNNEEDED, struct pubkey *node_id_2 UNNEEDED, struct pubkey *bitcoin_key_1 UNNEEDED, struct pubkey *bitcoin_key_2 UNNEEDED)
 { fprintf(stderr, "fromwire_channel_announcement called!\n"); abort(); }
@@ -28,31 +37,56 @@ bool fromwire_channel_update(const void *p UNNEEDED, size_t *plen UNNEEDED, secp
 /* Generated stub for fromwire_node_announcement */
 bool fromwire_node_announcement(const tal_t *ctx UNNEEDED, const void *p UNNEEDED, size_t *plen UNNEEDED, secp256k1_ecdsa_signature *signature UNNEEDED, u8 **features UNNEEDED, u32 *timestamp UNNEEDED, struct pubkey *node_id UNNEEDED, u8 rgb_color[3] UNNEEDED, u8 alias[32] UNNEEDED, u8 **addresses UNNEEDED)
 { fprintf(stderr, "fromwire_node_announcement called!\n"); abort(); }
+/* Generated stub for fromwire_pad */
+void fromwire_pad(const u8 **cursor UNNEEDED, size_t *max UNNEEDED, size_t num UNNEEDED)
+{ fprintf(stderr, "fromwire_pad called!\n"); abort(); }
+/* Generated stub for fromwire_peektype */
+int fromwire_peektype(const u8 *cursor UNNEEDED)
+{ fprintf(stderr, "fromwire_peektype called!\n"); abort(); }
+/* Generated stub for fromwire_pubkey */
+void fromwire_pubkey(const u8 **cursor UNNEEDED, size_t *max UNNEEDED, struct pubkey *pubkey UNNEEDED)
+{ fprintf(stderr, "fromwire_pubkey called!\n"); abort(); }
+/* Generated stub for fromwire_short_channel_id */
+void fromwire_short_channel_id(const u8 **cursor UNNEEDED, size_t *max UNNEEDED,
+			       struct short_channel_id *short_channel_id UNNEEDED)
+{ fprintf(stderr, "fromwire_short_channel_id called!\n"); abort(); }
+/* Generated stub for fromwire_u16 */
+u16 fromwire_u16(const u8 **cursor UNNEEDED, size_t *max UNNEEDED)
+{ fprintf(stderr, "fromwire_u16 called!\n"); abort(); }
+/* Generated stub for fromwire_u32 */
+u32 fromwire_u32(const u8 **cursor UNNEEDED, size_t *max UNNEEDED)
+{ fprintf(stderr, "fromwire_u32 called!\n"); abort(); }
 /* Generated stub for fromwire_u8 */
 u8 fromwire_u8(const u8 **cursor UNNEEDED, size_t *max UNNEEDED)
 { fprintf(stderr, "fromwire_u8 called!\n"); abort(); }
 /* Generated stub for fromwire_wireaddr */
 bool fromwire_wireaddr(const u8 **cursor UNNEEDED, size_t *max UNNEEDED, struct wireaddr *addr UNNEEDED)
 { fprintf(stderr, "fromwire_wireaddr called!\n"); abort(); }
+/* Generated stub for gossip_store_append */
+void gossip_store_append(struct gossip_store *gs UNNEEDED, const u8 *msg UNNEEDED)
+{ fprintf(stderr, "gossip_store_append called!\n"); abort(); }
+/* Generated stub for gossip_store_append_channel_announcement */
+void gossip_store_append_channel_announcement(struct gossip_store *gs UNNEEDED,
+					      const u8 *announce UNNEEDED,
+					      u64 satoshis UNNEEDED)
+{ fprintf(stderr, "gossip_store_append_channel_announcement called!\n"); abort(); }
+/* Generated stub for gossip_store_removed */
+void gossip_store_removed(struct gossip_store *gs UNNEEDED)
+{ fprintf(stderr, "gossip_store_removed called!\n"); abort(); }
+/* Generated stub for new_shared_payload */
+const u8 *new_shared_payload(const u8 *payload TAKES UNNEEDED)
+{ fprintf(stderr, "new_shared_payload called!\n"); abort(); }
 /* Generated stub for queue_broadcast */
 bool queue_broadcast(struct broadcast_state *bstate UNNEEDED,
-			     const int type UNNEEDED,
-			     const u8 *tag UNNEEDED,
-			     const u8 *payload UNNEEDED)
+		     const struct broadcast_key *key UNNEEDED,
+		     const u8 *payload UNNEEDED)
 { fprintf(stderr, "queue_broadcast called!\n"); abort(); }
+/* Generated stub for shared_payload_ref */
+const u8 *shared_payload_ref(const u8 *payload UNNEEDED)
+{ fprintf(stderr, "shared_payload_ref called!\n"); abort(); }
 /* Generated stub for status_failed */
 void status_failed(enum status_fail code UNNEEDED, const char *fmt UNNEEDED, ...)
 { fprintf(stderr, "status_failed called!\n"); abort(); }
-/* Generated stub for towire_pubkey */
-void towire_pubkey(u8 **pptr UNNEEDED, const struct pubkey *pubkey UNNEEDED)
-{ fprintf(stderr, "towire_pubkey called!\n"); abort(); }
-/* Generated stub for towire_short_channel_id */
-void towire_short_channel_id(u8 **pptr UNNEEDED,
-			     const struct short_channel_id *short_channel_id UNNEEDED)
-{ fprintf(stderr, "towire_short_channel_id called!\n"); abort(); }
-/* Generated stub for towire_u16 */
-void towire_u16(u8 **pptr UNNEEDED, u16 v UNNEEDED)
-{ fprintf(stderr, "towire_u16 called!\n"); abort(); }
 /* AUTOGENERATED MOCKS END */
 
 const void *trc;
@@ -64,9 +98,7 @@ int main(void)
 	struct node_connection *nc;
 	struct routing_state *rstate;
 	struct pubkey a, b, c;
-	u64 fee;
-	struct node_connection **route;
-	const double riskfactor = 1.0 / BLOCKS_PER_YEAR / 10000;
+	struct route_hop **routes;
 
 	secp256k1_ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
 						 | SECP256K1_CONTEXT_SIGN);
@@ -119,11 +151,11 @@ int main(void)
 	nc->flags = 1;
 	nc->last_timestamp = 1504064344;
 
-	nc = find_route(ctx, rstate, &a, &c, 100000, riskfactor, &fee, &route);
-	assert(nc);
-	assert(tal_count(route) == 1);
-	assert(pubkey_eq(&route[0]->src->id, &b));
-	assert(pubkey_eq(&route[0]->dst->id, &c));
+	routes = get_routes(ctx, rstate, &a, &c, 100000, 1, 9, 1);
+	assert(tal_count(routes) == 1);
+	assert(tal_count(routes[0]) == 2);
+	assert(pubkey_eq(&routes[0][0].nodeid, &b));
+	assert(pubkey_eq(&routes[0][1].nodeid, &c));
 
 	tal_free(ctx);
 	secp256k1_context_destroy(secp256k1_ctx);
@@ -11,7 +11,16 @@ struct broadcast_state *new_broadcast_state(tal_t *ctx UNNEEDED)
 	return NULL;
 }
 
+/* We never share any payloads, but connections unref theirs when freed */
+void shared_payload_unref(const u8 *payload UNNEEDED)
+{
+}
+
 /* AUTOGENERATED MOCKS START */
+/* Generated stub for broadcast_del */
+bool broadcast_del(struct broadcast_state *bstate UNNEEDED,
+		   const struct broadcast_key *key UNNEEDED)
+{ fprintf(stderr, "broadcast_del called!\n"); abort(); }
 /* Generated stub for fromwire_channel_announcement */
 bool fromwire_channel_announcement(const tal_t *ctx UNNEEDED, const void *p UNNEEDED, size_t *plen UNNEEDED, secp256k1_ecdsa_signature *node_signature_1 UNNEEDED, secp256k1_ecdsa_signature *node_signature_2 UNNEEDED, secp256k1_ecdsa_signature *bitcoin_signature_1 UNNEEDED, secp256k1_ecdsa_signature *bitcoin_signature_2 UNNEEDED, u8 **features UNNEEDED, struct bitcoin_blkid *chain_hash UNNEEDED, struct short_channel_id *short_channel_id UNNEEDED, struct pubkey *node_id_1 UNNEEDED, struct pubkey *node_id_2 UNNEEDED, struct pubkey *bitcoin_key_1 UNNEEDED, struct pubkey *bitcoin_key_2 UNNEEDED)
 { fprintf(stderr, "fromwire_channel_announcement called!\n"); abort(); }
@@ -21,31 +30,56 @@ bool fromwire_channel_update(const void *p UNNEEDED, size_t *plen UNNEEDED, secp
 /* Generated stub for fromwire_node_announcement */
 bool fromwire_node_announcement(const tal_t *ctx UNNEEDED, const void *p UNNEEDED, size_t *plen UNNEEDED, secp256k1_ecdsa_signature *signature UNNEEDED, u8 **features UNNEEDED, u32 *timestamp UNNEEDED, struct pubkey *node_id UNNEEDED, u8 rgb_color[3] UNNEEDED, u8 alias[32] UNNEEDED, u8 **addresses UNNEEDED)
 { fprintf(stderr, "fromwire_node_announcement called!\n"); abort(); }
+/* Generated stub for fromwire_pad */
+void fromwire_pad(const u8 **cursor UNNEEDED, size_t *max UNNEEDED, size_t num UNNEEDED)
+{ fprintf(stderr, "fromwire_pad called!\n"); abort(); }
+/* Generated stub for fromwire_peektype */
+int fromwire_peektype(const u8 *cursor UNNEEDED)
+{ fprintf(stderr, "fromwire_peektype called!\n"); abort(); }
+/* Generated stub for fromwire_pubkey */
+void fromwire_pubkey(const u8 **cursor UNNEEDED, size_t *max UNNEEDED, struct pubkey *pubkey UNNEEDED)
+{ fprintf(stderr, "fromwire_pubkey called!\n"); abort(); }
+/* Generated stub for fromwire_short_channel_id */
+void fromwire_short_channel_id(const u8 **cursor UNNEEDED, size_t *max UNNEEDED,
+			       struct short_channel_id *short_channel_id UNNEEDED)
+{ fprintf(stderr, "fromwire_short_channel_id called!\n"); abort(); }
+/* Generated stub for fromwire_u16 */
+u16 fromwire_u16(const u8 **cursor UNNEEDED, size_t *max UNNEEDED)
+{ fprintf(stderr, "fromwire_u16 called!\n"); abort(); }
+/* Generated stub for fromwire_u32 */
+u32 fromwire_u32(const u8 **cursor UNNEEDED, size_t *max UNNEEDED)
+{ fprintf(stderr, "fromwire_u32 called!\n"); abort(); }
 /* Generated stub for fromwire_u8 */
 u8 fromwire_u8(const u8 **cursor UNNEEDED, size_t *max UNNEEDED)
 { fprintf(stderr, "fromwire_u8 called!\n"); abort(); }
 /* Generated stub for fromwire_wireaddr */
 bool fromwire_wireaddr(const u8 **cursor UNNEEDED, size_t *max UNNEEDED, struct wireaddr *addr UNNEEDED)
 { fprintf(stderr, "fromwire_wireaddr called!\n"); abort(); }
+/* Generated stub for gossip_store_append */
+void gossip_store_append(struct gossip_store *gs UNNEEDED, const u8 *msg UNNEEDED)
+{ fprintf(stderr, "gossip_store_append called!\n"); abort(); }
+/* Generated stub for gossip_store_append_channel_announcement */
+void gossip_store_append_channel_announcement(struct gossip_store *gs UNNEEDED,
+					      const u8 *announce UNNEEDED,
+					      u64 satoshis UNNEEDED)
+{ fprintf(stderr, "gossip_store_append_channel_announcement called!\n"); abort(); }
+/* Generated stub for gossip_store_removed */
+void gossip_store_removed(struct gossip_store *gs UNNEEDED)
+{ fprintf(stderr, "gossip_store_removed called!\n"); abort(); }
+/* Generated stub for new_shared_payload */
+const u8 *new_shared_payload(const u8 *payload TAKES UNNEEDED)
+{ fprintf(stderr, "new_shared_payload called!\n"); abort(); }
 /* Generated stub for queue_broadcast */
 bool queue_broadcast(struct broadcast_state *bstate UNNEEDED,
-			     const int type UNNEEDED,
-			     const u8 *tag UNNEEDED,
-			     const u8 *payload UNNEEDED)
+		     const struct broadcast_key *key UNNEEDED,
+		     const u8 *payload UNNEEDED)
 { fprintf(stderr, "queue_broadcast called!\n"); abort(); }
+/* Generated stub for shared_payload_ref */
+const u8 *shared_payload_ref(const u8 *payload UNNEEDED)
+{ fprintf(stderr, "shared_payload_ref called!\n"); abort(); }
 /* Generated stub for status_failed */
 void status_failed(enum status_fail code UNNEEDED, const char *fmt UNNEEDED, ...)
 { fprintf(stderr, "status_failed called!\n"); abort(); }
-/* Generated stub for towire_pubkey */
-void towire_pubkey(u8 **pptr UNNEEDED, const struct pubkey *pubkey UNNEEDED)
-{ fprintf(stderr, "towire_pubkey called!\n"); abort(); }
-/* Generated stub for towire_short_channel_id */
-void towire_short_channel_id(u8 **pptr UNNEEDED,
-			     const struct short_channel_id *short_channel_id UNNEEDED)
-{ fprintf(stderr, "towire_short_channel_id called!\n"); abort(); }
-/* Generated stub for towire_u16 */
-void towire_u16(u8 **pptr UNNEEDED, u16 v UNNEEDED)
-{ fprintf(stderr, "towire_u16 called!\n"); abort(); }
 /* AUTOGENERATED MOCKS END */
 
 const void *trc;
@@ -67,16 +101,43 @@ static struct node_connection *add_connection(struct routing_state *rstate,
 	return c;
 }
 
+/* One search, as get_routes() makes them. */
+static bool search(struct routing_state *rstate,
+		   const struct pubkey *from, const struct pubkey *to,
+		   u64 msatoshi, double riskfactor, struct route_path *path)
+{
+	struct node *src, *dst;
+
+	if (!route_endpoints(rstate, from, to, msatoshi, &src, &dst))
+		return false;
+	return route_search_path(&rstate->graph, route_scratch(rstate, 0),
+				 src->index, dst->index, msatoshi, riskfactor,
+				 time_now().ts.tv_sec, NULL, path);
+}
+
+/* The i'th connection along it: 0 is our own. */
+static const struct node_connection *path_conn(struct routing_state *rstate,
+					       const struct route_path *path,
+					       u32 i)
+{
+	return rstate->graph.conns[path->edges[i]];
+}
+
 int main(void)
 {
 	static const struct bitcoin_blkid zerohash;
 	const tal_t *ctx = trc = tal_tmpctx(NULL);
 	struct node_connection *nc;
 	struct routing_state *rstate;
-	struct pubkey a, b, c, d;
+	struct pubkey a, b, c, d, extra;
+	struct pubkey chain[ROUTING_MAX_HOPS + 2];
 	struct privkey tmp;
-	u64 fee;
-	struct node_connection **route;
+	size_t i;
+	struct short_channel_id scid;
+	struct route_path path;
+	struct route_hop **routes, *hops;
+	struct route_query queries[ROUTING_MAX_HOPS + 1];
+	u64 now, hits;
 	const double riskfactor = 1.0 / BLOCKS_PER_YEAR / 10000;
 
 	secp256k1_ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
@@ -95,10 +156,9 @@ int main(void)
 	/* A<->B */
 	add_connection(rstate, &a, &b, 1, 1, 1);
 
-	nc = find_route(ctx, rstate, &a, &b, 1000, riskfactor, &fee, &route);
-	assert(nc);
-	assert(tal_count(route) == 0);
-	assert(fee == 0);
+	assert(search(rstate, &a, &b, 1000, riskfactor, &path));
+	assert(path.num_edges == 1);
+	assert(path.fee == 0);
 
 	/* A<->B<->C */
 	memset(&tmp, 'c', sizeof(tmp));
@@ -110,10 +170,9 @@ int main(void)
 	status_trace("C = %s", type_to_string(trc, struct pubkey, &c));
 	add_connection(rstate, &b, &c, 1, 1, 1);
 
-	nc = find_route(ctx, rstate, &a, &c, 1000, riskfactor, &fee, &route);
-	assert(nc);
-	assert(tal_count(route) == 1);
-	assert(fee == 1);
+	assert(search(rstate, &a, &c, 1000, riskfactor, &path));
+	assert(path.num_edges == 2);
+	assert(path.fee == 1);
 
 	/* A<->D<->C: Lower base, higher percentage. */
 	memset(&tmp, 'd', sizeof(tmp));
@@ -125,26 +184,205 @@ int main(void)
 	add_connection(rstate, &d, &c, 0, 2, 1);
 
 	/* Will go via D for small amounts. */
-	nc = find_route(ctx, rstate, &a, &c, 1000, riskfactor, &fee, &route);
-	assert(nc);
-	assert(tal_count(route) == 1);
-	assert(pubkey_eq(&route[0]->src->id, &d));
-	assert(fee == 0);
+	assert(search(rstate, &a, &c, 1000, riskfactor, &path));
+	assert(path.num_edges == 2);
+	assert(pubkey_eq(&path_conn(rstate, &path, 1)->src->id, &d));
+	assert(path.fee == 0);
 
 	/* Will go via B for large amounts. */
-	nc = find_route(ctx, rstate, &a, &c, 3000000, riskfactor, &fee, &route);
-	assert(nc);
-	assert(tal_count(route) == 1);
-	assert(pubkey_eq(&route[0]->src->id, &b));
-	assert(fee == 1 + 3);
+	assert(search(rstate, &a, &c, 3000000, riskfactor, &path));
+	assert(path.num_edges == 2);
+	assert(pubkey_eq(&path_conn(rstate, &path, 1)->src->id, &b));
+	assert(path.fee == 1 + 3);
 
 	/* Make B->C inactive, force it back via D */
-	get_connection(rstate, &b, &c)->active = false;
-	nc = find_route(ctx, rstate, &a, &c, 3000000, riskfactor, &fee, &route);
-	assert(nc);
-	assert(tal_count(route) == 1);
-	assert(pubkey_eq(&route[0]->src->id, &d));
-	assert(fee == 0 + 6);
+	nc = get_connection(rstate, &b, &c);
+	nc->active = false;
+	routing_connection_changed(rstate, nc);
+	assert(search(rstate, &a, &c, 3000000, riskfactor, &path));
+	assert(path.num_edges == 2);
+	assert(pubkey_eq(&path_conn(rstate, &path, 1)->src->id, &d));
+	assert(path.fee == 0 + 6);
+
+	/* D->C won't carry an HTLC below its minimum. */
+	nc = get_connection(rstate, &d, &c);
+	nc->htlc_minimum_msat = 3000001;
+	routing_connection_changed(rstate, nc);
+	assert(!search(rstate, &a, &c, 3000000, riskfactor, &path));
+	get_connection(rstate, &d, &c)->htlc_minimum_msat = 0;
+	routing_connection_changed(rstate, get_connection(rstate, &d, &c));
+
+	/* Nor one bigger than the whole channel. */
+	nc = get_connection(rstate, &d, &c);
+	nc->satoshis = 2999;
+	routing_connection_changed(rstate, nc);
+	assert(!search(rstate, &a, &c, 3000000, riskfactor, &path));
+	nc->satoshis = 3000;
+	routing_connection_changed(rstate, nc);
+	assert(search(rstate, &a, &c, 3000000, riskfactor, &path));
+	nc->satoshis = 0;
+	routing_connection_changed(rstate, nc);
+
+	/* With B->C back, we get both routes, cheapest first, and no more. */
+	nc = get_connection(rstate, &b, &c);
+	nc->active = true;
+	routing_connection_changed(rstate, nc);
+	routes = get_routes(ctx, rstate, &a, &c, 3000000, 1, 9, 3);
+	assert(tal_count(routes) == 2);
+	assert(tal_count(routes[0]) == 2);
+	assert(pubkey_eq(&routes[0][0].nodeid, &b));
+	assert(pubkey_eq(&routes[0][1].nodeid, &c));
+	assert(tal_count(routes[1]) == 2);
+	assert(pubkey_eq(&routes[1][0].nodeid, &d));
+	assert(pubkey_eq(&routes[1][1].nodeid, &c));
+	routes = get_routes(ctx, rstate, &a, &c, 3000000, 1, 9, 1);
+	assert(tal_count(routes) == 1);
+
+	/* get_route remembers the route for similar amounts, until a
+	 * connection on it changes. */
+	hops = get_route(rstate, rstate, &a, &c, 3000000, 1, 9);
+	assert(hops && pubkey_eq(&hops[0].nodeid, &b));
+	assert(rstate->route_cache.misses == 1);
+	assert(rstate->route_cache.num_entries == 1);
+	hops = get_route(rstate, rstate, &a, &c, 3000001, 1, 9);
+	assert(hops && pubkey_eq(&hops[0].nodeid, &b));
+	assert(hops[1].amount == 3000001);
+	assert(rstate->route_cache.hits == 1);
+	routing_connection_changed(rstate, get_connection(rstate, &b, &c));
+	assert(rstate->route_cache.num_entries == 0);
+	assert(rstate->route_cache.invalidations == 1);
+	hops = get_route(rstate, rstate, &a, &c, 3000000, 1, 9);
+	assert(rstate->route_cache.misses == 2);
+	/* A different amount bucket is a different route. */
+	hops = get_route(rstate, rstate, &a, &c, 1000, 1, 9);
+	assert(hops && pubkey_eq(&hops[0].nodeid, &d));
+	assert(rstate->route_cache.num_entries == 2);
+
+	/* A chain from A which is one hop too long can't be used. */
+	chain[0] = a;
+	for (i = 1; i < ROUTING_MAX_HOPS + 2; i++) {
+		memset(&tmp, 'e' + i, sizeof(tmp));
+		pubkey_from_privkey(&tmp, &chain[i]);
+		new_node(rstate, &chain[i]);
+		add_connection(rstate, &chain[i-1], &chain[i], 0, 0, 1);
+	}
+	assert(search(rstate, &a, &chain[ROUTING_MAX_HOPS], 1000, riskfactor,
+		      &path));
+	assert(path.num_edges == ROUTING_MAX_HOPS);
+	assert(!search(rstate, &a, &chain[ROUTING_MAX_HOPS + 1], 1000,
+		       riskfactor, &path));
+
+	/* However they were added, nodes_by_id stays sorted. */
+	for (i = 1; i < tal_count(rstate->nodes_by_id); i++)
+		assert(pubkey_cmp(&rstate->nodes_by_id[i-1]->id,
+				  &rstate->nodes_by_id[i]->id) < 0);
+	for (i = 0; i < ROUTING_MAX_HOPS + 2; i++)
+		assert(pubkey_eq(&rstate->nodes_by_id[node_by_id_index(rstate, &chain[i])]->id,
+				 &chain[i]));
+
+	/* A batch answers each query as get_route would, from the cache
+	 * where it can. */
+	for (i = 0; i < ROUTING_MAX_HOPS + 1; i++) {
+		queries[i].source = a;
+		queries[i].destination = chain[i + 1];
+		queries[i].msatoshi = 1000;
+		queries[i].riskfactor = 1;
+		queries[i].final_cltv = 9;
+	}
+	get_route_batch(ctx, rstate, queries, ROUTING_MAX_HOPS + 1);
+	for (i = 0; i < ROUTING_MAX_HOPS; i++) {
+		assert(tal_count(queries[i].hops) == i + 1);
+		assert(pubkey_eq(&queries[i].hops[i].nodeid, &chain[i + 1]));
+	}
+	assert(!queries[ROUTING_MAX_HOPS].hops);
+	hits = rstate->route_cache.hits;
+	get_route_batch(ctx, rstate, queries, ROUTING_MAX_HOPS + 1);
+	assert(rstate->route_cache.hits == hits + ROUTING_MAX_HOPS);
+	assert(tal_count(queries[3].hops) == 4);
+
+	/* After the graph grows, every search thread's scratch is grown
+	 * before the threads start. */
+	memset(&tmp, 'Z', sizeof(tmp));
+	pubkey_from_privkey(&tmp, &extra);
+	new_node(rstate, &extra);
+	add_connection(rstate, &chain[1], &extra, 0, 0, 1);
+	for (i = 0; i < ROUTING_MAX_HOPS + 1; i++) {
+		queries[i].destination = extra;
+		queries[i].msatoshi = 1000 + i;
+	}
+	get_route_batch(ctx, rstate, queries, ROUTING_MAX_HOPS + 1);
+	for (i = 0; i < ROUTING_MAX_HOPS + 1; i++) {
+		assert(tal_count(queries[i].hops) == 2);
+		assert(pubkey_eq(&queries[i].hops[1].nodeid, &extra));
+	}
+	for (i = 0; i < tal_count(rstate->route_scratch); i++)
+		assert(tal_count(rstate->route_scratch[i]->stamp)
+		       == tal_count(rstate->graph.nodes));
+
+	/* Both directions of a channel are found by short_channel_id,
+	 * and forgotten again once freed. */
+	memset(&scid, 0, sizeof(scid));
+	scid.blocknum = 100;
+	scid.outnum = 1;
+	nc = half_add_connection(rstate, &a, &b, &scid, 0);
+	assert(get_connection_by_scid(rstate, &scid, 0) == nc);
+	assert(!get_connection_by_scid(rstate, &scid, 1));
+	nc = half_add_connection(rstate, &b, &a, &scid, 1);
+	assert(get_connection_by_scid(rstate, &scid, 1) == nc);
+	tal_free(nc);
+	assert(!get_connection_by_scid(rstate, &scid, 1));
+	assert(get_connection_by_scid(rstate, &scid, 0));
+
+	/* A failure only makes A->B dearer: it's still the only way. */
+	nc = get_connection_by_scid(rstate, &scid, 0);
+	nc->active = true;
+	routing_connection_changed(rstate, nc);
+	now = time_now().ts.tv_sec;
+	assert(routing_failure(rstate, &scid, 0, UPDATE|7, 0, now) == nc);
+	assert(routing_failure_expiry(nc)
+	       == now + ROUTING_TEMPFAIL_HALFLIFE_SECS * ROUTING_FAIL_HALFLIVES);
+	assert(search(rstate, &a, &b, 1000, riskfactor, &path));
+	assert(!routing_failure(rstate, &scid, 1, UPDATE|7, 0, now));
+	routing_failure(rstate, &scid, 0, UPDATE|7, ROUTING_FAILURE_LOCAL,
+			now - 3600);
+	assert(nc->fail_origin_index == ROUTING_FAILURE_LOCAL);
+	assert(routing_failure_expiry(nc) < now);
+
+	/* With another way, a failure on B->C sends us via D until the
+	 * penalty has decayed below the difference in fees. */
+	scid.outnum = 2;
+	nc = get_connection(rstate, &b, &c);
+	set_connection_scid(rstate, nc, &scid);
+	routing_failure(rstate, &scid, nc->flags & 0x1, UPDATE|7, 1, now);
+	assert(search(rstate, &a, &c, 3000000, riskfactor, &path));
+	assert(pubkey_eq(&path_conn(rstate, &path, 1)->src->id, &d));
+	routing_failure(rstate, &scid, nc->flags & 0x1, UPDATE|7, 1,
+			now - ROUTING_TEMPFAIL_HALFLIFE_SECS * 4);
+	assert(search(rstate, &a, &c, 3000000, riskfactor, &path));
+	assert(pubkey_eq(&path_conn(rstate, &path, 1)->src->id, &d));
+	routing_failure(rstate, &scid, nc->flags & 0x1, UPDATE|7, 1,
+			now - ROUTING_TEMPFAIL_HALFLIFE_SECS
+			* ROUTING_FAIL_HALFLIVES);
+	assert(search(rstate, &a, &c, 3000000, riskfactor, &path));
+	assert(pubkey_eq(&path_conn(rstate, &path, 1)->src->id, &b));
+
+	/* Searches reuse scratch space, even once its epoch wraps. */
+	route_scratch(rstate, 0)->epoch = (u32)-1;
+	assert(search(rstate, &a, &b, 1000, riskfactor, &path));
+	assert(route_scratch(rstate, 0)->epoch == 1);
+	assert(search(rstate, &a, &b, 1000, riskfactor, &path));
+
+	/* Out-of-range riskfactors still get a bucket. */
+	{
+		struct route_cache_key key;
+
+		route_cache_key_init(&key, &a, &b, 1000, 0.0 / 0.0);
+		assert(key.riskfactor_bucket == 0);
+		route_cache_key_init(&key, &a, &b, 1000, -1);
+		assert(key.riskfactor_bucket == 0);
+		route_cache_key_init(&key, &a, &b, 1000, 1e300);
+		assert(key.riskfactor_bucket == 64);
+	}
 
 	tal_free(ctx);
 	secp256k1_context_destroy(secp256k1_ctx);
@@ -0,0 +1,66 @@
+#include <common/status.h>
+
+#include <stdio.h>
+#define status_trace(fmt, ...) \
+	do { printf((fmt) ,##__VA_ARGS__); printf("\n"); } while(0)
+
+#include "../sigcheck.c"
+#include <assert.h>
+#include <bitcoin/privkey.h>
+#include <bitcoin/shadouble.h>
+#include <common/utils.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+#define NUM_SIGS 100
+
+int main(void)
+{
+	tal_t *ctx = tal(NULL, char);
+	struct gossip_sig *sigs = tal_arr(ctx, struct gossip_sig, NUM_SIGS);
+	u8 *msgs[NUM_SIGS];
+	struct privkey priv;
+	struct pubkey key;
+	struct sha256_double hash;
+	size_t i;
+
+	secp256k1_ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
+						 | SECP256K1_CONTEXT_SIGN);
+	memset(&priv, 1, sizeof(priv));
+	pubkey_from_privkey(&priv, &key);
+
+	for (i = 0; i < NUM_SIGS; i++) {
+		msgs[i] = tal_arr(sigs, u8, 10);
+		memset(msgs[i], i, tal_len(msgs[i]));
+		sigs[i].msg = msgs[i];
+		sigs[i].offset = 2;
+		sigs[i].key = key;
+		sha256_double(&hash, msgs[i] + 2, tal_len(msgs[i]) - 2);
+		sign_hash(&priv, &hash, &sigs[i].sig);
+	}
+
+	/* Break every seventh one: only the signed part counts. */
+	for (i = 0; i < NUM_SIGS; i++) {
+		msgs[i][0]++;
+		if (i % 7 == 0)
+			msgs[i][5]++;
+	}
+
+	check_gossip_sigs(sigs, NUM_SIGS);
+	for (i = 0; i < NUM_SIGS; i++)
+		assert(sigs[i].ok == (i % 7 != 0));
+
+	/* Too few to bother with threads, same answers. */
+	check_gossip_sigs(sigs, 3);
+	assert(!sigs[0].ok);
+	assert(sigs[1].ok);
+	assert(sigs[2].ok);
+
+	/* And nothing at all. */
+	check_gossip_sigs(sigs, 0);
+
+	tal_free(ctx);
+	secp256k1_context_destroy(secp256k1_ctx);
+	return 0;
+}
@@ -9,6 +9,7 @@
 #include <ccan/take/take.h>
 #include <ccan/tal/str/str.h>
 #include <common/features.h>
+#include <common/timeout.h>
 #include <common/type_to_string.h>
 #include <common/utils.h>
 #include <errno.h>
@@ -20,6 +21,7 @@
 #include <lightningd/hsm_control.h>
 #include <lightningd/jsonrpc.h>
 #include <lightningd/log.h>
+#include <wire/gen_onion_wire.h>
 #include <wire/gen_peer_wire.h>
 #include <wire/wire_sync.h>
 
@@ -62,7 +64,9 @@ static void got_txout(struct bitcoind *bitcoind,
 {
 	/* output will be NULL if it wasn't found */
 	subd_send_msg(bitcoind->ld->gossip,
-		      towire_gossip_get_txout_reply(scid, scid, output->script));
+		      towire_gossip_get_txout_reply(scid, scid,
+						    output ? output->amount : 0,
+						    output ? output->script : NULL));
 	tal_free(scid);
 }
 
@@ -81,6 +85,33 @@ static void get_txout(struct subd *gossip, const u8 *msg)
 			   got_txout, scid);
 }
 
+/* A getgossipchanges command. */
+struct getchanges_query {
+	/* In ld->gossip_change_waiters, if waiting. */
+	struct list_node list;
+	bool waiting;
+
+	struct command *cmd;
+	u64 since;
+	u16 limit;
+	/* Return nothing after this long, if there are still no changes. */
+	u32 timeout;
+};
+
+static void getchanges_send(struct getchanges_query *q);
+
+/* gossipd says there's something after its last empty getchanges_reply. */
+static void gossip_changes_available(struct lightningd *ld)
+{
+	struct getchanges_query *q, *next;
+
+	list_for_each_safe(&ld->gossip_change_waiters, q, next, list) {
+		list_del(&q->list);
+		q->waiting = false;
+		getchanges_send(q);
+	}
+}
+
 static unsigned gossip_msg(struct subd *gossip, const u8 *msg, const int *fds)
 {
 	enum gossip_wire_type t = fromwire_peektype(msg);
@@ -101,6 +132,12 @@ static unsigned gossip_msg(struct subd *gossip, const u8 *msg, const int *fds)
 	case WIRE_GOSSIP_GET_UPDATE:
 	case WIRE_GOSSIP_SEND_GOSSIP:
 	case WIRE_GOSSIP_GET_TXOUT_REPLY:
+	case WIRE_GOSSIP_GETSTATS_REQUEST:
+	case WIRE_GOSSIP_GETROUTES_REQUEST:
+	case WIRE_GOSSIP_ROUTING_FAILURE:
+	case WIRE_GOSSIP_GETROUTINGFAILURES_REQUEST:
+	case WIRE_GOSSIP_GETCHANGES_REQUEST:
+	case WIRE_GOSSIP_CHANNEL_CLOSED:
 	/* This is a reply, so never gets through to here. */
 	case WIRE_GOSSIP_GET_UPDATE_REPLY:
 	case WIRE_GOSSIP_GETNODES_REPLY:
@@ -111,6 +148,10 @@ static unsigned gossip_msg(struct subd *gossip, const u8 *msg, const int *fds)
 	case WIRE_GOSSIP_RESOLVE_CHANNEL_REPLY:
 	case WIRE_GOSSIPCTL_RELEASE_PEER_REPLY:
 	case WIRE_GOSSIPCTL_RELEASE_PEER_REPLYFAIL:
+	case WIRE_GOSSIP_GETSTATS_REPLY:
+	case WIRE_GOSSIP_GETROUTES_REPLY:
+	case WIRE_GOSSIP_GETROUTINGFAILURES_REPLY:
+	case WIRE_GOSSIP_GETCHANGES_REPLY:
 		break;
 	/* These are inter-daemon messages, not received by us */
 	case WIRE_GOSSIP_LOCAL_ADD_CHANNEL:
@@ -132,6 +173,9 @@ static unsigned gossip_msg(struct subd *gossip, const u8 *msg, const int *fds)
 	case WIRE_GOSSIP_GET_TXOUT:
 		get_txout(gossip, msg);
 		break;
+	case WIRE_GOSSIP_CHANGES_AVAILABLE:
+		gossip_changes_available(gossip->ld);
+		break;
 	}
 	return 0;
 }
@@ -173,56 +217,151 @@ void gossip_init(struct lightningd *ld)
 	tal_free(tmpctx);
 }
 
+/* Most entries we ask gossipd for in a single message: big listings
+ * are fetched (and appended to the JSON reply) in several round trips, so
+ * neither daemon has to build one giant message. */
+#define GOSSIP_LIST_CHUNK 1000
+
+static void json_add_node_entry(struct json_result *response,
+				const struct gossip_getnodes_entry *node)
+{
+	size_t i;
+
+	json_object_start(response, NULL);
+	json_add_pubkey(response, "nodeid", &node->nodeid);
+	json_array_start(response, "addresses");
+	for (i = 0; i < tal_count(node->addresses); i++)
+		json_add_address(response, NULL, &node->addresses[i]);
+	json_array_end(response);
+	json_object_end(response);
+}
+
+struct getnodes_query {
+	struct command *cmd;
+	struct json_result *response;
+	/* Most nodes to return (0 == all), and how many we have so far. */
+	u32 limit, count;
+	u32 since;
+};
+
+static void getnodes_send(struct getnodes_query *q, const struct pubkey *start);
+
 static void json_getnodes_reply(struct subd *gossip, const u8 *reply,
 				const int *fds,
-				struct command *cmd)
+				struct getnodes_query *q)
 {
 	struct gossip_getnodes_entry *nodes;
-	struct json_result *response = new_json_result(cmd);
-	size_t i, j;
+	struct json_result *response = q->response;
+	struct pubkey next;
+	bool more;
+	size_t i;
 
-	if (!fromwire_gossip_getnodes_reply(reply, reply, NULL, &nodes)) {
-		command_fail(cmd, "Malformed gossip_getnodes response");
+	if (!fromwire_gossip_getnodes_reply(reply, reply, NULL, &more, &next,
+					    &nodes)) {
+		command_fail(q->cmd, "Malformed gossip_getnodes response");
 		return;
 	}
 
-	json_object_start(response, NULL);
-	json_array_start(response, "nodes");
+	for (i = 0; i < tal_count(nodes); i++)
+		json_add_node_entry(response, &nodes[i]);
+	q->count += tal_count(nodes);
 
-	for (i = 0; i < tal_count(nodes); i++) {
-		json_object_start(response, NULL);
-		json_add_pubkey(response, "nodeid", &nodes[i].nodeid);
-		json_array_start(response, "addresses");
-		for (j=0; j<tal_count(nodes[i].addresses); j++) {
-			json_add_address(response, NULL, &nodes[i].addresses[j]);
-		}
-		json_array_end(response);
-		json_object_end(response);
+	if (more && (!q->limit || q->count < q->limit)) {
+		getnodes_send(q, &next);
+		return;
 	}
+
 	json_array_end(response);
+	if (more)
+		json_add_pubkey(response, "cursor", &next);
 	json_object_end(response);
-	command_success(cmd, response);
+	command_success(q->cmd, response);
+}
+
+static void getnodes_send(struct getnodes_query *q, const struct pubkey *start)
+{
+	u32 chunk = GOSSIP_LIST_CHUNK;
+	u8 *req;
+
+	if (q->limit && q->limit - q->count < chunk)
+		chunk = q->limit - q->count;
+
+	/* start is ignored unless it's set, but must be a valid key. */
+	req = towire_gossip_getnodes_request(q, chunk, start != NULL,
+					     start ? start : &q->cmd->ld->id,
+					     q->since);
+	subd_req(q, q->cmd->ld->gossip, take(req), -1, 0,
+		 json_getnodes_reply, q);
 }
 
 static void json_getnodes(struct command *cmd, const char *buffer,
 			  const jsmntok_t *params)
 {
-	u8 *req = towire_gossip_getnodes_request(cmd);
-	subd_req(cmd, cmd->ld->gossip, req, -1, 0, json_getnodes_reply, cmd);
+	jsmntok_t *limittok, *cursortok, *sincetok;
+	struct getnodes_query *q = tal(cmd, struct getnodes_query);
+	struct pubkey cursor;
+
+	if (!json_get_params(buffer, params,
+			     "?limit", &limittok,
+			     "?cursor", &cursortok,
+			     "?since", &sincetok,
+			     NULL)) {
+		command_fail(cmd, "Invalid parameters");
+		return;
+	}
+
+	q->cmd = cmd;
+	q->count = 0;
+	q->limit = 0;
+	q->since = 0;
+	if (limittok && !json_tok_number(buffer, limittok, &q->limit)) {
+		command_fail(cmd, "Invalid limit");
+		return;
+	}
+	if (cursortok && !json_tok_pubkey(buffer, cursortok, &cursor)) {
+		command_fail(cmd, "Invalid cursor");
+		return;
+	}
+	if (sincetok && !json_tok_number(buffer, sincetok, &q->since)) {
+		command_fail(cmd, "Invalid since");
+		return;
+	}
+
+	q->response = new_json_result(cmd);
+	json_object_start(q->response, NULL);
+	json_array_start(q->response, "nodes");
+	getnodes_send(q, cursortok ? &cursor : NULL);
 	command_still_pending(cmd);
 }
 
 static const struct json_command getnodes_command = {
-    "getnodes", json_getnodes, "Retrieve all nodes in our local network view",
-    "Returns a list of all nodes that we know about"};
+    "getnodes", json_getnodes, "Retrieve nodes in our local network view, in node id order",
+    "Returns a 'nodes' array; optional {limit} on the number returned, starting at node id {cursor}, announced at or after {since}. If {limit} cut the list short, 'cursor' is where to continue."};
 AUTODATA(json_command, &getnodes_command);
 
+static void json_add_route(struct json_result *response, const char *name,
+			   const struct route_hop *hops, size_t num_hops)
+{
+	size_t i;
+
+	json_array_start(response, name);
+	for (i = 0; i < num_hops; i++) {
+		json_object_start(response, NULL);
+		json_add_pubkey(response, "id", &hops[i].nodeid);
+		json_add_short_channel_id(response, "channel",
+					  &hops[i].channel_id);
+		json_add_u64(response, "msatoshi", hops[i].amount);
+		json_add_num(response, "delay", hops[i].delay);
+		json_object_end(response);
+	}
+	json_array_end(response);
+}
+
 static void json_getroute_reply(struct subd *gossip, const u8 *reply, const int *fds,
 				struct command *cmd)
 {
 	struct json_result *response;
 	struct route_hop *hops;
-	size_t i;
 
 	fromwire_gossip_getroute_reply(reply, reply, NULL, &hops);
 
@@ -233,17 +372,7 @@ static void json_getroute_reply(struct subd *gossip, const u8 *reply, const int
 
 	response = new_json_result(cmd);
 	json_object_start(response, NULL);
-	json_array_start(response, "route");
-	for (i = 0; i < tal_count(hops); i++) {
-		json_object_start(response, NULL);
-		json_add_pubkey(response, "id", &hops[i].nodeid);
-		json_add_short_channel_id(response, "channel",
-					  &hops[i].channel_id);
-		json_add_u64(response, "msatoshi", hops[i].amount);
-		json_add_num(response, "delay", hops[i].delay);
-		json_object_end(response);
-	}
-	json_array_end(response);
+	json_add_route(response, "route", hops, tal_count(hops));
 	json_object_end(response);
 	command_success(cmd, response);
 }
@@ -302,41 +431,541 @@ static const struct json_command getroute_command = {
 };
 AUTODATA(json_command, &getroute_command);
 
+static void json_getroutes_reply(struct subd *gossip, const u8 *reply,
+				 const int *fds, struct command *cmd)
+{
+	struct json_result *response;
+	struct route_hop *hops;
+	u16 *route_lens;
+	size_t i, start = 0;
+
+	if (!fromwire_gossip_getroutes_reply(reply, reply, NULL,
+					     &route_lens, &hops)) {
+		command_fail(cmd, "Invalid reply from gossipd");
+		return;
+	}
+
+	if (tal_count(route_lens) == 0) {
+		command_fail(cmd, "Could not find a route");
+		return;
+	}
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_array_start(response, "routes");
+	for (i = 0; i < tal_count(route_lens); i++) {
+		json_object_start(response, NULL);
+		json_add_route(response, "route", hops + start, route_lens[i]);
+		json_object_end(response);
+		start += route_lens[i];
+	}
+	json_array_end(response);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+static void json_getroutes(struct command *cmd, const char *buffer,
+			   const jsmntok_t *params)
+{
+	struct pubkey id;
+	jsmntok_t *idtok, *msatoshitok, *riskfactortok, *cltvtok, *maxroutestok;
+	u64 msatoshi;
+	unsigned cltv = 9, maxroutes = 3;
+	double riskfactor;
+	struct lightningd *ld = cmd->ld;
+	u8 *req;
+
+	if (!json_get_params(buffer, params,
+			     "id", &idtok,
+			     "msatoshi", &msatoshitok,
+			     "riskfactor", &riskfactortok,
+			     "?cltv", &cltvtok,
+			     "?maxroutes", &maxroutestok,
+			     NULL)) {
+		command_fail(cmd, "Need id, msatoshi and riskfactor");
+		return;
+	}
+
+	if (!json_tok_pubkey(buffer, idtok, &id)) {
+		command_fail(cmd, "Invalid id");
+		return;
+	}
+
+	if (cltvtok && !json_tok_number(buffer, cltvtok, &cltv)) {
+		command_fail(cmd, "Invalid cltv");
+		return;
+	}
+
+	if (maxroutestok
+	    && (!json_tok_number(buffer, maxroutestok, &maxroutes)
+		|| maxroutes == 0 || maxroutes > UINT16_MAX)) {
+		command_fail(cmd, "Invalid maxroutes");
+		return;
+	}
+
+	if (!json_tok_u64(buffer, msatoshitok, &msatoshi)) {
+		command_fail(cmd, "'%.*s' is not a valid number",
+			     (int)(msatoshitok->end - msatoshitok->start),
+			     buffer + msatoshitok->start);
+		return;
+	}
+
+	if (!json_tok_double(buffer, riskfactortok, &riskfactor)) {
+		command_fail(cmd, "'%.*s' is not a valid double",
+			     (int)(riskfactortok->end - riskfactortok->start),
+			     buffer + riskfactortok->start);
+		return;
+	}
+
+	req = towire_gossip_getroutes_request(cmd, &ld->id, &id, msatoshi,
+					      riskfactor*1000, cltv, maxroutes);
+	subd_req(ld->gossip, ld->gossip, req, -1, 0, json_getroutes_reply, cmd);
+	command_still_pending(cmd);
+}
+
+static const struct json_command getroutes_command = {
+	"getroutes", json_getroutes,
+	"Return up to {maxroutes} (default 3) routes to {id} for {msatoshi}, using {riskfactor} and optional {cltv} (default 9)",
+	"Returns a {routes} array, cheapest first, each with a {route} as for getroute; no two routes use the same channel in the same direction."
+};
+AUTODATA(json_command, &getroutes_command);
+
+static void json_add_channel_entry(struct json_result *response,
+				   const struct gossip_getchannels_entry *e)
+{
+	json_object_start(response, NULL);
+	json_add_pubkey(response, "source", &e->source);
+	json_add_pubkey(response, "destination", &e->destination);
+	json_add_short_channel_id(response, "short_channel_id",
+				  &e->short_channel_id);
+	json_add_num(response, "flags", e->flags);
+	json_add_bool(response, "active", e->active);
+	json_add_bool(response, "public", e->public);
+	if (e->last_update_timestamp >= 0) {
+		json_add_num(response, "last_update",
+			     e->last_update_timestamp);
+		json_add_num(response, "base_fee_millisatoshi",
+			     e->base_fee_msat);
+		json_add_num(response, "fee_per_millionth",
+			     e->fee_per_millionth);
+		json_add_num(response, "delay", e->delay);
+	}
+	json_object_end(response);
+}
+
+struct getchannels_query {
+	struct command *cmd;
+	struct json_result *response;
+	/* Most channel directions to return (0 == all), and how many we
+	 * have so far. */
+	u32 limit, count;
+	struct short_channel_id end_scid;
+	bool filter_source;
+	struct pubkey source;
+	bool active_only;
+	u32 since;
+};
+
+/* A cursor names a channel direction, as "<short_channel_id>/<direction>". */
+static bool json_tok_getchannels_cursor(const char *buffer,
+					const jsmntok_t *tok,
+					struct short_channel_id *scid,
+					u8 *direction)
+{
+	const char *start = buffer + tok->start;
+	const char *slash = memchr(start, '/', tok->end - tok->start);
+
+	if (!slash || buffer + tok->end != slash + 2)
+		return false;
+	if (slash[1] != '0' && slash[1] != '1')
+		return false;
+	*direction = slash[1] - '0';
+	return short_channel_id_from_str(start, slash - start, scid);
+}
+
+static bool json_tok_scid(const char *buffer, const jsmntok_t *tok,
+			  struct short_channel_id *scid)
+{
+	return short_channel_id_from_str(buffer + tok->start,
+					 tok->end - tok->start, scid);
+}
+
+static void getchannels_send(struct getchannels_query *q,
+			     const struct short_channel_id *start_scid,
+			     u8 start_direction);
+
 /* Called upon receiving a getchannels_reply from `gossipd` */
 static void json_getchannels_reply(struct subd *gossip, const u8 *reply,
-				   const int *fds, struct command *cmd)
+				   const int *fds,
+				   struct getchannels_query *q)
 {
 	size_t i;
 	struct gossip_getchannels_entry *entries;
+	struct json_result *response = q->response;
+	struct short_channel_id next_scid;
+	u8 next_direction;
+	bool more;
+
+	if (!fromwire_gossip_getchannels_reply(reply, reply, NULL, &more,
+					       &next_scid, &next_direction,
+					       &entries)) {
+		command_fail(q->cmd, "Invalid reply from gossipd");
+		return;
+	}
+
+	for (i = 0; i < tal_count(entries); i++)
+		json_add_channel_entry(response, &entries[i]);
+	q->count += tal_count(entries);
+
+	if (more && (!q->limit || q->count < q->limit)) {
+		getchannels_send(q, &next_scid, next_direction);
+		return;
+	}
+
+	json_array_end(response);
+	if (more)
+		json_add_string(response, "cursor",
+				tal_fmt(reply, "%s/%u",
+					type_to_string(reply,
+						       struct short_channel_id,
+						       &next_scid),
+					next_direction));
+	json_object_end(response);
+	command_success(q->cmd, response);
+}
+
+static void getchannels_send(struct getchannels_query *q,
+			     const struct short_channel_id *start_scid,
+			     u8 start_direction)
+{
+	u32 chunk = GOSSIP_LIST_CHUNK;
+	u8 *req;
+
+	if (q->limit && q->limit - q->count < chunk)
+		chunk = q->limit - q->count;
+
+	req = towire_gossip_getchannels_request(q, chunk,
+						start_scid, start_direction,
+						&q->end_scid,
+						q->filter_source, &q->source,
+						q->active_only, q->since);
+	subd_req(q, q->cmd->ld->gossip, take(req), -1, 0,
+		 json_getchannels_reply, q);
+}
+
+static void json_getchannels(struct command *cmd, const char *buffer,
+			     const jsmntok_t *params)
+{
+	jsmntok_t *sourcetok, *firsttok, *lasttok, *activetok, *sincetok;
+	jsmntok_t *limittok, *cursortok;
+	struct getchannels_query *q = tal(cmd, struct getchannels_query);
+	struct short_channel_id start_scid, cursor_scid;
+	u8 start_direction = 0, cursor_direction;
+
+	if (!json_get_params(buffer, params,
+			     "?source", &sourcetok,
+			     "?first_scid", &firsttok,
+			     "?last_scid", &lasttok,
+			     "?active_only", &activetok,
+			     "?since", &sincetok,
+			     "?limit", &limittok,
+			     "?cursor", &cursortok,
+			     NULL)) {
+		command_fail(cmd, "Invalid parameters");
+		return;
+	}
+
+	q->cmd = cmd;
+	q->count = 0;
+	q->limit = 0;
+	q->since = 0;
+	q->active_only = false;
+	q->filter_source = (sourcetok != NULL);
+	/* Unused unless filter_source, but must be a valid key. */
+	q->source = cmd->ld->id;
+	memset(&start_scid, 0, sizeof(start_scid));
+	memset(&q->end_scid, 0xFF, sizeof(q->end_scid));
+
+	if (sourcetok && !json_tok_pubkey(buffer, sourcetok, &q->source)) {
+		command_fail(cmd, "Invalid source");
+		return;
+	}
+	if (firsttok && !json_tok_scid(buffer, firsttok, &start_scid)) {
+		command_fail(cmd, "Invalid first_scid");
+		return;
+	}
+	if (lasttok && !json_tok_scid(buffer, lasttok, &q->end_scid)) {
+		command_fail(cmd, "Invalid last_scid");
+		return;
+	}
+	if (activetok && !json_tok_bool(buffer, activetok, &q->active_only)) {
+		command_fail(cmd, "Invalid active_only");
+		return;
+	}
+	if (sincetok && !json_tok_number(buffer, sincetok, &q->since)) {
+		command_fail(cmd, "Invalid since");
+		return;
+	}
+	if (limittok && !json_tok_number(buffer, limittok, &q->limit)) {
+		command_fail(cmd, "Invalid limit");
+		return;
+	}
+	if (cursortok) {
+		if (!json_tok_getchannels_cursor(buffer, cursortok,
+						 &cursor_scid,
+						 &cursor_direction)) {
+			command_fail(cmd, "Invalid cursor");
+			return;
+		}
+		if (short_channel_id_to_uint(&cursor_scid)
+		    >= short_channel_id_to_uint(&start_scid)) {
+			start_scid = cursor_scid;
+			start_direction = cursor_direction;
+		}
+	}
+
+	q->response = new_json_result(cmd);
+	json_object_start(q->response, NULL);
+	json_array_start(q->response, "channels");
+	getchannels_send(q, &start_scid, start_direction);
+	command_still_pending(cmd);
+}
+
+static const struct json_command getchannels_command = {
+    "getchannels", json_getchannels, "List known channels, in short_channel_id order",
+    "Returns a 'channels' array including their fees; optionally only those from {source}, between {first_scid} and {last_scid}, {active_only}, or updated at or after {since}. Returns at most {limit} starting at {cursor}: if cut short, 'cursor' is where to continue."};
+AUTODATA(json_command, &getchannels_command);
+
+static void getchanges_respond(struct getchanges_query *q,
+			       u64 next, bool more,
+			       const struct gossip_getchannels_entry *channels,
+			       const struct gossip_getnodes_entry *nodes,
+			       const struct short_channel_id *removed_channels,
+			       const struct pubkey *removed_nodes)
+{
+	struct json_result *response = new_json_result(q->cmd);
+	size_t i;
+
+	json_object_start(response, NULL);
+	json_array_start(response, "channels");
+	for (i = 0; i < tal_count(channels); i++)
+		json_add_channel_entry(response, &channels[i]);
+	for (i = 0; i < tal_count(removed_channels); i++) {
+		json_object_start(response, NULL);
+		json_add_short_channel_id(response, "short_channel_id",
+					  &removed_channels[i]);
+		json_add_bool(response, "removed", true);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_array_start(response, "nodes");
+	for (i = 0; i < tal_count(nodes); i++)
+		json_add_node_entry(response, &nodes[i]);
+	for (i = 0; i < tal_count(removed_nodes); i++) {
+		json_object_start(response, NULL);
+		json_add_pubkey(response, "nodeid", &removed_nodes[i]);
+		json_add_bool(response, "removed", true);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_add_u64(response, "next", next);
+	json_add_bool(response, "more", more);
+	json_object_end(response);
+	command_success(q->cmd, response);
+}
+
+static void json_getchanges_reply(struct subd *gossip, const u8 *reply,
+				  const int *fds,
+				  struct getchanges_query *q)
+{
+	struct gossip_getchannels_entry *channels;
+	struct gossip_getnodes_entry *nodes;
+	struct short_channel_id *removed_channels;
+	struct pubkey *removed_nodes;
+	u64 last_index;
+	bool more, expired;
+
+	if (!fromwire_gossip_getchanges_reply(reply, reply, NULL,
+					      &last_index, &more, &expired,
+					      &channels, &nodes,
+					      &removed_channels,
+					      &removed_nodes)) {
+		command_fail(q->cmd, "Invalid reply from gossipd");
+		return;
+	}
+
+	if (expired) {
+		command_fail(q->cmd,
+			     "since %"PRIu64" is too old: start again from 0",
+			     q->since);
+		return;
+	}
+
+	/* Nothing since then: gossipd will tell us when there is. */
+	if (last_index == q->since && q->timeout) {
+		q->waiting = true;
+		list_add_tail(&q->cmd->ld->gossip_change_waiters, &q->list);
+		return;
+	}
+
+	getchanges_respond(q, last_index, more, channels, nodes,
+			   removed_channels, removed_nodes);
+}
+
+static void getchanges_send(struct getchanges_query *q)
+{
+	u8 *req = towire_gossip_getchanges_request(q, q->since, q->limit);
+	subd_req(q, q->cmd->ld->gossip, take(req), -1, 0,
+		 json_getchanges_reply, q);
+}
+
+static void getchanges_timeout(struct getchanges_query *q)
+{
+	getchanges_respond(q, q->since, false, NULL, NULL, NULL, NULL);
+}
+
+static void destroy_getchanges_query(struct getchanges_query *q)
+{
+	if (q->waiting)
+		list_del(&q->list);
+}
+
+static void json_getgossipchanges(struct command *cmd, const char *buffer,
+				  const jsmntok_t *params)
+{
+	jsmntok_t *sincetok, *limittok, *timeouttok;
+	struct getchanges_query *q = tal(cmd, struct getchanges_query);
+	unsigned int limit = 1000;
+
+	if (!json_get_params(buffer, params,
+			     "?since", &sincetok,
+			     "?limit", &limittok,
+			     "?timeout", &timeouttok,
+			     NULL)) {
+		command_fail(cmd, "Invalid parameters");
+		return;
+	}
+
+	q->cmd = cmd;
+	q->waiting = false;
+	q->since = 0;
+	q->timeout = 0;
+	if (sincetok && !json_tok_u64(buffer, sincetok, &q->since)) {
+		command_fail(cmd, "Invalid since");
+		return;
+	}
+	if (limittok
+	    && (!json_tok_number(buffer, limittok, &limit)
+		|| limit == 0 || limit > UINT16_MAX)) {
+		command_fail(cmd, "Invalid limit");
+		return;
+	}
+	q->limit = limit;
+	if (timeouttok && !json_tok_number(buffer, timeouttok, &q->timeout)) {
+		command_fail(cmd, "Invalid timeout");
+		return;
+	}
+	tal_add_destructor(q, destroy_getchanges_query);
+
+	if (q->timeout)
+		new_reltimer(&cmd->ld->timers, q, time_from_sec(q->timeout),
+			     getchanges_timeout, q);
+	getchanges_send(q);
+	command_still_pending(cmd);
+}
+
+static const struct json_command getgossipchanges_command = {
+	"getgossipchanges", json_getgossipchanges,
+	"Return channels and nodes whose gossip changed after {since} (default 0, meaning everything), at most {limit} (default 1000) changes; if there are none, wait up to {timeout} seconds (default 0) for some",
+	"Returns 'channels' and 'nodes' arrays as for getchannels and getnodes, as they are now, and 'next' to pass as {since} next time: 'more' is true if there are more changes already. A channel can appear twice if both its announcement and an update changed.  When one of our own channels closes, it (and any node left without channels) appears once as {short_channel_id} or {nodeid} with 'removed' true; closes of other channels are not reported, unless we find one spent when we restart.  Fails if {since} is more than about an hour old, as removals are forgotten after that: start again from 0."
+};
+AUTODATA(json_command, &getgossipchanges_command);
+
+static void json_getgossipstats_reply(struct subd *gossip, const u8 *reply,
+				      const int *fds, struct command *cmd)
+{
+	u64 dup_announce, stale_update, stale_node, bad_sig, unknown,
+		bad_txout, invalid;
+	u64 cache_entries, cache_hits, cache_misses, cache_invalidations;
 	struct json_result *response = new_json_result(cmd);
 
-	if (!fromwire_gossip_getchannels_reply(reply, reply, NULL, &entries)) {
+	if (!fromwire_gossip_getstats_reply(reply, NULL, &dup_announce,
+					    &stale_update, &stale_node,
+					    &bad_sig, &unknown, &bad_txout,
+					    &invalid, &cache_entries,
+					    &cache_hits, &cache_misses,
+					    &cache_invalidations)) {
 		command_fail(cmd, "Invalid reply from gossipd");
 		return;
 	}
 
 	json_object_start(response, NULL);
-	json_array_start(response, "channels");
-	for (i = 0; i < tal_count(entries); i++) {
+	json_object_start(response, "dropped");
+	json_add_u64(response, "duplicate_channel_announcement", dup_announce);
+	json_add_u64(response, "stale_channel_update", stale_update);
+	json_add_u64(response, "stale_node_announcement", stale_node);
+	json_add_u64(response, "bad_signature", bad_sig);
+	json_add_u64(response, "unknown_channel_or_node", unknown);
+	json_add_u64(response, "bad_txout", bad_txout);
+	json_add_u64(response, "invalid", invalid);
+	json_object_end(response);
+	json_object_start(response, "route_cache");
+	json_add_u64(response, "entries", cache_entries);
+	json_add_u64(response, "hits", cache_hits);
+	json_add_u64(response, "misses", cache_misses);
+	json_add_u64(response, "invalidations", cache_invalidations);
+	json_object_end(response);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+static void json_getgossipstats(struct command *cmd, const char *buffer,
+				const jsmntok_t *params)
+{
+	u8 *req = towire_gossip_getstats_request(cmd);
+	subd_req(cmd->ld->gossip, cmd->ld->gossip,
+		 req, -1, 0, json_getgossipstats_reply, cmd);
+	command_still_pending(cmd);
+}
+
+static const struct json_command getgossipstats_command = {
+	"getgossipstats", json_getgossipstats,
+	"Show how much incoming gossip was dropped, and at which stage, and how well getroute's cache works",
+	"Returns a 'dropped' object of counters: the duplicate/stale ones were caught before checking signatures; and a 'route_cache' object with its {entries} {hits} {misses} {invalidations}."
+};
+AUTODATA(json_command, &getgossipstats_command);
+
+static void json_listroutingfailures_reply(struct subd *gossip, const u8 *reply,
+					   const int *fds, struct command *cmd)
+{
+	struct gossip_routing_failure_entry *failures;
+	struct json_result *response;
+	size_t i;
+
+	if (!fromwire_gossip_getroutingfailures_reply(reply, reply, NULL,
+						      &failures)) {
+		command_fail(cmd, "Invalid reply from gossipd");
+		return;
+	}
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_array_start(response, "failures");
+	for (i = 0; i < tal_count(failures); i++) {
 		json_object_start(response, NULL);
-		json_add_pubkey(response, "source", &entries[i].source);
-		json_add_pubkey(response, "destination",
-				&entries[i].destination);
-		json_add_string(response, "short_channel_id",
-				type_to_string(reply, struct short_channel_id,
-					       &entries[i].short_channel_id));
-		json_add_num(response, "flags", entries[i].flags);
-		json_add_bool(response, "active", entries[i].active);
-		json_add_bool(response, "public", entries[i].public);
-		if (entries[i].last_update_timestamp >= 0) {
-			json_add_num(response, "last_update",
-				     entries[i].last_update_timestamp);
-			json_add_num(response, "base_fee_millisatoshi",
-				     entries[i].base_fee_msat);
-			json_add_num(response, "fee_per_millionth",
-				     entries[i].fee_per_millionth);
-			json_add_num(response, "delay", entries[i].delay);
-		}
+		json_add_short_channel_id(response, "channel",
+					  &failures[i].short_channel_id);
+		json_add_num(response, "direction", failures[i].direction);
+		json_add_num(response, "failcode", failures[i].failcode);
+		json_add_string(response, "failcodename",
+				onion_type_name(failures[i].failcode));
+		if (failures[i].origin_index == ROUTING_FAILURE_LOCAL)
+			json_add_bool(response, "local", true);
+		else
+			json_add_num(response, "erring_index",
+				     failures[i].origin_index);
+		json_add_u64(response, "penalized_until",
+			     failures[i].penalized_until);
 		json_object_end(response);
 	}
 	json_array_end(response);
@@ -344,16 +973,18 @@ static void json_getchannels_reply(struct subd *gossip, const u8 *reply,
 	command_success(cmd, response);
 }
 
-static void json_getchannels(struct command *cmd, const char *buffer,
-			     const jsmntok_t *params)
+static void json_listroutingfailures(struct command *cmd, const char *buffer,
+				     const jsmntok_t *params)
 {
-	u8 *req = towire_gossip_getchannels_request(cmd);
+	u8 *req = towire_gossip_getroutingfailures_request(cmd);
 	subd_req(cmd->ld->gossip, cmd->ld->gossip,
-		 req, -1, 0, json_getchannels_reply, cmd);
+		 req, -1, 0, json_listroutingfailures_reply, cmd);
 	command_still_pending(cmd);
 }
 
-static const struct json_command getchannels_command = {
-    "getchannels", json_getchannels, "List all known channels.",
-    "Returns a 'channels' array with all known channels including their fees."};
-AUTODATA(json_command, &getchannels_command);
+static const struct json_command listroutingfailures_command = {
+	"listroutingfailures", json_listroutingfailures,
+	"Show channels which route finding avoids because payments failed there",
+	"Returns a 'failures' array of {channel} {direction} {failcode} {failcodename} {erring_index} {penalized_until}, with 'local' true instead of {erring_index} if we failed it ourselves.  Until {penalized_until}, routes through the channel cost extra: at first as much again as the payment, halving every minute (every hour for permanent failures)."
+};
+AUTODATA(json_command, &listroutingfailures_command);
@@ -76,3 +76,23 @@ void towire_gossip_getchannels_entry(
 		towire_u32(pptr, entry->delay);
 	}
 }
+
+void fromwire_gossip_routing_failure_entry(const u8 **pptr, size_t *max,
+				struct gossip_routing_failure_entry *entry)
+{
+	fromwire_short_channel_id(pptr, max, &entry->short_channel_id);
+	entry->direction = fromwire_u8(pptr, max);
+	entry->failcode = fromwire_u16(pptr, max);
+	entry->origin_index = fromwire_u16(pptr, max);
+	entry->penalized_until = fromwire_u64(pptr, max);
+}
+
+void towire_gossip_routing_failure_entry(u8 **pptr,
+			const struct gossip_routing_failure_entry *entry)
+{
+	towire_short_channel_id(pptr, &entry->short_channel_id);
+	towire_u8(pptr, entry->direction);
+	towire_u16(pptr, entry->failcode);
+	towire_u16(pptr, entry->origin_index);
+	towire_u64(pptr, entry->penalized_until);
+}
@@ -22,6 +22,15 @@ struct gossip_getchannels_entry {
 	u32 fee_per_millionth;
 };
 
+struct gossip_routing_failure_entry {
+	struct short_channel_id short_channel_id;
+	u8 direction;
+	u16 failcode;
+	u16 origin_index;
+	/* Seconds since epoch until which routes through it cost extra */
+	u64 penalized_until;
+};
+
 void fromwire_gossip_getnodes_entry(const tal_t *ctx, const u8 **pptr,
 				    size_t *max,
 				    struct gossip_getnodes_entry *entry);
@@ -36,4 +45,9 @@ void fromwire_gossip_getchannels_entry(const u8 **pptr, size_t *max,
 void towire_gossip_getchannels_entry(
     u8 **pptr, const struct gossip_getchannels_entry *entry);
 
+void fromwire_gossip_routing_failure_entry(const u8 **pptr, size_t *max,
+				struct gossip_routing_failure_entry *entry);
+void towire_gossip_routing_failure_entry(u8 **pptr,
+			const struct gossip_routing_failure_entry *entry);
+
 #endif /* LIGHTNING_LIGHTNINGD_GOSSIP_MSG_H */
@@ -51,6 +51,8 @@ static struct lightningd *new_lightningd(const tal_t *ctx,
 #endif
 
 	list_head_init(&ld->peers);
+	peer_id_map_init(&ld->peers_by_id);
+	peer_scid_map_init(&ld->peers_by_scid);
 	htlc_in_map_init(&ld->htlcs_in);
 	htlc_out_map_init(&ld->htlcs_out);
 	ld->log_book = log_book;
@@ -59,6 +61,7 @@ static struct lightningd *new_lightningd(const tal_t *ctx,
 	ld->rgb = NULL;
 	list_head_init(&ld->pay_commands);
 	list_head_init(&ld->connects);
+	list_head_init(&ld->gossip_change_waiters);
 	ld->wireaddrs = tal_arr(ld, struct wireaddr, 0);
 	ld->portnum = DEFAULT_PORT;
 	timers_init(&ld->timers, time_mono());
@@ -200,6 +203,30 @@ void derive_peer_seed(struct lightningd *ld, struct privkey *peer_seed,
 		    info, strlen(info));
 }
 
+/* Nothing we send (to subdaemons, peers via them, or JSON-RPC clients)
+ * goes out until we poll, so that's where group commit commits. */
+static struct db *group_commit_db;
+
+static int group_commit_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	db_flush(group_commit_db);
+	return debug_poll(fds, nfds, timeout);
+}
+
+/* Keep channel_htlcs down to live HTLCs, and forget old history. */
+static void archive_htlcs(struct lightningd *ld)
+{
+	u64 now = time_now().ts.tv_sec;
+	u64 keep = (u64)ld->config.htlc_history_days * 24 * 60 * 60;
+
+	wallet_htlcs_archive(ld->wallet, now);
+	if (keep && now > keep)
+		wallet_htlc_history_compact(ld->wallet, now - keep);
+
+	new_reltimer(&ld->timers, ld, ld->config.htlc_archive_time,
+		     archive_htlcs, ld);
+}
+
 static void shutdown_subdaemons(struct lightningd *ld)
 {
 	struct peer *p;
@@ -282,6 +309,13 @@ int main(int argc, char *argv[])
 	/* Initialize wallet, now that we are in the correct directory */
 	ld->wallet = wallet_new(ld, ld->log);
 	ld->owned_txfilter = txfilter_new(ld);
+	db_set_profile(ld->wallet->db, ld->config.db_profile);
+
+	if (ld->config.db_group_commit) {
+		ld->wallet->db->group_commit = true;
+		group_commit_db = ld->wallet->db;
+		io_poll_override(group_commit_poll);
+	}
 
 	/* Set up HSM. */
 	hsm_init(ld, newdir);
@@ -300,6 +334,9 @@ int main(int argc, char *argv[])
 		fatal("Could not load invoices from the database");
 	}
 
+	/* Before we load HTLCs, so we only load live ones. */
+	archive_htlcs(ld);
+
 	/* Set up gossip daemon. */
 	gossip_init(ld);
 
@@ -361,6 +398,7 @@ int main(int argc, char *argv[])
 	}
 
 	shutdown_subdaemons(ld);
+	db_flush(ld->wallet->db);
 
 	tal_free(ld);
 	opt_free_table();
@@ -7,6 +7,7 @@
 #include <ccan/time/time.h>
 #include <ccan/timer/timer.h>
 #include <lightningd/htlc_end.h>
+#include <lightningd/peer_control.h>
 #include <lightningd/txfilter.h>
 #include <stdio.h>
 #include <wallet/wallet.h>
@@ -68,6 +69,18 @@ struct config {
 
 	/* Disable automatic reconnects */
 	bool no_reconnect;
+
+	/* Commit database transactions together, before we next poll */
+	bool db_group_commit;
+
+	/* Database journaling and tuning */
+	enum db_profile db_profile;
+
+	/* How often to move resolved HTLCs into history. */
+	struct timerel htlc_archive_time;
+
+	/* Days to keep HTLC history of closed channels (0 = forever) */
+	u32 htlc_history_days;
 };
 
 struct lightningd {
@@ -109,6 +122,10 @@ struct lightningd {
 
 	/* All peers we're tracking. */
 	struct list_head peers;
+	/* ... indexed by node id, ... */
+	struct peer_id_map peers_by_id;
+	/* ... and those with a channel, by short_channel_id. */
+	struct peer_scid_map peers_by_scid;
 	/* FIXME: This should stay in HSM */
 	struct secret peer_seed;
 
@@ -130,6 +147,9 @@ struct lightningd {
 	/* Any outstanding "pay" commands. */
 	struct list_head pay_commands;
 
+	/* "getgossipchanges" commands waiting for new gossip. */
+	struct list_head gossip_change_waiters;
+
 	/* Transaction filter matching what we're interested in */
 	struct txfilter *owned_txfilter;
 
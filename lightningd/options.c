@@ -149,6 +149,20 @@ static void opt_show_network(char buf[OPT_SHOW_LEN],
 	snprintf(buf, OPT_SHOW_LEN, "%s", get_chainparams(ld)->network_name);
 }
 
+static char *opt_set_db_profile(const char *arg, struct lightningd *ld)
+{
+	if (!db_profile_by_name(arg, &ld->config.db_profile))
+		return tal_fmt(NULL, "Unknown database profile '%s'", arg);
+	return NULL;
+}
+
+static void opt_show_db_profile(char buf[OPT_SHOW_LEN],
+				const struct lightningd *ld)
+{
+	snprintf(buf, OPT_SHOW_LEN, "%s",
+		 db_profile_name(ld->config.db_profile));
+}
+
 static char *opt_set_rgb(const char *arg, struct lightningd *ld)
 {
 	ld->rgb = tal_free(ld->rgb);
@@ -257,6 +271,19 @@ static void config_register_opts(struct lightningd *ld)
 			 "Microsatoshi fee for every satoshi in HTLC");
 	opt_register_noarg("--no-reconnect", opt_set_bool,
 			   &ld->config.no_reconnect, "Disable automatic reconnect attempts");
+	opt_register_noarg("--db-group-commit", opt_set_bool,
+			   &ld->config.db_group_commit,
+			   "Commit all database changes once per event loop iteration, before sending anything out");
+	opt_register_arg("--db-profile", opt_set_db_profile,
+			 opt_show_db_profile, ld,
+			 "Database journaling: rollback, or wal (write-ahead"
+			 " log, checkpointed in the background)");
+	opt_register_arg("--htlc-archive-time", opt_set_time, opt_show_time,
+			 &ld->config.htlc_archive_time,
+			 "Time between moving resolved HTLCs into history");
+	opt_register_arg("--htlc-history-days", opt_set_u32, opt_show_u32,
+			 &ld->config.htlc_history_days,
+			 "Days to keep HTLC history of closed channels (0 to keep forever)");
 
 	opt_register_arg("--ipaddr", opt_add_ipaddr, NULL,
 			 ld,
@@ -343,6 +370,16 @@ static const struct config testnet_config = {
 
 	/* Automatically reconnect */
 	.no_reconnect = false,
+
+	/* Commit each transaction as it ends */
+	.db_group_commit = false,
+
+	/* sqlite's defaults */
+	.db_profile = DB_PROFILE_ROLLBACK,
+
+	/* Archive resolved HTLCs hourly, and keep their history. */
+	.htlc_archive_time = TIME_FROM_SEC(60 * 60),
+	.htlc_history_days = 0,
 };
 
 /* aka. "Dude, where's my coins?" */
@@ -401,6 +438,16 @@ static const struct config mainnet_config = {
 
 	/* Automatically reconnect */
 	.no_reconnect = false,
+
+	/* Commit each transaction as it ends */
+	.db_group_commit = false,
+
+	/* sqlite's defaults */
+	.db_profile = DB_PROFILE_ROLLBACK,
+
+	/* Archive resolved HTLCs hourly, and keep their history. */
+	.htlc_archive_time = TIME_FROM_SEC(60 * 60),
+	.htlc_history_days = 0,
 };
 
 static void check_config(struct lightningd *ld)
@@ -3,6 +3,7 @@
 #include <ccan/str/hex/hex.h>
 #include <ccan/structeq/structeq.h>
 #include <ccan/tal/str/str.h>
+#include <ccan/time/time.h>
 #include <channeld/gen_channel_wire.h>
 #include <common/bolt11.h>
 #include <gossipd/gen_gossip_wire.h>
@@ -17,23 +18,89 @@
 #include <lightningd/subd.h>
 #include <sodium/randombytes.h>
 
+/* One sendpay done on behalf of a "pay" command. */
+struct pay_attempt {
+	/* When we sent it, and how long until it resolved. */
+	struct timeabs start;
+	struct timerel duration;
+	size_t num_hops;
+	/* NULL unless it failed. */
+	const char *failure;
+};
+
+/* A "pay" command: it keeps finding a new route and retrying until it
+ * succeeds, or runs out of attempts or time. */
+struct pay {
+	struct lightningd *ld;
+	struct command *cmd;
+	struct sha256 payment_hash;
+	struct pubkey receiver_id;
+	u64 msatoshi;
+	double riskfactor;
+	u32 min_final_cltv_expiry;
+
+	/* Give up after maxtries attempts, or once past deadline. */
+	unsigned int maxtries;
+	struct timeabs deadline;
+
+	/* Every attempt so far; only the last one can be in progress. */
+	struct pay_attempt *attempts;
+};
+
+static void pay_attempt_failed(struct pay *pay, enum onion_type failure_code,
+			       const char *details, bool retriable);
+
 /* Outstanding "pay" commands. */
 struct pay_command {
 	struct list_node list;
 	struct sha256 rhash;
 	u64 msatoshi;
 	const struct pubkey *ids;
+	/* Channel leading to each of ids */
+	const struct short_channel_id *channels;
 	/* Set if this is in progress. */
 	struct htlc_out *out;
 	/* Preimage if this succeeded. */
 	const struct preimage *rval;
 	struct command *cmd;
+	/* Set if cmd is a "pay" which will retry on failure. */
+	struct pay *pay;
 
 	/* Remember all shared secrets, so we can unwrap an eventual failure */
 	struct secret *path_secrets;
 };
 
-static void json_pay_success(struct command *cmd, const struct preimage *rval)
+/* The last attempt is over: note how long it took. */
+static struct pay_attempt *pay_attempt_done(struct pay *pay)
+{
+	struct pay_attempt *attempt = &pay->attempts[tal_count(pay->attempts)-1];
+
+	attempt->duration = time_between(time_now(), attempt->start);
+	return attempt;
+}
+
+static void json_add_pay_attempts(struct json_result *response,
+				  const struct pay *pay)
+{
+	size_t i;
+
+	json_array_start(response, "attempts");
+	for (i = 0; i < tal_count(pay->attempts); i++) {
+		const struct pay_attempt *attempt = &pay->attempts[i];
+
+		json_object_start(response, NULL);
+		json_add_num(response, "hops", attempt->num_hops);
+		json_add_u64(response, "duration_msec",
+			     time_to_msec(attempt->duration));
+		if (attempt->failure)
+			json_add_string(response, "failure", attempt->failure);
+		json_object_end(response);
+	}
+	json_array_end(response);
+}
+
+static void json_pay_success(struct command *cmd, struct pay *pay,
+			     const struct preimage *rval)
 {
 	struct json_result *response;
 
@@ -44,6 +111,10 @@ static void json_pay_success(struct command *cmd, const struct preimage *rval)
 	response = new_json_result(cmd);
 	json_object_start(response, NULL);
 	json_add_hex(response, "preimage", rval, sizeof(*rval));
+	if (pay) {
+		pay_attempt_done(pay);
+		json_add_pay_attempts(response, pay);
+	}
 	json_object_end(response);
 	command_success(cmd, response);
 }
@@ -51,17 +122,23 @@ static void json_pay_success(struct command *cmd, const struct preimage *rval)
 static void json_pay_failed(struct pay_command *pc,
 			    const struct pubkey *sender,
 			    enum onion_type failure_code,
-			    const char *details)
+			    const char *details,
+			    bool retriable)
 {
 	/* Can be NULL if JSON RPC goes away. */
 	if (!pc->cmd)
 		return;
 
+	pc->out = NULL;
+
+	if (pc->pay) {
+		pay_attempt_failed(pc->pay, failure_code, details, retriable);
+		return;
+	}
+
 	/* FIXME: Report sender! */
 	command_fail(pc->cmd, "failed: %s (%s)",
 		     onion_type_name(failure_code), details);
-
-	pc->out = NULL;
 }
 
 void payment_succeeded(struct lightningd *ld, struct htlc_out *hout,
@@ -71,22 +148,117 @@ void payment_succeeded(struct lightningd *ld, struct htlc_out *hout,
 	wallet_payment_set_status(ld->wallet, &hout->payment_hash, PAYMENT_COMPLETE);
 	hout->pay_command->rval = tal_dup(hout->pay_command,
 					  struct preimage, rval);
-	json_pay_success(hout->pay_command->cmd, rval);
+	json_pay_success(hout->pay_command->cmd, hout->pay_command->pay, rval);
 	hout->pay_command->out = NULL;
 }
 
+/* Failures which say the erring node wants different fees, cltv or amount
+ * carry its latest channel_update: returns it, or NULL. */
+static u8 *channel_update_from_onion_error(const tal_t *ctx,
+					   const u8 *onion_message)
+{
+	u8 *channel_update = NULL;
+	u64 unused64;
+	u32 unused32;
+
+	if (!onion_message)
+		return NULL;
+
+	switch (fromwire_peektype(onion_message)) {
+	case WIRE_TEMPORARY_CHANNEL_FAILURE:
+		fromwire_temporary_channel_failure(ctx, onion_message, NULL,
+						   &channel_update);
+		break;
+	case WIRE_AMOUNT_BELOW_MINIMUM:
+		fromwire_amount_below_minimum(ctx, onion_message, NULL,
+					      &unused64, &channel_update);
+		break;
+	case WIRE_FEE_INSUFFICIENT:
+		fromwire_fee_insufficient(ctx, onion_message, NULL,
+					  &unused64, &channel_update);
+		break;
+	case WIRE_INCORRECT_CLTV_EXPIRY:
+		fromwire_incorrect_cltv_expiry(ctx, onion_message, NULL,
+					       &unused32, &channel_update);
+		break;
+	case WIRE_EXPIRY_TOO_SOON:
+		fromwire_expiry_too_soon(ctx, onion_message, NULL,
+					 &channel_update);
+		break;
+	default:
+		break;
+	}
+	return channel_update;
+}
+
+/* Tell gossipd which channel to avoid next time, if it's one we can blame.
+ * origin_index -1 means we failed it ourselves. */
+static void report_routing_failure(struct lightningd *ld,
+				   const struct pay_command *pc,
+				   int origin_index, enum onion_type failcode,
+				   const u8 *onion_message)
+{
+	const struct pubkey *from, *to;
+	size_t n_hops = tal_count(pc->ids);
+	u8 *channel_update;
+	int hop;
+
+	if (failcode & NODE) {
+		/* The node itself is the problem: avoid the channel into it. */
+		if (origin_index == (int)n_hops - 1)
+			return;
+		hop = origin_index;
+	} else if (failcode & (UPDATE | PERM)) {
+		/* Failed on its outgoing channel. */
+		hop = origin_index + 1;
+	} else
+		return;
+
+	if (hop < 0 || hop >= (int)n_hops)
+		return;
+
+	from = hop == 0 ? &ld->id : &pc->ids[hop - 1];
+	to = &pc->ids[hop];
+	channel_update = channel_update_from_onion_error(pc, onion_message);
+	subd_send_msg(ld->gossip,
+		      take(towire_gossip_routing_failure(pc,
+						 &pc->channels[hop],
+						 get_channel_direction(from, to),
+						 failcode,
+						 origin_index < 0
+						 ? ROUTING_FAILURE_LOCAL
+						 : origin_index,
+						 channel_update)));
+	tal_free(channel_update);
+}
+
+/* We couldn't even hand the HTLC to the first peer. */
+static void report_first_hop_failure(struct lightningd *ld,
+				     const struct short_channel_id *channel,
+				     const struct pubkey *first,
+				     enum onion_type failcode)
+{
+	subd_send_msg(ld->gossip,
+		      take(towire_gossip_routing_failure(NULL, channel,
+					get_channel_direction(&ld->id, first),
+					failcode, ROUTING_FAILURE_LOCAL,
+					NULL)));
+}
+
 void payment_failed(struct lightningd *ld, const struct htlc_out *hout,
 		    const char *localfail)
 {
 	struct pay_command *pc = hout->pay_command;
 	struct onionreply *reply;
 	enum onion_type failcode;
+	bool retriable;
 
 	wallet_payment_set_status(ld->wallet, &hout->payment_hash, PAYMENT_FAILED);
 
 	/* This gives more details than a generic failure message */
 	if (localfail) {
-		json_pay_failed(pc, NULL, hout->failcode, localfail);
+		report_routing_failure(ld, pc, -1, hout->failcode, NULL);
+		json_pay_failed(pc, NULL, hout->failcode, localfail, true);
 		return;
 	}
 
@@ -112,10 +284,15 @@ void payment_failed(struct lightningd *ld, const struct htlc_out *hout,
 
 	/* FIXME: save ids we can turn reply->origin_index into sender. */
 
-	/* FIXME: check for routing failure / perm fail. */
-	/* check_for_routing_failure(i, sender, failure_code); */
+	if (reply) {
+		report_routing_failure(ld, pc, reply->origin_index, failcode,
+				       reply->msg);
+		/* No other route will change the recipient's mind. */
+		retriable = (reply->origin_index != (int)tal_count(pc->ids) - 1);
+	} else
+		retriable = true;
 
-	json_pay_failed(pc, NULL, failcode, "reply from remote");
+	json_pay_failed(pc, NULL, failcode, "reply from remote", retriable);
 }
 
 /* When JSON RPC goes away, cmd is freed: detach from any running paycommand */
@@ -123,8 +300,10 @@ static void remove_cmd_from_pc(struct command *cmd, struct pay_command *pc)
 {
 	/* This can be false, in the case where another pay command
 	 * re-uses the pc->cmd before we get around to cleaning up. */
-	if (pc->cmd == cmd)
+	if (pc->cmd == cmd) {
 		pc->cmd = NULL;
+		pc->pay = NULL;
+	}
 }
 
 static struct pay_command *find_pay_command(struct lightningd *ld,
@@ -146,6 +325,7 @@ static void pay_command_destroyed(struct pay_command *pc)
 
 /* Returns true if it's still pending. */
 static bool send_payment(struct command *cmd,
+			 struct pay *pay,
 			 const struct sha256 *rhash,
 			 const struct route_hop *route)
 {
@@ -162,14 +342,18 @@ static bool send_payment(struct command *cmd,
 	size_t i, n_hops = tal_count(route);
 	struct hop_data *hop_data = tal_arr(tmpctx, struct hop_data, n_hops);
 	struct pubkey *ids = tal_arr(tmpctx, struct pubkey, n_hops);
+	struct short_channel_id *channels
+		= tal_arr(tmpctx, struct short_channel_id, n_hops);
 	struct wallet_payment *payment = NULL;
 
 	/* Expiry for HTLCs is absolute.  And add one to give some margin. */
 	base_expiry = get_block_height(cmd->ld->topology) + 1;
 
 	/* Extract IDs for each hop: create_onionpacket wants array. */
-	for (i = 0; i < n_hops; i++)
+	for (i = 0; i < n_hops; i++) {
 		ids[i] = route[i].nodeid;
+		channels[i] = route[i].channel_id;
+	}
 
 	/* Copy hop_data[n] from route[n+1] (ie. where it goes next) */
 	for (i = 0; i < n_hops - 1; i++) {
@@ -213,15 +397,26 @@ static bool send_payment(struct command *cmd,
 					     previd);
 				return false;
 			}
-			json_pay_success(cmd, pc->rval);
+			json_pay_success(cmd, pay, pc->rval);
 			return false;
 		}
 		/* FIXME: We can free failed ones... */
 		log_add(cmd->ld->log, "... retrying");
+		wallet_payment_set_status(cmd->ld->wallet, rhash,
+					  PAYMENT_PENDING);
 	}
 
 	peer = peer_by_id(cmd->ld, &ids[0]);
 	if (!peer) {
+		if (pay) {
+			report_first_hop_failure(cmd->ld, &channels[0], &ids[0],
+						 WIRE_UNKNOWN_NEXT_PEER);
+			tal_free(tmpctx);
+			pay_attempt_failed(pay, WIRE_UNKNOWN_NEXT_PEER,
+					   "no connection to first peer found",
+					   true);
+			return false;
+		}
 		command_fail(cmd, "no connection to first peer found");
 		return false;
 	}
@@ -235,6 +430,7 @@ static bool send_payment(struct command *cmd,
 
 	if (pc) {
 		pc->ids = tal_free(pc->ids);
+		pc->channels = tal_free(pc->channels);
 		pc->path_secrets = tal_free(pc->path_secrets);
 	} else {
 		pc = tal(cmd->ld, struct pay_command);
@@ -250,11 +446,25 @@ static bool send_payment(struct command *cmd,
 		payment->msatoshi = tal(payment, u64);
 		*payment->msatoshi = route[n_hops-1].amount;
 		payment->timestamp = time_now().ts.tv_sec;
+		pc->cmd = NULL;
+	}
+
+	/* "pay" retries with the same cmd: it only needs this once. */
+	if (pc->cmd != cmd) {
+		/* Wait until we get response. */
+		tal_add_destructor2(cmd, remove_cmd_from_pc, pc);
+
+		/* They're both children of ld, but on shutdown make sure we
+		 * destroy the command before the pc, otherwise the
+		 * remove_cmd_from_pc destructor causes a use-after-free */
+		tal_steal(pc, cmd);
 	}
 	pc->cmd = cmd;
+	pc->pay = pay;
 	pc->rhash = *rhash;
 	pc->rval = NULL;
 	pc->ids = tal_steal(pc, ids);
+	pc->channels = tal_steal(pc, channels);
 	pc->msatoshi = route[n_hops-1].amount;
 	pc->path_secrets = tal_steal(pc, path_secrets);
 	pc->out = NULL;
@@ -262,19 +472,19 @@ static bool send_payment(struct command *cmd,
 	log_info(cmd->ld->log, "Sending %u over %zu hops to deliver %"PRIu64,
 		 route[0].amount, n_hops, pc->msatoshi);
 
-	/* Wait until we get response. */
-	tal_add_destructor2(cmd, remove_cmd_from_pc, pc);
-
-	/* They're both children of ld, but on shutdown make sure we
-	 * destroy the command before the pc, otherwise the
-	 * remove_cmd_from_pc destructor causes a use-after-free */
-	tal_steal(pc, cmd);
-
 	failcode = send_htlc_out(peer, route[0].amount,
 				 base_expiry + route[0].delay,
 				 rhash, onion, NULL, payment, pc,
 				 &pc->out);
 	if (failcode) {
+		if (pay) {
+			report_first_hop_failure(cmd->ld, &pc->channels[0],
+						 &pc->ids[0], failcode);
+			tal_free(tmpctx);
+			pay_attempt_failed(pay, failcode,
+					   "first peer not ready", true);
+			return false;
+		}
 		command_fail(cmd, "first peer not ready: %s",
 			     onion_type_name(failcode));
 		return false;
@@ -371,7 +581,7 @@ static void json_sendpay(struct command *cmd,
 		return;
 	}
 
-	if (send_payment(cmd, &rhash, route))
+	if (send_payment(cmd, NULL, &rhash, route))
 		command_still_pending(cmd);
 }
 
@@ -383,43 +593,92 @@ static const struct json_command sendpay_command = {
 };
 AUTODATA(json_command, &sendpay_command);
 
-struct pay {
-	struct sha256 payment_hash;
-	struct command *cmd;
-};
-
 static void json_pay_getroute_reply(struct subd *gossip,
 				    const u8 *reply, const int *fds,
 				    struct pay *pay)
 {
 	struct route_hop *route;
+	size_t n = tal_count(pay->attempts);
 
 	fromwire_gossip_getroute_reply(reply, reply, NULL, &route);
 
 	if (tal_count(route) == 0) {
-		command_fail(pay->cmd, "Could not find a route");
+		if (n == 0)
+			command_fail(pay->cmd, "Could not find a route");
+		else
+			command_fail(pay->cmd,
+				     "Could not find a route after %zu attempts,"
+				     " last failed: %s",
+				     n, pay->attempts[n-1].failure);
 		return;
 	}
 
-	send_payment(pay->cmd, &pay->payment_hash, route);
+	tal_resize(&pay->attempts, n + 1);
+	pay->attempts[n].start = time_now();
+	pay->attempts[n].num_hops = tal_count(route);
+	pay->attempts[n].failure = NULL;
+
+	send_payment(pay->cmd, pay, &pay->payment_hash, route);
+}
+
+/* Ask gossipd for a route: it avoids whatever failed last time. */
+static void pay_try(struct pay *pay)
+{
+	/* FIXME: use b11->routes */
+	u8 *req = towire_gossip_getroute_request(pay, &pay->ld->id,
+						 &pay->receiver_id,
+						 pay->msatoshi,
+						 pay->riskfactor*1000,
+						 pay->min_final_cltv_expiry);
+	subd_req(pay, pay->ld->gossip, req, -1, 0, json_pay_getroute_reply, pay);
+}
+
+static void pay_attempt_failed(struct pay *pay, enum onion_type failure_code,
+			       const char *details, bool retriable)
+{
+	struct pay_attempt *attempt = pay_attempt_done(pay);
+	size_t n = tal_count(pay->attempts);
+
+	attempt->failure = tal_fmt(pay->attempts, "%s (%s)",
+				   onion_type_name(failure_code), details);
+	log_info(pay->ld->log, "pay attempt %zu over %zu hops failed"
+		 " after %"PRIu64"ms: %s",
+		 n, attempt->num_hops, time_to_msec(attempt->duration),
+		 attempt->failure);
+
+	if (retriable
+	    && n < pay->maxtries
+	    && time_before(time_now(), pay->deadline)) {
+		pay_try(pay);
+		return;
+	}
+
+	if (n == 1)
+		command_fail(pay->cmd, "failed: %s", attempt->failure);
+	else
+		command_fail(pay->cmd, "failed after %zu attempts: %s",
+			     n, attempt->failure);
 }
 
 static void json_pay(struct command *cmd,
 		     const char *buffer, const jsmntok_t *params)
 {
 	jsmntok_t *bolt11tok, *msatoshitok, *desctok, *riskfactortok;
+	jsmntok_t *maxtriestok, *retryfortok;
 	double riskfactor = 1.0;
+	unsigned int retryfor = 60;
 	u64 msatoshi;
 	struct pay *pay = tal(cmd, struct pay);
 	struct bolt11 *b11;
 	char *fail, *b11str, *desc;
-	u8 *req;
 
 	if (!json_get_params(buffer, params,
 			     "bolt11", &bolt11tok,
 			     "?msatoshi", &msatoshitok,
 			     "?description", &desctok,
 			     "?riskfactor", &riskfactortok,
+			     "?maxtries", &maxtriestok,
+			     "?retry_for", &retryfortok,
 			     NULL)) {
 		command_fail(cmd, "Need bolt11 string");
 		return;
@@ -439,8 +698,13 @@ static void json_pay(struct command *cmd,
 		return;
 	}
 
+	pay->ld = cmd->ld;
 	pay->cmd = cmd;
 	pay->payment_hash = b11->payment_hash;
+	pay->receiver_id = b11->receiver_id;
+	pay->min_final_cltv_expiry = b11->min_final_cltv_expiry;
+	pay->maxtries = 10;
+	pay->attempts = tal_arr(pay, struct pay_attempt, 0);
 
 	if (b11->msatoshi) {
 		msatoshi = *b11->msatoshi;
@@ -470,20 +734,36 @@ static void json_pay(struct command *cmd,
 		return;
 	}
 
-	/* FIXME: use b11->routes */
-	req = towire_gossip_getroute_request(cmd, &cmd->ld->id,
-					     &b11->receiver_id,
-					     msatoshi, riskfactor*1000,
-					     b11->min_final_cltv_expiry);
-	subd_req(pay, cmd->ld->gossip, req, -1, 0, json_pay_getroute_reply, pay);
+	if (maxtriestok
+	    && (!json_tok_number(buffer, maxtriestok, &pay->maxtries)
+		|| pay->maxtries == 0)) {
+		command_fail(cmd, "'%.*s' is not a valid maxtries",
+			     (int)(maxtriestok->end - maxtriestok->start),
+			     buffer + maxtriestok->start);
+		return;
+	}
+
+	if (retryfortok
+	    && !json_tok_number(buffer, retryfortok, &retryfor)) {
+		command_fail(cmd, "'%.*s' is not a valid retry_for",
+			     (int)(retryfortok->end - retryfortok->start),
+			     buffer + retryfortok->start);
+		return;
+	}
+
+	pay->msatoshi = msatoshi;
+	pay->riskfactor = riskfactor;
+	pay->deadline = timeabs_add(time_now(), time_from_sec(retryfor));
+
+	pay_try(pay);
 	command_still_pending(cmd);
 }
 
 static const struct json_command pay_command = {
 	"pay",
 	json_pay,
-	"Send payment in {bolt11} with optional {msatoshi}, {description} and {riskfactor}",
-	"Returns the {preimage} on success"
+	"Send payment in {bolt11} with optional {msatoshi}, {description}, {riskfactor}, {maxtries} (default 10) and {retry_for} (seconds, default 60)",
+	"Returns the {preimage} on success, and the {hops}, {duration_msec} and {failure} of each of the {attempts}"
 };
 AUTODATA(json_command, &pay_command);
 
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <bitcoin/script.h>
 #include <bitcoin/tx.h>
+#include <ccan/crypto/siphash24/siphash24.h>
 #include <ccan/fdpass/fdpass.h>
 #include <ccan/io/io.h>
 #include <ccan/noerr/noerr.h>
@@ -18,6 +19,7 @@
 #include <common/funding_tx.h>
 #include <common/initial_commit_tx.h>
 #include <common/key_derive.h>
+#include <common/pseudorand.h>
 #include <common/status.h>
 #include <common/timeout.h>
 #include <common/wire_error.h>
@@ -89,6 +91,38 @@ static void peer_set_owner(struct peer *peer, struct subd *owner)
 		subd_release_peer(old_owner, peer);
 }
 
+const struct pubkey *peer_id_keyof(const struct peer *peer)
+{
+	return &peer->id;
+}
+
+size_t peer_id_hash(const struct pubkey *id)
+{
+	return siphash24(siphash_seed(), &id->pubkey, sizeof(id->pubkey));
+}
+
+bool peer_id_eq(const struct peer *peer, const struct pubkey *id)
+{
+	return pubkey_eq(&peer->id, id);
+}
+
+const struct short_channel_id *peer_scid_keyof(const struct peer *peer)
+{
+	return peer->scid;
+}
+
+size_t peer_scid_hash(const struct short_channel_id *scid)
+{
+	/* Don't hash the bitfield padding. */
+	u64 key = short_channel_id_to_uint(scid);
+	return siphash24(siphash_seed(), &key, sizeof(key));
+}
+
+bool peer_scid_eq(const struct peer *peer, const struct short_channel_id *scid)
+{
+	return short_channel_id_eq(peer->scid, scid);
+}
+
 static void destroy_peer(struct peer *peer)
 {
 	/* Must not have any HTLCs! */
@@ -120,6 +154,9 @@ static void destroy_peer(struct peer *peer)
 	/* Free any old owner still hanging around. */
 	peer_set_owner(peer, NULL);
 	list_del_from(&peer->ld->peers, &peer->list);
+	peer_id_map_del(&peer->ld->peers_by_id, peer);
+	if (peer->scid)
+		peer_scid_map_del(&peer->ld->peers_by_scid, peer);
 }
 
 static void sign_last_tx(struct peer *peer)
@@ -680,17 +717,22 @@ void populate_peer(struct lightningd *ld, struct peer *peer)
 	peer->log = new_log(peer, peer->log_book, "peer %s:", idname);
 	set_log_outfn(peer->log_book, copy_to_parent_log, peer);
 	tal_free(idname);
+	peer_id_map_add(&ld->peers_by_id, peer);
+	/* Loaded from the database with its channel already locked in? */
+	if (peer->scid)
+		peer_scid_map_add(&ld->peers_by_scid, peer);
 	tal_add_destructor(peer, destroy_peer);
 }
 
 struct peer *peer_by_id(struct lightningd *ld, const struct pubkey *id)
 {
-	struct peer *p;
+	return peer_id_map_get(&ld->peers_by_id, id);
+}
 
-	list_for_each(&ld->peers, p, list)
-		if (pubkey_eq(&p->id, id))
-			return p;
-	return NULL;
+struct peer *peer_by_scid(struct lightningd *ld,
+			  const struct short_channel_id *scid)
+{
+	return peer_scid_map_get(&ld->peers_by_scid, scid);
 }
 
 static void json_connect(struct command *cmd,
@@ -1338,6 +1380,12 @@ static enum watch_result funding_spent(struct peer *peer,
 
 	peer_fail_permanent(peer, "Funding transaction spent");
 
+	/* Nobody can route through it any more. */
+	if (peer->scid) {
+		msg = towire_gossip_channel_closed(peer, peer->scid);
+		subd_send_msg(peer->ld->gossip, take(msg));
+	}
+
 	/* We could come from almost any state. */
 	peer_set_condition(peer, peer->state, FUNDING_SPEND_SEEN);
 
@@ -1468,6 +1516,7 @@ static enum watch_result funding_lockin_cb(struct peer *peer,
 		peer->scid->blocknum = loc->blkheight;
 		peer->scid->txnum = loc->index;
 		peer->scid->outnum = peer->funding_outnum;
+		peer_scid_map_add(&peer->ld->peers_by_scid, peer);
 	}
 	tal_free(loc);
 
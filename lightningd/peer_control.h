@@ -3,6 +3,7 @@
 #include "config.h"
 #include <ccan/compiler/compiler.h>
 #include <ccan/crypto/shachain/shachain.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/list/list.h>
 #include <common/channel_config.h>
 #include <common/htlc.h>
@@ -102,6 +103,20 @@ struct peer {
 	struct wallet_channel *channel;
 };
 
+/* ld->peers_by_id: every peer, by node id. */
+const struct pubkey *peer_id_keyof(const struct peer *peer);
+size_t peer_id_hash(const struct pubkey *id);
+bool peer_id_eq(const struct peer *peer, const struct pubkey *id);
+HTABLE_DEFINE_TYPE(struct peer, peer_id_keyof, peer_id_hash, peer_id_eq,
+		   peer_id_map);
+
+/* ld->peers_by_scid: peers whose channel has a short_channel_id. */
+const struct short_channel_id *peer_scid_keyof(const struct peer *peer);
+size_t peer_scid_hash(const struct short_channel_id *scid);
+bool peer_scid_eq(const struct peer *peer, const struct short_channel_id *scid);
+HTABLE_DEFINE_TYPE(struct peer, peer_scid_keyof, peer_scid_hash, peer_scid_eq,
+		   peer_scid_map);
+
 static inline bool peer_can_add_htlc(const struct peer *peer)
 {
 	return peer->state == CHANNELD_NORMAL;
@@ -156,6 +171,9 @@ static inline bool peer_persists(const struct peer *peer)
 }
 
 struct peer *peer_by_id(struct lightningd *ld, const struct pubkey *id);
+/* Our peer on this (local) channel, if any. */
+struct peer *peer_by_scid(struct lightningd *ld,
+			  const struct short_channel_id *scid);
 struct peer *peer_from_json(struct lightningd *ld,
 			    const char *buffer,
 			    jsmntok_t *peeridtok);
@@ -411,13 +411,12 @@ static void forward_htlc(struct htlc_in *hin,
 			 const struct sha256 *payment_hash,
 			 u64 amt_to_forward,
 			 u32 outgoing_cltv_value,
-			 const struct pubkey *next_hop,
+			 struct peer *next,
 			 const u8 next_onion[TOTAL_PACKET_SIZE])
 {
 	enum onion_type failcode;
 	u64 fee;
 	struct lightningd *ld = hin->key.peer->ld;
-	struct peer *next = peer_by_id(ld, next_hop);
 
 	/* Unknown peer, or peer not ready. */
 	if (!next || !next->scid) {
@@ -535,8 +534,8 @@ static void channel_resolve_reply(struct subd *gossip, const u8 *msg,
 	}
 
 	forward_htlc(gr->hin, gr->hin->cltv_expiry, &gr->hin->payment_hash,
-		     gr->amt_to_forward, gr->outgoing_cltv_value, peer_id,
-		     gr->next_onion);
+		     gr->amt_to_forward, gr->outgoing_cltv_value,
+		     peer_by_id(gossip->ld, peer_id), gr->next_onion);
 	tal_free(gr);
 }
 
@@ -619,7 +618,24 @@ static bool peer_accepted_htlc(struct peer *peer,
 	}
 
 	if (rs->nextcase == ONION_FORWARD) {
-		struct gossip_resolve *gr = tal(peer->ld, struct gossip_resolve);
+		struct gossip_resolve *gr;
+		struct peer *next = peer_by_scid(peer->ld,
+						 &rs->hop_data.channel_id);
+
+		/* One of our own channels: no need to ask gossipd. */
+		if (next) {
+			log_debug(peer->log, "Forwarding to own channel %s",
+				  type_to_string(tmpctx, struct short_channel_id,
+						 &rs->hop_data.channel_id));
+			forward_htlc(hin, hin->cltv_expiry, &hin->payment_hash,
+				     rs->hop_data.amt_forward,
+				     rs->hop_data.outgoing_cltv, next,
+				     serialize_onionpacket(tmpctx, rs->next));
+			*failcode = 0;
+			goto out;
+		}
+
+		gr = tal(peer->ld, struct gossip_resolve);
 
 		gr->next_onion = serialize_onionpacket(gr, rs->next);
 		gr->next_channel = rs->hop_data.channel_id;
@@ -19,9 +19,15 @@ void db_begin_transaction_(struct db *db UNNEEDED, const char *location UNNEEDED
 /* Generated stub for db_commit_transaction */
 void db_commit_transaction(struct db *db UNNEEDED)
 { fprintf(stderr, "db_commit_transaction called!\n"); abort(); }
+/* Generated stub for db_flush */
+void db_flush(struct db *db UNNEEDED)
+{ fprintf(stderr, "db_flush called!\n"); abort(); }
 /* Generated stub for db_get_intvar */
 s64 db_get_intvar(struct db *db UNNEEDED, char *varname UNNEEDED, s64 defval UNNEEDED)
 { fprintf(stderr, "db_get_intvar called!\n"); abort(); }
+/* Generated stub for db_set_profile */
+void db_set_profile(struct db *db UNNEEDED, enum db_profile profile UNNEEDED)
+{ fprintf(stderr, "db_set_profile called!\n"); abort(); }
 /* Generated stub for debug_poll */
 int debug_poll(struct pollfd *fds UNNEEDED, nfds_t nfds UNNEEDED, int timeout UNNEEDED)
 { fprintf(stderr, "debug_poll called!\n"); abort(); }
@@ -58,9 +64,33 @@ struct log_book *new_log_book(const tal_t *ctx UNNEEDED,
 			      size_t max_mem UNNEEDED,
 			      enum log_level printlevel UNNEEDED)
 { fprintf(stderr, "new_log_book called!\n"); abort(); }
+/* Generated stub for new_reltimer_ */
+struct oneshot *new_reltimer_(struct timers *timers UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *) UNNEEDED, void *arg UNNEEDED)
+{ fprintf(stderr, "new_reltimer_ called!\n"); abort(); }
 /* Generated stub for new_topology */
 struct chain_topology *new_topology(struct lightningd *ld UNNEEDED, struct log *log UNNEEDED)
 { fprintf(stderr, "new_topology called!\n"); abort(); }
+/* Generated stub for peer_id_eq */
+bool peer_id_eq(const struct peer *peer UNNEEDED, const struct pubkey *id UNNEEDED)
+{ fprintf(stderr, "peer_id_eq called!\n"); abort(); }
+/* Generated stub for peer_id_hash */
+size_t peer_id_hash(const struct pubkey *id UNNEEDED)
+{ fprintf(stderr, "peer_id_hash called!\n"); abort(); }
+/* Generated stub for peer_id_keyof */
+const struct pubkey *peer_id_keyof(const struct peer *peer UNNEEDED)
+{ fprintf(stderr, "peer_id_keyof called!\n"); abort(); }
+/* Generated stub for peer_scid_eq */
+bool peer_scid_eq(const struct peer *peer UNNEEDED, const struct short_channel_id *scid UNNEEDED)
+{ fprintf(stderr, "peer_scid_eq called!\n"); abort(); }
+/* Generated stub for peer_scid_hash */
+size_t peer_scid_hash(const struct short_channel_id *scid UNNEEDED)
+{ fprintf(stderr, "peer_scid_hash called!\n"); abort(); }
+/* Generated stub for peer_scid_keyof */
+const struct short_channel_id *peer_scid_keyof(const struct peer *peer UNNEEDED)
+{ fprintf(stderr, "peer_scid_keyof called!\n"); abort(); }
 /* Generated stub for populate_peer */
 void populate_peer(struct lightningd *ld UNNEEDED, struct peer *peer UNNEEDED)
 { fprintf(stderr, "populate_peer called!\n"); abort(); }
@@ -100,6 +130,12 @@ u32 wallet_channels_first_blocknum(struct wallet *w UNNEEDED)
 bool wallet_channels_load_active(const tal_t *ctx UNNEEDED,
 				 struct wallet *w UNNEEDED, struct list_head *peers UNNEEDED)
 { fprintf(stderr, "wallet_channels_load_active called!\n"); abort(); }
+/* Generated stub for wallet_htlc_history_compact */
+size_t wallet_htlc_history_compact(struct wallet *wallet UNNEEDED, u64 before UNNEEDED)
+{ fprintf(stderr, "wallet_htlc_history_compact called!\n"); abort(); }
+/* Generated stub for wallet_htlcs_archive */
+size_t wallet_htlcs_archive(struct wallet *wallet UNNEEDED, u64 now UNNEEDED)
+{ fprintf(stderr, "wallet_htlcs_archive called!\n"); abort(); }
 /* Generated stub for wallet_htlcs_load_for_channel */
 bool wallet_htlcs_load_for_channel(struct wallet *wallet UNNEEDED,
 				   struct wallet_channel *chan UNNEEDED,
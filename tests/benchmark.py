@@ -48,9 +48,12 @@ def node_factory(request, bitcoind, executor):
     yield nf
     nf.killall()
 
-def test_single_hop(node_factory, executor):
-    l1 = node_factory.get_node()
-    l2 = node_factory.get_node()
+# The same payments with and without --db-group-commit, so the end-to-end
+# difference can be measured where bitcoind is available.
+@pytest.mark.parametrize("options", [[], ['--db-group-commit']])
+def test_single_hop(node_factory, executor, options):
+    l1 = node_factory.get_node(options=options)
+    l2 = node_factory.get_node(options=options)
 
     l1.rpc.connect(l2.rpc.getinfo()['id'], 'localhost:%d' % l2.rpc.getinfo()['port'])
     l1.openchannel(l2, 4000000)
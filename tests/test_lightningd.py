@@ -737,7 +737,10 @@ class LightningDTests(BaseLightningDTests):
         self.wait_for_routes(l1, [chanid])
 
         inv = l2.rpc.invoice(123000, 'test_pay', 'description')['bolt11']
-        l1.rpc.pay(inv)
+        attempts = l1.rpc.pay(inv)['attempts']
+        assert len(attempts) == 1
+        assert attempts[0]['hops'] == 1
+        assert 'failure' not in attempts[0]
         assert l2.rpc.listinvoice('test_pay')[0]['complete'] == True
 
         # Check pay_index is not null
@@ -750,6 +753,75 @@ class LightningDTests(BaseLightningDTests):
             inv = l2.rpc.invoice("any", label, 'description')['bolt11']
             l1.rpc.pay(inv, random.randint(1000, 999999))
 
+        # HTLC updates reuse their compiled statements.
+        stats = l2.rpc.getdbstats()['statement_cache']
+        assert stats['hits'] > stats['misses']
+
+    def test_htlc_archive(self):
+        l1 = self.node_factory.get_node()
+        l2 = self.node_factory.get_node(options=['--htlc-archive-time=1s'])
+        l1.rpc.connect(l2.info['id'], 'localhost', l2.info['port'])
+        self.fund_channel(l1, l2, 10**6)
+
+        for i in range(5):
+            self.pay(l1, l2, 10000)
+
+        # All but the newest HTLC move into history, onion and all.
+        wait_for(lambda: l2.db_query('SELECT COUNT(*) AS c FROM channel_htlc_history;')[0]['c'] == 4)
+        assert l2.db_query('SELECT COUNT(*) AS c FROM channel_htlcs;')[0]['c'] == 1
+
+        # And they stay gone over a restart.
+        l2.stop()
+        l2.daemon.start()
+        assert l2.db_query('SELECT COUNT(*) AS c FROM channel_htlcs;')[0]['c'] == 1
+        wait_for(lambda: l2.rpc.getpeers()['peers'][0]['connected'], interval=1)
+
+        self.pay(l1, l2, 10000)
+        wait_for(lambda: l2.db_query('SELECT COUNT(*) AS c FROM channel_htlc_history;')[0]['c'] == 5)
+
+    def test_htlc_archive_forward(self):
+        # l2 forwards l1 -> l3 and archives as it goes.
+        l1 = self.node_factory.get_node()
+        l2 = self.node_factory.get_node(options=['--htlc-archive-time=1s'])
+        l3 = self.node_factory.get_node()
+        l1.rpc.connect(l2.info['id'], 'localhost', l2.info['port'])
+        l2.rpc.connect(l3.info['id'], 'localhost', l3.info['port'])
+        self.fund_channel(l1, l2, 10**6)
+        self.fund_channel(l2, l3, 10**6)
+        l1.bitcoin.generate_block(5)
+        sync_blockheight([l1, l2, l3])
+
+        chanid1 = l1.rpc.getpeer(l2.info['id'])['channel']
+        chanid2 = l2.rpc.getpeer(l3.info['id'])['channel']
+        amt = 100000
+        fee = amt * 10 // 1000000 + 1
+        route = [ { 'msatoshi' : amt + fee,
+                    'id' : l2.info['id'],
+                    'delay' : 12,
+                    'channel' : chanid1 },
+                  { 'msatoshi' : amt,
+                    'id' : l3.info['id'],
+                    'delay' : 6,
+                    'channel' : chanid2 } ]
+
+        for i in range(3):
+            rhash = l3.rpc.invoice(amt, 'fwd{}'.format(i), 'desc')['rhash']
+            l1.rpc.sendpay(to_json(route), rhash)
+
+        # An incoming HTLC only goes once its outgoing HTLC has.
+        wait_for(lambda: l2.db_query('SELECT COUNT(*) AS c FROM channel_htlc_history;')[0]['c'] >= 4)
+        assert l2.db_query('SELECT COUNT(*) AS c FROM channel_htlcs h'
+                           ' WHERE h.origin_htlc IS NOT NULL'
+                           ' AND h.origin_htlc NOT IN (SELECT id FROM channel_htlcs);')[0]['c'] == 0
+
+        # Every htlc_out we reload still finds its htlc_in.
+        l2.stop()
+        l2.daemon.start()
+        wait_for(lambda: l2.rpc.getpeer(l1.info['id'])['connected'], interval=1)
+        wait_for(lambda: l2.rpc.getpeer(l3.info['id'])['connected'], interval=1)
+        assert not l2.daemon.is_in_log('Unable to find corresponding htlc_in')
+        assert not l2.daemon.is_in_log('BROKEN')
+
     def test_bad_opening(self):
         # l1 asks for a too-long locktime
         l1 = self.node_factory.get_node(options=['--locktime-blocks=100'])
@@ -1400,6 +1472,21 @@ class LightningDTests(BaseLightningDTests):
         assert [c['active'] for c in l2.rpc.getchannels()['channels']] == [True, True]
         assert [c['public'] for c in l2.rpc.getchannels()['channels']] == [True, True]
 
+        # Asking for the same route again is answered from the cache.
+        hits = l1.rpc.getgossipstats()['route_cache']['hits']
+        l1.rpc.getroute(l2.info['id'], 100, 1)
+        l1.rpc.getroute(l2.info['id'], 100, 1)
+        stats = l1.rpc.getgossipstats()
+        assert stats['route_cache']['hits'] == hits + 1
+
+        # Nothing we received was bad.
+        dropped = stats['dropped']
+        assert dropped['bad_signature'] == 0
+        assert dropped['bad_txout'] == 0
+
+        # Nothing has failed, so route finding avoids nothing.
+        assert l1.rpc.listroutingfailures()['failures'] == []
+
     def ping_tests(self, l1, l2):
         # 0-byte pong gives just type + length field.
         ret = l1.rpc.dev_ping(l2.info['id'], 0, 0)
@@ -1506,6 +1593,128 @@ class LightningDTests(BaseLightningDTests):
                 seen.append((c['source'],c['destination']))
             assert set(seen) == set(comb)
 
+        # Paging through them two at a time gives the same list.
+        channels = l1.rpc.getchannels()['channels']
+        paged = []
+        cursor = None
+        while True:
+            page = l1.rpc.getchannels(None, None, None, None, None, 2, cursor)
+            assert len(page['channels']) <= 2
+            paged += page['channels']
+            if 'cursor' not in page:
+                break
+            cursor = page['cursor']
+        assert paged == channels
+
+        # Filter by source node.
+        src = l1.rpc.getchannels(l1.info['id'])['channels']
+        assert [(c['source'], c['destination']) for c in src] == [(l1.info['id'], nodes[1].info['id'])]
+
+        # Following the change feed from the start sees every channel.
+        seen = set()
+        since = 0
+        while True:
+            changes = l1.rpc.getgossipchanges(since, 2)
+            seen |= set(c['short_channel_id'] for c in changes['channels'])
+            since = changes['next']
+            if not changes['more']:
+                break
+        assert seen == set(c['short_channel_id'] for c in channels)
+
+    def test_gossip_changes_closed(self):
+        l1, l2 = self.line_graph(n=2)
+
+        # Announce the channel.
+        l1.bitcoin.generate_block(5)
+        wait_for(lambda: [c['public'] for c in l1.rpc.getchannels()['channels']] == [True, True])
+        scid = l1.rpc.getchannels()['channels'][0]['short_channel_id']
+        l1.daemon.wait_for_log('Received node_announcement for node {}'.format(l2.info['id']))
+
+        since = 0
+        while True:
+            changes = l1.rpc.getgossipchanges(since)
+            since = changes['next']
+            if not changes['more']:
+                break
+
+        # Once the close is mined, the channel is reported gone, and so
+        # are the nodes, which have no other channels.
+        l1.rpc.close(l2.info['id'])
+        l1.daemon.wait_for_log('sendrawtx exit 0')
+        l1.bitcoin.generate_block(1)
+        l1.daemon.wait_for_log('Channel {} closed'.format(scid))
+
+        changes = l1.rpc.getgossipchanges(since)
+        assert {'short_channel_id': scid, 'removed': True} in changes['channels']
+        assert {'nodeid': l2.info['id'], 'removed': True} in changes['nodes']
+        assert l1.rpc.getchannels()['channels'] == []
+
+    def test_gossip_store_spent(self):
+        l1, l2, l3 = self.line_graph(n=3)
+
+        l1.bitcoin.generate_block(5)
+        wait_for(lambda: len(l1.rpc.getchannels()['channels']) == 4)
+        scid = l2.rpc.getpeer(l3.info['id'])['channel']
+
+        # l2 and l3 close their channel while l1 is down...
+        l1.stop()
+        l2.rpc.close(l3.info['id'])
+        l2.daemon.wait_for_log('sendrawtx exit 0')
+        l2.bitcoin.generate_block(1)
+        l2.daemon.wait_for_log('Channel {} closed'.format(scid))
+
+        # ... so l1's stored copy is stale, and goes once it checks.
+        l1.daemon.start()
+        l1.daemon.wait_for_log('Stored channel {} is spent'.format(scid))
+        scids = [c['short_channel_id'] for c in l1.rpc.getchannels()['channels']]
+        assert scid not in scids
+        assert l1.rpc.getpeer(l2.info['id'])['channel'] in scids
+
+    def test_getroutes(self):
+        # Two ways from l1 to l4: via l2, and via l3.
+        l1, l2, l4 = self.line_graph(n=3)
+        l3 = self.node_factory.get_node()
+        for a, b in [(l1, l3), (l3, l4)]:
+            a.rpc.connect(b.info['id'], 'localhost', b.info['port'])
+            self.fund_channel(a, b, 10**6)
+
+        # Announce all four channels.
+        l1.bitcoin.generate_block(5)
+        wait_for(lambda: len([c for c in l1.rpc.getchannels()['channels'] if c['active']]) == 8)
+
+        routes = l1.rpc.getroutes(l4.info['id'], 1000, 1, 9, 3)['routes']
+        assert len(routes) == 2
+
+        # Each is a route as getroute returns it, ending at l4.
+        mids = set()
+        for r in routes:
+            route = r['route']
+            assert len(route) == 2
+            for hop in route:
+                assert set(hop.keys()) == set(['id', 'channel', 'msatoshi', 'delay'])
+            assert route[-1]['id'] == l4.info['id']
+            assert route[-1]['msatoshi'] == 1000
+            mids.add(route[0]['id'])
+        assert mids == set([l2.info['id'], l3.info['id']])
+
+        # The cheapest comes first.
+        assert routes[0]['route'][0]['msatoshi'] <= routes[1]['route'][0]['msatoshi']
+
+        # No channel is used in the same direction twice.  A hop's direction
+        # is 0 if it leaves the lesser node id.
+        used = set()
+        for r in routes:
+            prev = l1.info['id']
+            for hop in r['route']:
+                pair = (hop['channel'], 0 if prev < hop['id'] else 1)
+                assert pair not in used
+                used.add(pair)
+                prev = hop['id']
+
+        # Asking for just one gives the cheapest.
+        one = l1.rpc.getroutes(l4.info['id'], 1000, 1, 9, 1)['routes']
+        assert one == routes[:1]
+
     def test_forward(self):
         # Connect 1 -> 2 -> 3.
         l1,l2 = self.connect()
@@ -1564,6 +1773,12 @@ class LightningDTests(BaseLightningDTests):
         route = copy.deepcopy(baseroute)
         l1.rpc.sendpay(to_json(route), rhash)
 
+        # chanid2 is l2's own: it forwards without asking gossipd.
+        l2.daemon.wait_for_log('Forwarding to own channel {}'.format(chanid2))
+        assert not l2.daemon.is_in_log('Asking gossip to resolve channel')
+        assert not l2.daemon.is_in_log('GOSSIP_RESOLVE_CHANNEL_REPLY')
+        assert not l2.daemon.is_in_log('Resolved channel')
+
     @unittest.skipIf(not DEVELOPER, "needs DEVELOPER=1 for --dev-broadcast-interval")
     def test_forward_different_fees_and_cltv(self):
         # FIXME: Check BOLT quotes here too
@@ -1,13 +1,29 @@
 #include "db.h"
 
+#include <ccan/array_size/array_size.h>
+#include <ccan/crypto/siphash24/siphash24.h>
 #include <ccan/tal/str/str.h>
 #include <ccan/tal/tal.h>
+#include <common/pseudorand.h>
 #include <inttypes.h>
 #include <lightningd/lightningd.h>
 #include <lightningd/log.h>
+#include <pthread.h>
+#include <time.h>
 
 #define DB_FILE "lightningd.sqlite3"
 
+/* Queries are (almost all) literals, so this is plenty: it only stops
+ * generated queries growing the statement cache forever. */
+#define DB_STMT_CACHE_MAX 256
+
+/* How often the background checkpointer copies the WAL into the database. */
+#define DB_CHECKPOINT_INTERVAL_SECS 1
+
+/* If it falls this far behind (in pages: 64MB, at 4k each), commits
+ * checkpoint too, so the WAL can't grow forever. */
+#define DB_WAL_AUTOCHECKPOINT_PAGES 16384
+
 /* Do not reorder or remove elements from this array, it is used to
  * migrate existing databases from a previous state, based on the
  * string indices */
@@ -153,24 +169,115 @@ char *dbmigrations[] = {
     "ALTER TABLE outputs ADD COLUMN channel_id INTEGER;",
     "ALTER TABLE outputs ADD COLUMN peer_id BLOB;",
     "ALTER TABLE outputs ADD COLUMN commitment_point BLOB;",
+    /* Loading a channel's HTLCs can check direction and hstate in the
+     * index, rather than reading every HTLC (and its onion) it ever had. */
+    "CREATE INDEX channel_htlcs_channel_direction_hstate"
+    "  ON channel_htlcs(channel_id, direction, hstate);",
+    "CREATE INDEX outputs_status ON outputs(status);",
+    /* Resolved HTLCs move here, without their onion or shared secret:
+     * wallet_htlc_stubs still needs them in case of a cheat. */
+    "CREATE TABLE channel_htlc_history ("
+    "  id INTEGER,"
+    "  channel_id INTEGER REFERENCES channels(id) ON DELETE CASCADE,"
+    "  channel_htlc_id INTEGER,"
+    "  direction INTEGER,"
+    "  origin_htlc INTEGER,"
+    "  msatoshi INTEGER,"
+    "  cltv_expiry INTEGER,"
+    "  payment_hash BLOB,"
+    "  payment_key BLOB,"
+    "  hstate INTEGER,"
+    "  resolved_time INTEGER,"
+    "  PRIMARY KEY (id)"
+    ");",
+    "CREATE INDEX channel_htlc_history_channel"
+    "  ON channel_htlc_history(channel_id, resolved_time);",
+    "CREATE INDEX channel_htlcs_origin_htlc ON channel_htlcs(origin_htlc);",
     NULL,
 };
 
+const char *db_stmt_keyof(const struct db_stmt *s)
+{
+	return s->query;
+}
+
+size_t db_stmt_hash(const char *query)
+{
+	return siphash24(siphash_seed(), query, strlen(query));
+}
+
+bool db_stmt_eq(const struct db_stmt *s, const char *query)
+{
+	return streq(s->query, query);
+}
+
 sqlite3_stmt *db_prepare_(const char *caller, struct db *db, const char *query)
 {
 	int err;
 	sqlite3_stmt *stmt;
+	struct db_stmt *s;
+	size_t n;
 
 	assert(db->in_transaction);
 
+	s = db_stmt_map_get(&db->stmts, query);
+	if (s && !s->in_use) {
+		db->stmt_cache_hits++;
+		stmt = s->stmt;
+		goto in_use;
+	}
+	db->stmt_cache_misses++;
+
 	err = sqlite3_prepare_v2(db->sql, query, -1, &stmt, NULL);
 
 	if (err != SQLITE_OK)
 		fatal("%s: %s: %s", caller, query, sqlite3_errmsg(db->sql));
 
+	/* If it's already in use (a nested query), this one isn't cached. */
+	if (s || db->num_stmts == DB_STMT_CACHE_MAX)
+		return stmt;
+
+	s = tal(db, struct db_stmt);
+	s->query = tal_strdup(s, query);
+	s->stmt = stmt;
+	s->uses = 0;
+	s->elapsed = time_from_sec(0);
+	db_stmt_map_add(&db->stmts, s);
+	db->num_stmts++;
+
+in_use:
+	s->in_use = true;
+	s->started = time_mono();
+	n = tal_count(db->stmts_in_use);
+	tal_resize(&db->stmts_in_use, n + 1);
+	db->stmts_in_use[n] = s;
 	return stmt;
 }
 
+void db_stmt_done(struct db *db, sqlite3_stmt *stmt)
+{
+	size_t i, n = tal_count(db->stmts_in_use);
+
+	/* Rarely more than one or two are in use at once. */
+	for (i = 0; i < n; i++) {
+		struct db_stmt *s = db->stmts_in_use[i];
+		if (s->stmt != stmt)
+			continue;
+
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		s->in_use = false;
+		s->uses++;
+		s->elapsed = timerel_add(s->elapsed,
+					 timemono_between(time_mono(),
+							  s->started));
+		db->stmts_in_use[i] = db->stmts_in_use[n - 1];
+		tal_resize(&db->stmts_in_use, n - 1);
+		return;
+	}
+	sqlite3_finalize(stmt);
+}
+
 void db_exec_prepared_(const char *caller, struct db *db, sqlite3_stmt *stmt)
 {
 	assert(db->in_transaction);
@@ -178,7 +285,7 @@ void db_exec_prepared_(const char *caller, struct db *db, sqlite3_stmt *stmt)
 	if (sqlite3_step(stmt) !=  SQLITE_DONE)
 		fatal("%s: %s", caller, sqlite3_errmsg(db->sql));
 
-	sqlite3_finalize(stmt);
+	db_stmt_done(db, stmt);
 }
 
 /* This one doesn't check if we're in a transaction. */
@@ -219,10 +326,10 @@ bool db_exec_prepared_mayfail_(const char *caller, struct db *db, sqlite3_stmt *
 		goto fail;
 	}
 
-	sqlite3_finalize(stmt);
+	db_stmt_done(db, stmt);
 	return true;
 fail:
-	sqlite3_finalize(stmt);
+	db_stmt_done(db, stmt);
 	return false;
 }
 
@@ -245,22 +352,267 @@ sqlite3_stmt *PRINTF_FMT(3, 4)
 	return stmt;
 }
 
-static void close_db(struct db *db) { sqlite3_close(db->sql); }
+/* Copies the WAL back into the database on its own connection, so the
+ * main thread never stalls for a big checkpoint on commit.  It uses
+ * PASSIVE checkpoints, which never wait for (or block) the main thread:
+ * whatever they can't copy yet waits for next time. */
+struct db_checkpointer {
+	pthread_t thread;
+	sqlite3 *sql;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	/* These are protected by lock. */
+	bool stop;
+	u64 runs, frames, failures;
+};
+
+static void *checkpoint_loop(void *arg)
+{
+	struct db_checkpointer *c = arg;
+	struct timespec deadline;
+	int err, log_frames, copied;
+
+	pthread_mutex_lock(&c->lock);
+	while (!c->stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += DB_CHECKPOINT_INTERVAL_SECS;
+		pthread_cond_timedwait(&c->wake, &c->lock, &deadline);
+		if (c->stop)
+			break;
+
+		pthread_mutex_unlock(&c->lock);
+		err = sqlite3_wal_checkpoint_v2(c->sql, NULL,
+						SQLITE_CHECKPOINT_PASSIVE,
+						&log_frames, &copied);
+		pthread_mutex_lock(&c->lock);
+
+		if (err == SQLITE_OK) {
+			c->runs++;
+			c->frames += copied;
+		} else
+			c->failures++;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+static void stop_checkpointer(struct db *db)
+{
+	struct db_checkpointer *c = db->checkpointer;
+
+	if (!c)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	c->stop = true;
+	pthread_cond_signal(&c->wake);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+
+	sqlite3_close(c->sql);
+	pthread_cond_destroy(&c->wake);
+	pthread_mutex_destroy(&c->lock);
+	db->checkpointer = tal_free(c);
+}
+
+/* Returns false if we can't: then sqlite checkpoints on commit, as usual. */
+static bool start_checkpointer(struct db *db)
+{
+	struct db_checkpointer *c;
+	sqlite3 *sql;
+
+	if (!sqlite3_threadsafe())
+		return false;
+
+	if (sqlite3_open_v2(db->filename, &sql, SQLITE_OPEN_READWRITE, NULL)
+	    != SQLITE_OK) {
+		sqlite3_close(sql);
+		return false;
+	}
+
+	c = tal(db, struct db_checkpointer);
+	c->sql = sql;
+	c->stop = false;
+	c->runs = c->frames = c->failures = 0;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->wake, NULL);
+	if (pthread_create(&c->thread, NULL, checkpoint_loop, c) != 0) {
+		sqlite3_close(sql);
+		pthread_cond_destroy(&c->wake);
+		pthread_mutex_destroy(&c->lock);
+		tal_free(c);
+		return false;
+	}
+	db->checkpointer = c;
+	return true;
+}
+
+bool db_checkpoint_stats(struct db *db, u64 *runs, u64 *frames,
+			 u64 *failures)
+{
+	struct db_checkpointer *c = db->checkpointer;
+
+	if (!c)
+		return false;
+
+	pthread_mutex_lock(&c->lock);
+	*runs = c->runs;
+	*frames = c->frames;
+	*failures = c->failures;
+	pthread_mutex_unlock(&c->lock);
+	return true;
+}
+
+const char **db_query_plan(const tal_t *ctx, struct db *db, const char *query)
+{
+	sqlite3_stmt *stmt;
+	char *explain = tal_fmt(ctx, "EXPLAIN QUERY PLAN %s", query);
+	const char **plan = tal_arr(ctx, const char *, 0);
+	size_t n = 0;
+
+	if (sqlite3_prepare_v2(db->sql, explain, -1, &stmt, NULL) != SQLITE_OK) {
+		tal_free(explain);
+		return tal_free(plan);
+	}
+	tal_free(explain);
+
+	/* Columns are id, parent, notused, detail. */
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		tal_resize(&plan, n + 1);
+		plan[n++] = tal_strdup(plan,
+				       (const char *)sqlite3_column_text(stmt, 3));
+	}
+	sqlite3_finalize(stmt);
+	return plan;
+}
+
+static void close_db(struct db *db)
+{
+	struct db_stmt_map_iter it;
+	struct db_stmt *s;
+
+	stop_checkpointer(db);
+
+	/* sqlite3_close fails while any statement is unfinalized. */
+	for (s = db_stmt_map_first(&db->stmts, &it);
+	     s;
+	     s = db_stmt_map_next(&db->stmts, &it))
+		sqlite3_finalize(s->stmt);
+	db_stmt_map_clear(&db->stmts);
+	sqlite3_close(db->sql);
+}
 
 void db_begin_transaction_(struct db *db, const char *location)
 {
 	if (db->in_transaction)
 		fatal("Already in transaction from %s", db->in_transaction);
 
-	db_do_exec(location, db, "BEGIN TRANSACTION;");
+	/* Group commit may have left one open for us to join. */
+	if (!db->pending_commit)
+		db_do_exec(location, db, "BEGIN TRANSACTION;");
+	db->pending_commit = false;
 	db->in_transaction = location;
 }
 
 void db_commit_transaction(struct db *db)
 {
 	assert(db->in_transaction);
-	db_exec(__func__, db, "COMMIT;");
 	db->in_transaction = NULL;
+	if (db->group_commit)
+		db->pending_commit = true;
+	else
+		db_do_exec(__func__, db, "COMMIT;");
+}
+
+void db_flush(struct db *db)
+{
+	assert(!db->in_transaction);
+	if (!db->pending_commit)
+		return;
+	db_do_exec(__func__, db, "COMMIT;");
+	db->pending_commit = false;
+}
+
+static const char *db_profile_names[] = {
+	[DB_PROFILE_ROLLBACK] = "rollback",
+	[DB_PROFILE_WAL] = "wal",
+};
+
+const char *db_profile_name(enum db_profile profile)
+{
+	return db_profile_names[profile];
+}
+
+bool db_profile_by_name(const char *name, enum db_profile *profile)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(db_profile_names); i++) {
+		if (streq(name, db_profile_names[i])) {
+			*profile = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Only synchronous=FULL makes each commit durable even in WAL mode: we
+ * must never forget a commitment we've acknowledged, so no profile
+ * relaxes it. */
+void db_set_profile(struct db *db, enum db_profile profile)
+{
+	sqlite3_stmt *stmt;
+	const char *mode;
+	bool wal;
+
+	assert(!db->in_transaction);
+	db_flush(db);
+	stop_checkpointer(db);
+
+	switch (profile) {
+	case DB_PROFILE_ROLLBACK:
+		db_do_exec(__func__, db, "PRAGMA journal_mode = DELETE;");
+		db_do_exec(__func__, db, "PRAGMA synchronous = FULL;");
+		db_do_exec(__func__, db, "PRAGMA mmap_size = 0;");
+		db_do_exec(__func__, db, "PRAGMA cache_size = -2000;");
+		return;
+	case DB_PROFILE_WAL:
+		/* We can't switch inside a transaction, but we can check
+		 * what mode we ended up in. */
+		db_do_exec(__func__, db, "PRAGMA journal_mode = WAL;");
+		db_begin_transaction(db);
+		stmt = db_prepare(db, "PRAGMA journal_mode;");
+		wal = sqlite3_step(stmt) == SQLITE_ROW
+			&& (mode = (const char *)sqlite3_column_text(stmt, 0))
+			&& streq(mode, "wal");
+		db_stmt_done(db, stmt);
+		db_commit_transaction(db);
+		db_flush(db);
+		if (!wal)
+			fatal("%s: could not switch %s to WAL mode",
+			      __func__, db->filename);
+
+		db_do_exec(__func__, db, "PRAGMA synchronous = FULL;");
+		/* Map up to 256MB of the database, and cache 16MB of pages. */
+		db_do_exec(__func__, db, "PRAGMA mmap_size = 268435456;");
+		db_do_exec(__func__, db, "PRAGMA cache_size = -16384;");
+		/* Once checkpointed, cut the WAL back to 64MB. */
+		db_do_exec(__func__, db,
+			   "PRAGMA journal_size_limit = 67108864;");
+		/* Checkpoint in the background, rather than on commit;
+		 * unless it can't keep up. */
+		if (start_checkpointer(db))
+			db_do_exec(__func__, db,
+				   "PRAGMA wal_autocheckpoint = "
+				   stringify(DB_WAL_AUTOCHECKPOINT_PAGES) ";");
+		else
+			db_do_exec(__func__, db,
+				   "PRAGMA wal_autocheckpoint = 1000;");
+		return;
+	}
+	fatal("%s: unknown profile %u", __func__, profile);
 }
 
 /**
@@ -285,10 +637,16 @@ static struct db *db_open(const tal_t *ctx, char *filename)
 	}
 
 	db = tal(ctx, struct db);
-	db->filename = tal_dup_arr(db, char, filename, strlen(filename), 0);
+	db->filename = tal_strdup(db, filename);
 	db->sql = sql;
+	db_stmt_map_init(&db->stmts);
+	db->num_stmts = 0;
+	db->stmts_in_use = tal_arr(db, struct db_stmt *, 0);
+	db->stmt_cache_hits = db->stmt_cache_misses = 0;
 	tal_add_destructor(db, close_db);
 	db->in_transaction = NULL;
+	db->group_commit = db->pending_commit = false;
+	db->checkpointer = NULL;
 	db_do_exec(__func__, db, "PRAGMA foreign_keys = ON;");
 
 	return db;
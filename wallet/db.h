@@ -6,19 +6,66 @@
 #include <bitcoin/preimage.h>
 #include <bitcoin/short_channel_id.h>
 #include <bitcoin/tx.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/short_types/short_types.h>
 #include <ccan/tal/tal.h>
+#include <ccan/time/time.h>
 
 #include <secp256k1_ecdh.h>
 #include <sqlite3.h>
 #include <stdbool.h>
 
+struct db_checkpointer;
 struct log;
 
+/* How we trade durability against write latency; every profile keeps each
+ * commit durable, they differ in how much work a commit is. */
+enum db_profile {
+	/* sqlite's defaults: rollback journal, fsync on every commit. */
+	DB_PROFILE_ROLLBACK,
+	/* Write-ahead log, still fsync on every commit, bigger caches, and
+	 * checkpoints in a background thread. */
+	DB_PROFILE_WAL,
+};
+
+/* A statement db_prepare compiled, kept to be reset and reused by the
+ * next db_prepare of the same query. */
+struct db_stmt {
+	const char *query;
+	sqlite3_stmt *stmt;
+	/* Handed out by db_prepare, and not yet back via db_stmt_done. */
+	bool in_use;
+
+	/* How often it was handed out, and for how long in total. */
+	u64 uses;
+	struct timemono started;
+	struct timerel elapsed;
+};
+
+const char *db_stmt_keyof(const struct db_stmt *s);
+size_t db_stmt_hash(const char *query);
+bool db_stmt_eq(const struct db_stmt *s, const char *query);
+HTABLE_DEFINE_TYPE(struct db_stmt, db_stmt_keyof, db_stmt_hash, db_stmt_eq,
+		   db_stmt_map);
+
 struct db {
 	char *filename;
 	const char *in_transaction;
 	sqlite3 *sql;
+
+	/* Group commit: db_commit_transaction leaves the transaction open
+	 * (pending_commit) for the next db_flush to commit. */
+	bool group_commit;
+	bool pending_commit;
+
+	/* Background WAL checkpoints, if DB_PROFILE_WAL */
+	struct db_checkpointer *checkpointer;
+
+	/* Statement cache, by query text, and those of it handed out. */
+	struct db_stmt_map stmts;
+	size_t num_stmts;
+	struct db_stmt **stmts_in_use;
+	u64 stmt_cache_hits, stmt_cache_misses;
 };
 
 /**
@@ -34,6 +81,39 @@ struct db {
  */
 struct db *db_setup(const tal_t *ctx, struct log *log);
 
+/**
+ * db_set_profile - Configure the database for a durability profile
+ *
+ * Sets the journal mode and sqlite's tuning for @profile, and starts or
+ * stops the background checkpointer to match.  Must not be in a
+ * transaction.  Calls fatal() on error.
+ */
+void db_set_profile(struct db *db, enum db_profile profile);
+
+/**
+ * db_profile_name / db_profile_by_name - Convert a db_profile to/from text
+ *
+ * db_profile_by_name returns false if @name isn't a profile.
+ */
+const char *db_profile_name(enum db_profile profile);
+bool db_profile_by_name(const char *name, enum db_profile *profile);
+
+/**
+ * db_query_plan - What sqlite's EXPLAIN QUERY PLAN says about @query
+ *
+ * Returns one string per step of the plan, or NULL if @query doesn't
+ * compile.
+ */
+const char **db_query_plan(const tal_t *ctx, struct db *db, const char *query);
+
+/**
+ * db_checkpoint_stats - How the background checkpointer is doing
+ *
+ * Returns false if there isn't one (not DB_PROFILE_WAL).
+ */
+bool db_checkpoint_stats(struct db *db, u64 *runs, u64 *frames,
+			 u64 *failures);
+
 /**
  * db_query - Prepare and execute a query, and return the result (or NULL)
  */
@@ -53,10 +133,21 @@ void db_begin_transaction_(struct db *db, const char *location);
  * db_commit_transaction - Commit a running transaction
  *
  * Requires that we are currently in a transaction.  fatal() if we
- * fail to commit.
+ * fail to commit.  With group commit, the actual commit waits for
+ * db_flush().
  */
 void db_commit_transaction(struct db *db);
 
+/**
+ * db_flush - Commit what group commit left open
+ *
+ * With @db->group_commit set, db_commit_transaction only ends the
+ * transaction as far as the caller is concerned: call this before
+ * anything which depends on it being durable leaves the process.
+ * Requires that we are not currently in a transaction.
+ */
+void db_flush(struct db *db);
+
 /**
  * db_set_intvar - Set an integer variable in the database
  *
@@ -82,12 +173,28 @@ s64 db_get_intvar(struct db *db, char *varname, s64 defval);
  * statement, `NULL` otherwise. On failure `db->err` will be set with
  * the human readable error.
  *
+ * Statements are cached by query text, so the same query is usually
+ * only compiled once: the caller must hand `stmt` back through
+ * `db_exec_prepared` or `db_stmt_done`, never `sqlite3_finalize`.
+ *
  * @db: Database to query/exec
  * @query: The SQL statement to compile
  */
 #define db_prepare(db,query) db_prepare_(__func__,db,query)
 sqlite3_stmt *db_prepare_(const char *caller, struct db *db, const char *query);
 
+/**
+ * db_stmt_done -- Finish with a statement from `db_prepare` or `db_query`
+ *
+ * Statements `db_prepare` got from its cache are reset and cleared for
+ * reuse, others are finalized: either way, don't touch @stmt again.
+ * Use instead of `sqlite3_finalize` once done stepping through results.
+ *
+ * @db: The database it was prepared on
+ * @stmt: The statement (may be NULL)
+ */
+void db_stmt_done(struct db *db, sqlite3_stmt *stmt);
+
 /**
  * db_exec_prepared -- Execute a prepared statement
  *
@@ -95,8 +202,8 @@ sqlite3_stmt *db_prepare_(const char *caller, struct db *db, const char *query);
  * all non-null variables using the `sqlite3_bind_*` functions, it can
  * be executed with this function. It is a small, transaction-aware,
  * wrapper around `sqlite3_step`, that calls fatal() if the execution
- * fails. This will take ownership of `stmt` and will free
- * it before returning.
+ * fails. This will take ownership of `stmt` and will hand it to
+ * `db_stmt_done` before returning.
  *
  * @db: The database to execute on
  * @stmt: The prepared statement to execute
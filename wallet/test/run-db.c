@@ -110,6 +110,139 @@ static bool test_vars(void)
 	return true;
 }
 
+static bool test_stmt_cache(void)
+{
+	struct db *db = create_test_db(__func__);
+	const char *query = "SELECT val FROM vars WHERE name=?;";
+	sqlite3_stmt *stmt, *nested;
+	CHECK(db);
+	db_migrate(db, NULL);
+
+	db_begin_transaction(db);
+	db_set_intvar(db, "testvar", 7);
+
+	stmt = db_prepare(db, query);
+	CHECK(db->stmt_cache_misses == 1 && db->num_stmts == 1);
+	sqlite3_bind_text(stmt, 1, "testvar", -1, SQLITE_TRANSIENT);
+
+	/* The cached statement is busy, so this gets a fresh one. */
+	nested = db_prepare(db, query);
+	CHECK(nested != stmt);
+	CHECK(db->stmt_cache_misses == 2 && db->num_stmts == 1);
+	db_stmt_done(db, nested);
+
+	CHECK(sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(sqlite3_column_int64(stmt, 0) == 7);
+	db_stmt_done(db, stmt);
+
+	/* Now it's reused, without the old bindings. */
+	CHECK(db_prepare(db, query) == stmt);
+	CHECK(db->stmt_cache_hits == 1);
+	CHECK(sqlite3_step(stmt) == SQLITE_DONE);
+	db_stmt_done(db, stmt);
+	CHECK(tal_count(db->stmts_in_use) == 0);
+	db_commit_transaction(db);
+
+	tal_free(db);
+	return true;
+}
+
+static bool test_group_commit(void)
+{
+	struct db *db = create_test_db(__func__);
+	CHECK(db);
+	db_migrate(db, NULL);
+	db->group_commit = true;
+
+	db_begin_transaction(db);
+	db_set_intvar(db, "testvar", 1);
+	db_commit_transaction(db);
+	CHECK(!db->in_transaction);
+	/* Still open, and the next one joins it. */
+	CHECK(!sqlite3_get_autocommit(db->sql));
+	db_begin_transaction(db);
+	db_set_intvar(db, "testvar", 2);
+	db_commit_transaction(db);
+	CHECK(!sqlite3_get_autocommit(db->sql));
+
+	db_flush(db);
+	CHECK(sqlite3_get_autocommit(db->sql));
+	CHECK(!db->pending_commit);
+	/* Nothing to do. */
+	db_flush(db);
+
+	db_begin_transaction(db);
+	CHECK(db_get_intvar(db, "testvar", 0) == 2);
+	db_commit_transaction(db);
+	db_flush(db);
+
+	tal_free(db);
+	return true;
+}
+
+static bool test_wal_profile(void)
+{
+	struct db *db = create_test_db(__func__);
+	sqlite3_stmt *stmt;
+	enum db_profile profile;
+	u64 runs, frames, failures;
+	CHECK(db);
+	db_migrate(db, NULL);
+
+	CHECK(db_profile_by_name("wal", &profile) && profile == DB_PROFILE_WAL);
+	CHECK(!db_profile_by_name("fast", &profile));
+	db_set_profile(db, DB_PROFILE_WAL);
+	CHECK(db_checkpoint_stats(db, &runs, &frames, &failures));
+
+	db_begin_transaction(db);
+	stmt = db_query(__func__, db, "PRAGMA journal_mode;");
+	CHECK(sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(streq((const char *)sqlite3_column_text(stmt, 0), "wal"));
+	db_stmt_done(db, stmt);
+	/* Commits still checkpoint if the background thread falls behind. */
+	stmt = db_query(__func__, db, "PRAGMA wal_autocheckpoint;");
+	CHECK(sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(sqlite3_column_int(stmt, 0) == DB_WAL_AUTOCHECKPOINT_PAGES);
+	db_stmt_done(db, stmt);
+	db_set_intvar(db, "testvar", 3);
+	db_commit_transaction(db);
+
+	/* Back again, which stops the checkpointer. */
+	db_set_profile(db, DB_PROFILE_ROLLBACK);
+	CHECK(!db_checkpoint_stats(db, &runs, &frames, &failures));
+	db_begin_transaction(db);
+	CHECK(db_get_intvar(db, "testvar", 0) == 3);
+	db_commit_transaction(db);
+
+	/* Freeing stops the checkpointer too. */
+	db_set_profile(db, DB_PROFILE_WAL);
+	tal_free(db);
+	return true;
+}
+
+static bool test_query_plan(void)
+{
+	struct db *db = create_test_db(__func__);
+	const char **plan;
+	size_t i;
+	bool indexed = false;
+	CHECK(db);
+	db_migrate(db, NULL);
+
+	plan = db_query_plan(db, db,
+			     "SELECT id FROM channel_htlcs"
+			     " WHERE channel_id = ? AND direction = ?;");
+	CHECK(plan);
+	for (i = 0; i < tal_count(plan); i++)
+		if (strstr(plan[i], "channel_htlcs_channel_direction_hstate"))
+			indexed = true;
+	CHECK(indexed);
+
+	CHECK(!db_query_plan(db, db, "SELECT nosuchcolumn FROM outputs;"));
+	tal_free(db);
+	return true;
+}
+
 int main(void)
 {
 	bool ok = true;
@@ -117,6 +250,10 @@ int main(void)
 	ok &= test_empty_db_migrate();
 	ok &= test_vars();
 	ok &= test_primitives();
+	ok &= test_stmt_cache();
+	ok &= test_group_commit();
+	ok &= test_wal_profile();
+	ok &= test_query_plan();
 
 	return !ok;
 }
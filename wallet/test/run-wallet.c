@@ -530,6 +530,22 @@ static bool test_htlc_crud(const tal_t *ctx)
 	db_commit_transaction(w->db);
 	CHECK(!wallet_err);
 
+	/* Both loads went through the statement cache, so dev-queryplans
+	 * can show them. */
+	{
+		struct db_stmt_map_iter it;
+		struct db_stmt *s;
+		int loads = 0;
+
+		for (s = db_stmt_map_first(&w->db->stmts, &it);
+		     s;
+		     s = db_stmt_map_next(&w->db->stmts, &it))
+			if (strstr(s->query, "FROM channel_htlcs WHERE "
+				   "direction=? AND channel_id=?"))
+				loads++;
+		CHECK(loads == 2);
+	}
+
 	hin = htlc_in_map_get(htlcs_in, &in.key);
 	hout = htlc_out_map_get(htlcs_out, &out.key);
 
@@ -546,6 +562,71 @@ static bool test_htlc_crud(const tal_t *ctx)
 	return true;
 }
 
+static bool test_htlc_archive(const tal_t *ctx)
+{
+	struct htlc_in in1, in2, in3;
+	struct htlc_out out;
+	struct wallet_channel *chan = tal(ctx, struct wallet_channel);
+	struct peer *peer = talz(ctx, struct peer);
+	struct wallet *w = create_test_wallet(ctx);
+	struct htlc_stub *stubs;
+
+	CHECK(transaction_wrap(w->db,
+			       db_exec(__func__, w->db, "INSERT INTO channels (id) VALUES (1);")));
+	chan->id = 1;
+	chan->peer = peer;
+
+	memset(&in1, 0, sizeof(in1));
+	memset(&in2, 0, sizeof(in2));
+	memset(&in3, 0, sizeof(in3));
+	memset(&out, 0, sizeof(out));
+	in1.key.id = 1;
+	in2.key.id = 2;
+	in3.key.id = 3;
+	out.key.id = 1;
+	out.in = &in1;
+
+	CHECK(transaction_wrap(w->db, wallet_htlc_save_in(w, chan, &in1)));
+	CHECK(transaction_wrap(w->db, wallet_htlc_save_out(w, chan, &out)));
+	CHECK(transaction_wrap(w->db, wallet_htlc_save_in(w, chan, &in2)));
+	CHECK(transaction_wrap(w->db, wallet_htlc_save_in(w, chan, &in3)));
+
+	/* in1 is still the origin of a live HTLC, and in3 is the newest. */
+	db_begin_transaction(w->db);
+	wallet_htlc_update(w, in1.dbid, SENT_REMOVE_ACK_REVOCATION, NULL);
+	wallet_htlc_update(w, out.dbid, RCVD_REMOVE_COMMIT, NULL);
+	wallet_htlc_update(w, in2.dbid, SENT_REMOVE_ACK_REVOCATION, NULL);
+	wallet_htlc_update(w, in3.dbid, SENT_REMOVE_ACK_REVOCATION, NULL);
+	CHECK(wallet_htlcs_archive(w, 1000) == 1);
+	CHECK(wallet_htlcs_archive(w, 1000) == 0);
+
+	/* in1 waits until out has left channel_htlcs, or out would be
+	 * loaded on restart without its origin. */
+	wallet_htlc_update(w, out.dbid, RCVD_REMOVE_ACK_REVOCATION, NULL);
+	CHECK(wallet_htlcs_archive(w, 2000) == 1);
+	CHECK(wallet_htlcs_archive(w, 2000) == 1);
+	CHECK(wallet_htlcs_archive(w, 2000) == 0);
+
+	/* Onchain settlement still sees all of them. */
+	stubs = wallet_htlc_stubs(ctx, w, chan);
+	CHECK(tal_count(stubs) == 4);
+
+	/* Channel is open: history must stay. */
+	CHECK(wallet_htlc_history_compact(w, 3000) == 0);
+
+	db_exec(__func__, w->db, "UPDATE channels SET state=%d WHERE id=1;",
+		ONCHAIND_MUTUAL);
+	CHECK(wallet_htlc_history_compact(w, 1000) == 0);
+	CHECK(wallet_htlc_history_compact(w, 1500) == 1);
+	CHECK(wallet_htlc_history_compact(w, 3000) == 2);
+	stubs = wallet_htlc_stubs(ctx, w, chan);
+	CHECK(tal_count(stubs) == 1);
+	db_commit_transaction(w->db);
+	CHECK(!wallet_err);
+
+	return true;
+}
+
 static bool test_payment_crud(const tal_t *ctx)
 {
 	struct wallet_payment t, *t2;
@@ -588,6 +669,7 @@ int main(void)
 	ok &= test_channel_crud(tmpctx);
 	ok &= test_channel_config_crud(tmpctx);
 	ok &= test_htlc_crud(tmpctx);
+	ok &= test_htlc_archive(tmpctx);
 	ok &= test_payment_crud(tmpctx);
 
 	tal_free(tmpctx);
@@ -102,11 +102,19 @@ struct utxo **wallet_get_utxos(const tal_t *ctx, struct wallet *w, const enum ou
 	struct utxo **results;
 	int i;
 
-	sqlite3_stmt *stmt = db_prepare(
-		w->db, "SELECT prev_out_tx, prev_out_index, value, type, status, keyindex, "
-		"channel_id, peer_id, commitment_point "
-		"FROM outputs WHERE status=?1 OR ?1=255");
-	sqlite3_bind_int(stmt, 1, state);
+	sqlite3_stmt *stmt;
+
+	/* "status=?1 OR ?1=255" would stop sqlite using outputs_status. */
+	if (state == output_state_any)
+		stmt = db_prepare(w->db, "SELECT prev_out_tx, prev_out_index, value, type, status, keyindex, "
+				  "channel_id, peer_id, commitment_point "
+				  "FROM outputs");
+	else {
+		stmt = db_prepare(w->db, "SELECT prev_out_tx, prev_out_index, value, type, status, keyindex, "
+				  "channel_id, peer_id, commitment_point "
+				  "FROM outputs WHERE status=?");
+		sqlite3_bind_int(stmt, 1, state);
+	}
 
        	results = tal_arr(ctx, struct utxo*, 0);
 	for (i=0; sqlite3_step(stmt) == SQLITE_ROW; i++) {
@@ -114,7 +122,7 @@ struct utxo **wallet_get_utxos(const tal_t *ctx, struct wallet *w, const enum ou
 		results[i] = tal(results, struct utxo);
 		wallet_stmt2output(stmt, results[i]);
 	}
-	sqlite3_finalize(stmt);
+	db_stmt_done(w->db, stmt);
 
 	return results;
 }
@@ -382,13 +390,13 @@ bool wallet_shachain_load(struct wallet *wallet, u64 id,
 
 	err = sqlite3_step(stmt);
 	if (err != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
+		db_stmt_done(wallet->db, stmt);
 		return false;
 	}
 
 	chain->chain.min_index = sqlite3_column_int64(stmt, 0);
 	chain->chain.num_valid = sqlite3_column_int64(stmt, 1);
-	sqlite3_finalize(stmt);
+	db_stmt_done(wallet->db, stmt);
 
 	/* Load shachain known entries */
 	stmt = db_prepare(wallet->db, "SELECT idx, hash, pos FROM shachain_known WHERE shachain_id=?");
@@ -400,7 +408,7 @@ bool wallet_shachain_load(struct wallet *wallet, u64 id,
 		memcpy(&chain->chain.known[pos].hash, sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1));
 	}
 
-	sqlite3_finalize(stmt);
+	db_stmt_done(wallet->db, stmt);
 	return true;
 }
 
@@ -410,11 +418,12 @@ static bool wallet_peer_load(struct wallet *w, const u64 id, struct peer *peer)
 	const unsigned char *addrstr;
 
 	sqlite3_stmt *stmt =
-		db_query(__func__, w->db,
-			 "SELECT id, node_id, address FROM peers WHERE id=%"PRIu64";", id);
+		db_prepare(w->db,
+			   "SELECT id, node_id, address FROM peers WHERE id=?;");
 
-	if (!stmt || sqlite3_step(stmt) != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
+	sqlite3_bind_int64(stmt, 1, id);
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		db_stmt_done(w->db, stmt);
 		return false;
 	}
 	peer->dbid = sqlite3_column_int64(stmt, 0);
@@ -424,7 +433,7 @@ static bool wallet_peer_load(struct wallet *w, const u64 id, struct peer *peer)
 	if (addrstr)
 		parse_wireaddr((const char*)addrstr, &peer->addr, DEFAULT_PORT);
 
-	sqlite3_finalize(stmt);
+	db_stmt_done(w->db, stmt);
 
 	return ok;
 }
@@ -450,7 +459,7 @@ bool wallet_peer_by_nodeid(struct wallet *w, const struct pubkey *nodeid,
 		/* Make sure we mark this as a new peer */
 		peer->dbid = 0;
 	}
-	sqlite3_finalize(stmt);
+	db_stmt_done(w->db, stmt);
 	tal_free(tmpctx);
 	return ok;
 }
@@ -577,33 +586,36 @@ static bool wallet_stmt2channel(const tal_t *ctx, struct wallet *w, sqlite3_stmt
 }
 
 /* List of fields to retrieve from the channels DB table, in the order
- * that wallet_stmt2channel understands and will parse correctly */
-static const char *channel_fields =
-    "id, peer_id, short_channel_id, channel_config_local, "
-    "channel_config_remote, state, funder, channel_flags, "
-    "minimum_depth, "
-    "next_index_local, next_index_remote, "
-    "next_htlc_id, funding_tx_id, funding_tx_outnum, funding_satoshi, "
-    "funding_locked_remote, push_msatoshi, msatoshi_local, "
-    "fundingkey_remote, revocation_basepoint_remote, "
-    "payment_basepoint_remote, htlc_basepoint_remote, "
-    "delayed_payment_basepoint_remote, per_commit_remote, "
-    "old_per_commit_remote, local_feerate_per_kw, remote_feerate_per_kw, shachain_remote_id, "
-    "shutdown_scriptpubkey_remote, shutdown_keyidx_local, "
-    "last_sent_commit_state, last_sent_commit_id, "
-    "last_tx, last_sig";
+ * that wallet_stmt2channel understands and will parse correctly.  A literal,
+ * so queries using it can be prepared (and cached) as they are. */
+#define CHANNEL_FIELDS \
+    "id, peer_id, short_channel_id, channel_config_local, " \
+    "channel_config_remote, state, funder, channel_flags, " \
+    "minimum_depth, " \
+    "next_index_local, next_index_remote, " \
+    "next_htlc_id, funding_tx_id, funding_tx_outnum, funding_satoshi, " \
+    "funding_locked_remote, push_msatoshi, msatoshi_local, " \
+    "fundingkey_remote, revocation_basepoint_remote, " \
+    "payment_basepoint_remote, htlc_basepoint_remote, " \
+    "delayed_payment_basepoint_remote, per_commit_remote, " \
+    "old_per_commit_remote, local_feerate_per_kw, remote_feerate_per_kw, shachain_remote_id, " \
+    "shutdown_scriptpubkey_remote, shutdown_keyidx_local, " \
+    "last_sent_commit_state, last_sent_commit_id, " \
+    "last_tx, last_sig"
 
 bool wallet_channels_load_active(const tal_t *ctx, struct wallet *w, struct list_head *peers)
 {
 	bool ok = true;
 	/* Channels are active if they have reached at least the
 	 * opening state and they are not marked as complete */
-	sqlite3_stmt *stmt = db_query(
-	    __func__, w->db, "SELECT %s FROM channels WHERE state >= %d AND state != %d;",
-	    channel_fields, OPENINGD, CLOSINGD_COMPLETE);
-
+	sqlite3_stmt *stmt = db_prepare(w->db, "SELECT " CHANNEL_FIELDS
+					" FROM channels"
+					" WHERE state >= ? AND state != ?;");
 	int count = 0;
-	while (ok && stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+
+	sqlite3_bind_int(stmt, 1, OPENINGD);
+	sqlite3_bind_int(stmt, 2, CLOSINGD_COMPLETE);
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
 		struct wallet_channel *c = talz(w, struct wallet_channel);
 		ok &= wallet_stmt2channel(ctx, w, stmt, c);
 		list_add(peers, &c->peer->list);
@@ -612,7 +624,7 @@ bool wallet_channels_load_active(const tal_t *ctx, struct wallet *w, struct list
 		count++;
 	}
 	log_debug(w->log, "Loaded %d channels from DB", count);
-	sqlite3_finalize(stmt);
+	db_stmt_done(w->db, stmt);
 	return ok;
 }
 
@@ -631,7 +643,7 @@ u32 wallet_channels_first_blocknum(struct wallet *w)
 	else
 		first_blocknum = UINT32_MAX;
 
-	sqlite3_finalize(stmt);
+	db_stmt_done(w->db, stmt);
 	return first_blocknum;
 }
 
@@ -669,13 +681,15 @@ bool wallet_channel_config_load(struct wallet *w, const u64 id,
 {
 	bool ok = true;
 	int col = 1;
-	const char *query =
+	sqlite3_stmt *stmt = db_prepare(
+	    w->db,
 	    "SELECT id, dust_limit_satoshis, max_htlc_value_in_flight_msat, "
 	    "channel_reserve_satoshis, htlc_minimum_msat, to_self_delay, "
-	    "max_accepted_htlcs FROM channel_configs WHERE id=%" PRIu64 ";";
-	sqlite3_stmt *stmt = db_query(__func__, w->db, query, id);
-	if (!stmt || sqlite3_step(stmt) != SQLITE_ROW) {
-		sqlite3_finalize(stmt);
+	    "max_accepted_htlcs FROM channel_configs WHERE id=?;");
+
+	sqlite3_bind_int64(stmt, 1, id);
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		db_stmt_done(w->db, stmt);
 		return false;
 	}
 	cc->id = id;
@@ -686,7 +700,7 @@ bool wallet_channel_config_load(struct wallet *w, const u64 id,
 	cc->to_self_delay = sqlite3_column_int(stmt, col++);
 	cc->max_accepted_htlcs = sqlite3_column_int(stmt, col++);
 	assert(col == 7);
-	sqlite3_finalize(stmt);
+	db_stmt_done(w->db, stmt);
 	return ok;
 }
 
@@ -1061,40 +1075,34 @@ bool wallet_htlcs_load_for_channel(struct wallet *wallet,
 	int incount = 0, outcount = 0;
 
 	log_debug(wallet->log, "Loading HTLCs for channel %"PRIu64, chan->id);
-	sqlite3_stmt *stmt = db_query(
-	    __func__, wallet->db,
+	sqlite3_stmt *stmt = db_prepare(
+	    wallet->db,
 	    "SELECT id, channel_htlc_id, msatoshi, cltv_expiry, hstate, "
 	    "payment_hash, shared_secret, payment_key, routing_onion FROM channel_htlcs WHERE "
-	    "direction=%d AND channel_id=%" PRIu64 " AND hstate != %d",
-	    DIRECTION_INCOMING, chan->id, SENT_REMOVE_ACK_REVOCATION);
+	    "direction=? AND channel_id=? AND hstate != ?;");
+	sqlite3_bind_int(stmt, 1, DIRECTION_INCOMING);
+	sqlite3_bind_int64(stmt, 2, chan->id);
+	sqlite3_bind_int(stmt, 3, SENT_REMOVE_ACK_REVOCATION);
 
-	if (!stmt) {
-		log_broken(wallet->log, "Could not select htlc_ins");
-		return false;
-	}
-
-	while (ok && stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
 		struct htlc_in *in = tal(chan, struct htlc_in);
 		ok &= wallet_stmt2htlc_in(chan, stmt, in);
 		connect_htlc_in(htlcs_in, in);
 		ok &=  htlc_in_check(in, "wallet_htlcs_load") != NULL;
 		incount++;
 	}
-	sqlite3_finalize(stmt);
+	db_stmt_done(wallet->db, stmt);
 
-	stmt = db_query(
-	    __func__, wallet->db,
+	stmt = db_prepare(
+	    wallet->db,
 	    "SELECT id, channel_htlc_id, msatoshi, cltv_expiry, hstate, "
 	    "payment_hash, origin_htlc, payment_key, routing_onion FROM channel_htlcs WHERE "
-	    "direction=%d AND channel_id=%" PRIu64 " AND hstate != %d",
-	    DIRECTION_OUTGOING, chan->id, RCVD_REMOVE_ACK_REVOCATION);
-
-	if (!stmt) {
-		log_broken(wallet->log, "Could not select htlc_outs");
-		return false;
-	}
+	    "direction=? AND channel_id=? AND hstate != ?;");
+	sqlite3_bind_int(stmt, 1, DIRECTION_OUTGOING);
+	sqlite3_bind_int64(stmt, 2, chan->id);
+	sqlite3_bind_int(stmt, 3, RCVD_REMOVE_ACK_REVOCATION);
 
-	while (ok && stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+	while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
 		struct htlc_out *out = tal(chan, struct htlc_out);
 		ok &= wallet_stmt2htlc_out(chan, stmt, out);
 		connect_htlc_out(htlcs_out, out);
@@ -1102,7 +1110,7 @@ bool wallet_htlcs_load_for_channel(struct wallet *wallet,
 		 * dependencies in yet */
 		outcount++;
 	}
-	sqlite3_finalize(stmt);
+	db_stmt_done(wallet->db, stmt);
 	log_debug(wallet->log, "Restored %d incoming and %d outgoing HTLCS", incount, outcount);
 
 	return ok;
@@ -1147,6 +1155,81 @@ bool wallet_htlcs_reconnect(struct wallet *wallet,
 	return true;
 }
 
+/* Removal irrevocably committed on both sides, and not the origin of any
+ * outgoing HTLC still in channel_htlcs: on restart, every loaded htlc_out
+ * must find its htlc_in.  We never archive the newest HTLC: sqlite hands
+ * out one past the largest id left in channel_htlcs, and an id must not be
+ * reused while the history (or an origin_htlc) still refers to it. */
+#define HTLC_RESOLVED							\
+	"((h.direction = ?1 AND h.hstate = ?2)"				\
+	"  OR (h.direction = ?3 AND h.hstate = ?4))"			\
+	" AND h.id < (SELECT MAX(id) FROM channel_htlcs)"		\
+	" AND NOT EXISTS (SELECT 1 FROM channel_htlcs o"		\
+	"  WHERE o.origin_htlc = h.id)"
+
+static void bind_htlc_resolved(sqlite3_stmt *stmt)
+{
+	sqlite3_bind_int(stmt, 1, DIRECTION_INCOMING);
+	sqlite3_bind_int(stmt, 2, SENT_REMOVE_ACK_REVOCATION);
+	sqlite3_bind_int(stmt, 3, DIRECTION_OUTGOING);
+	sqlite3_bind_int(stmt, 4, RCVD_REMOVE_ACK_REVOCATION);
+}
+
+size_t wallet_htlcs_archive(struct wallet *wallet, u64 now)
+{
+	sqlite3_stmt *stmt;
+	size_t archived;
+
+	stmt = db_prepare(wallet->db,
+		"INSERT INTO channel_htlc_history ("
+		"  id, channel_id, channel_htlc_id, direction, origin_htlc,"
+		"  msatoshi, cltv_expiry, payment_hash, payment_key, hstate,"
+		"  resolved_time)"
+		" SELECT h.id, h.channel_id, h.channel_htlc_id, h.direction,"
+		"  h.origin_htlc, h.msatoshi, h.cltv_expiry, h.payment_hash,"
+		"  h.payment_key, h.hstate, ?5"
+		" FROM channel_htlcs h WHERE " HTLC_RESOLVED ";");
+	bind_htlc_resolved(stmt);
+	sqlite3_bind_int64(stmt, 5, now);
+	db_exec_prepared(wallet->db, stmt);
+	archived = sqlite3_changes(wallet->db->sql);
+	if (!archived)
+		return 0;
+
+	stmt = db_prepare(wallet->db,
+		"DELETE FROM channel_htlcs WHERE id IN"
+		" (SELECT h.id FROM channel_htlcs h WHERE " HTLC_RESOLVED ");");
+	bind_htlc_resolved(stmt);
+	db_exec_prepared(wallet->db, stmt);
+	assert(sqlite3_changes(wallet->db->sql) == archived);
+
+	log_debug(wallet->log, "Archived %zu resolved HTLCs", archived);
+	return archived;
+}
+
+size_t wallet_htlc_history_compact(struct wallet *wallet, u64 before)
+{
+	sqlite3_stmt *stmt;
+	size_t deleted;
+
+	/* ONCHAIND_CHEATED is missing on purpose: onchaind needs every
+	 * HTLC the revoked commitment might hold if it restarts. */
+	stmt = db_prepare(wallet->db,
+		"DELETE FROM channel_htlc_history"
+		" WHERE resolved_time < ? AND channel_id IN"
+		"  (SELECT id FROM channels WHERE state IN (?, ?, ?));");
+	sqlite3_bind_int64(stmt, 1, before);
+	sqlite3_bind_int(stmt, 2, ONCHAIND_THEIR_UNILATERAL);
+	sqlite3_bind_int(stmt, 3, ONCHAIND_OUR_UNILATERAL);
+	sqlite3_bind_int(stmt, 4, ONCHAIND_MUTUAL);
+	db_exec_prepared(wallet->db, stmt);
+	deleted = sqlite3_changes(wallet->db->sql);
+
+	if (deleted)
+		log_debug(wallet->log, "Forgot %zu archived HTLCs", deleted);
+	return deleted;
+}
+
 bool wallet_invoice_nextpaid(const tal_t *cxt,
 			     const struct wallet *wallet,
 			     u64 pay_index,
@@ -1170,7 +1253,7 @@ bool wallet_invoice_nextpaid(const tal_t *cxt,
 	res = sqlite3_step(stmt);
 	if (res != SQLITE_ROW) {
 		/* No paid invoice found. */
-		sqlite3_finalize(stmt);
+		db_stmt_done(wallet->db, stmt);
 		return false;
 	} else {
 		/* Paid invoice found, return data. */
@@ -1183,7 +1266,7 @@ bool wallet_invoice_nextpaid(const tal_t *cxt,
 
 		*outpay_index = sqlite3_column_int64(stmt, 3);
 
-		sqlite3_finalize(stmt);
+		db_stmt_done(wallet->db, stmt);
 		return true;
 	}
 }
@@ -1217,7 +1300,7 @@ static enum invoice_status wallet_invoice_db_state(
 	res = sqlite3_step(stmt);
 	assert(res == SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	db_stmt_done(db, stmt);
 	return (enum invoice_status) state;
 }
 
@@ -1311,21 +1394,17 @@ bool wallet_invoices_load(struct wallet *wallet, struct invoices *invs)
 {
 	struct invoice *i;
 	int count = 0;
-	sqlite3_stmt *stmt = db_query(__func__, wallet->db,
+	sqlite3_stmt *stmt = db_prepare(wallet->db,
 				"SELECT id, state, payment_key, payment_hash, "
 				"label, msatoshi, expiry_time, pay_index "
 				"FROM invoices;");
-	if (!stmt) {
-		log_broken(wallet->log, "Could not load invoices");
-		return false;
-	}
 
 	while (sqlite3_step(stmt) == SQLITE_ROW) {
 		i = tal(invs, struct invoice);
 		if (!wallet_stmt2invoice(stmt, i)) {
 			log_broken(wallet->log, "Error deserializing invoice");
 			tal_free(i);
-			sqlite3_finalize(stmt);
+			db_stmt_done(wallet->db, stmt);
 			return false;
 		}
 		invoice_add(invs, i);
@@ -1333,7 +1412,7 @@ bool wallet_invoices_load(struct wallet *wallet, struct invoices *invs)
 	}
 
 	log_debug(wallet->log, "Loaded %d invoices from DB", count);
-	sqlite3_finalize(stmt);
+	db_stmt_done(wallet->db, stmt);
 	return true;
 }
 
@@ -1352,7 +1431,10 @@ struct htlc_stub *wallet_htlc_stubs(const tal_t *ctx, struct wallet *wallet,
 	struct sha256 payment_hash;
 	sqlite3_stmt *stmt = db_prepare(wallet->db,
 		"SELECT channel_id, direction, cltv_expiry, payment_hash "
-		"FROM channel_htlcs WHERE channel_id = ?;");
+		"FROM channel_htlcs WHERE channel_id = ?1 "
+		"UNION ALL "
+		"SELECT channel_id, direction, cltv_expiry, payment_hash "
+		"FROM channel_htlc_history WHERE channel_id = ?1;");
 
 	sqlite3_bind_int64(stmt, 1, chan->id);
 
@@ -1371,7 +1453,7 @@ struct htlc_stub *wallet_htlc_stubs(const tal_t *ctx, struct wallet *wallet,
 		sqlite3_column_sha256(stmt, 3, &payment_hash);
 		ripemd160(&stubs[n].ripemd, payment_hash.u.u8, sizeof(payment_hash.u));
 	}
-	sqlite3_finalize(stmt);
+	db_stmt_done(wallet->db, stmt);
 	return stubs;
 }
 
@@ -1459,7 +1541,7 @@ wallet_payment_by_hash(const tal_t *ctx, struct wallet *wallet,
 	if (sqlite3_step(stmt) == SQLITE_ROW) {
 		payment = wallet_stmt2payment(ctx, stmt);
 	}
-	sqlite3_finalize(stmt);
+	db_stmt_done(wallet->db, stmt);
 	return payment;
 }
 
@@ -1496,7 +1578,7 @@ const struct wallet_payment **wallet_payment_list(const tal_t *ctx,
 		payments[i] = wallet_stmt2payment(payments, stmt);
 	}
 
-	sqlite3_finalize(stmt);
+	db_stmt_done(wallet->db, stmt);
 
 	return payments;
 }
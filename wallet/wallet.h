@@ -343,6 +343,37 @@ bool wallet_htlcs_reconnect(struct wallet *wallet,
 			    struct htlc_in_map *htlcs_in,
 			    struct htlc_out_map *htlcs_out);
 
+/**
+ * wallet_htlcs_archive -- Move resolved HTLCs into the history table
+ *
+ * An HTLC is resolved once its removal is irrevocably committed on
+ * both sides, and any outgoing HTLC it originated is resolved too.
+ * Resolved HTLCs are copied to `channel_htlc_history`, less their
+ * onion and shared secret, and deleted from `channel_htlcs`, so
+ * `wallet_htlcs_load_for_channel` only reads live HTLCs.
+ *
+ * @wallet: Wallet to archive in
+ * @now: Time to record as `resolved_time` (seconds since the epoch)
+ *
+ * Returns the number of HTLCs archived.
+ */
+size_t wallet_htlcs_archive(struct wallet *wallet, u64 now);
+
+/**
+ * wallet_htlc_history_compact -- Forget old HTLCs of closed channels
+ *
+ * Deletes archived HTLCs resolved before @before, but only for
+ * channels whose funding output was spent by a mutual close or a
+ * current commitment transaction: until then a revoked commitment
+ * could still need them in `wallet_htlc_stubs`.
+ *
+ * @wallet: Wallet to compact
+ * @before: Cutoff `resolved_time` (seconds since the epoch)
+ *
+ * Returns the number of HTLCs deleted.
+ */
+size_t wallet_htlc_history_compact(struct wallet *wallet, u64 before);
+
 /**
  * wallet_invoice_nextpaid -- Find a paid invoice.
  *
@@ -410,7 +441,7 @@ bool wallet_invoice_remove(struct wallet *wallet, struct invoice *inv);
  *
  * Load minimal necessary information about HTLCs for the on-chain
  * settlement. This returns a `tal_arr` allocated off of @ctx with the
- * necessary size to hold all HTLCs.
+ * necessary size to hold all HTLCs, including archived ones.
  *
  * @ctx: Allocation context for the return value
  * @wallet: Wallet to load from
@@ -1,6 +1,7 @@
 #include <bitcoin/address.h>
 #include <bitcoin/base58.h>
 #include <bitcoin/script.h>
+#include <ccan/asort/asort.h>
 #include <ccan/tal/str/str.h>
 #include <common/bech32.h>
 #include <common/key_derive.h>
@@ -437,3 +438,92 @@ static const struct json_command listfunds_command = {
     "List funds available to the daemon to open channels",
     "Returns an array of available outputs"};
 AUTODATA(json_command, &listfunds_command);
+
+static void json_getdbstats(struct command *cmd, const char *buffer,
+			    const jsmntok_t *params)
+{
+	struct json_result *response = new_json_result(cmd);
+	struct db *db = cmd->ld->wallet->db;
+	u64 runs, frames, failures;
+
+	json_object_start(response, NULL);
+	json_object_start(response, "statement_cache");
+	json_add_u64(response, "entries", db->num_stmts);
+	json_add_u64(response, "hits", db->stmt_cache_hits);
+	json_add_u64(response, "misses", db->stmt_cache_misses);
+	json_object_end(response);
+	if (db_checkpoint_stats(db, &runs, &frames, &failures)) {
+		json_object_start(response, "checkpoints");
+		json_add_u64(response, "runs", runs);
+		json_add_u64(response, "frames", frames);
+		json_add_u64(response, "failures", failures);
+		json_object_end(response);
+	}
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+static const struct json_command getdbstats_command = {
+	"getdbstats", json_getdbstats,
+	"Show how well the database's prepared statement cache works, and how background checkpoints are going",
+	"Returns a 'statement_cache' object with its {entries} {hits} {misses}, and with --db-profile=wal a 'checkpoints' object with the {runs} and {failures} of the checkpointer, and how many {frames} it copied."
+};
+AUTODATA(json_command, &getdbstats_command);
+
+#if DEVELOPER
+/* Most time first. */
+static int stmt_elapsed_cmp(struct db_stmt *const *a, struct db_stmt *const *b,
+			    void *unused)
+{
+	return time_less((*b)->elapsed, (*a)->elapsed)
+		- time_less((*a)->elapsed, (*b)->elapsed);
+}
+
+static void json_dev_queryplans(struct command *cmd,
+				const char *buffer UNNEEDED,
+				const jsmntok_t *params UNNEEDED)
+{
+	struct json_result *response = new_json_result(cmd);
+	struct db *db = cmd->ld->wallet->db;
+	struct db_stmt_map_iter it;
+	struct db_stmt *s, **stmts = tal_arr(cmd, struct db_stmt *, 0);
+	size_t i, n = 0;
+
+	for (s = db_stmt_map_first(&db->stmts, &it);
+	     s;
+	     s = db_stmt_map_next(&db->stmts, &it)) {
+		tal_resize(&stmts, n + 1);
+		stmts[n++] = s;
+	}
+	asort(stmts, n, stmt_elapsed_cmp, NULL);
+
+	json_object_start(response, NULL);
+	json_array_start(response, "queries");
+	for (i = 0; i < n; i++) {
+		const char **plan = db_query_plan(stmts, db, stmts[i]->query);
+		size_t j;
+
+		json_object_start(response, NULL);
+		json_add_string(response, "query", stmts[i]->query);
+		json_add_u64(response, "uses", stmts[i]->uses);
+		json_add_u64(response, "total_usec",
+			     time_to_usec(stmts[i]->elapsed));
+		json_array_start(response, "plan");
+		for (j = 0; j < tal_count(plan); j++)
+			json_add_string(response, NULL, plan[j]);
+		json_array_end(response);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_object_end(response);
+	tal_free(stmts);
+	command_success(cmd, response);
+}
+
+static const struct json_command dev_queryplans_command = {
+	"dev-queryplans", json_dev_queryplans,
+	"Show how sqlite runs each query in the statement cache, and how long they took",
+	"Returns a 'queries' array of {query} {uses} {total_usec} (time from prepare to done, summed over uses) and {plan} (the EXPLAIN QUERY PLAN steps), slowest first."
+};
+AUTODATA(json_command, &dev_queryplans_command);
+#endif /* DEVELOPER */